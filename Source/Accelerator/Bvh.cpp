@@ -1,11 +1,198 @@
 #include "Bvh.h"
+#include "LinearBuilder.h"
+#include "ClusterBuilder.h"
+#include "SplitBuilder.h"
+#include "PreSplitter.h"
+#include "BvhOptimizer.h"
 #include <algorithm>
 #include <numeric>
+#include <limits>
+#include <functional>
 namespace accel {
+    // Subtrees with at least this many primitives are built as separate tasks
+    static const int gParallelSubtreeThreshold = 1024;
+    // Ranges with at least this many primitives are binned, partitioned and reduced in chunks.
+    // Both values only depend on the primitive count so the tree is the same for any thread count
+    static const int gParallelRangeThreshold = 64 * 1024;
+    static const int gChunkSize = 16 * 1024;
+
+    struct Bin
+    {
+        BBox bound;
+        int count = 0;
+    };
+
+    static void reduceBounds(const Bvh::PrimRefs& primRefs, int startIdx, int endIdx, BBox& bound, BBox& centroidBound)
+    {
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            const float* minValues = primRefs.min[dim].data();
+            const float* maxValues = primRefs.max[dim].data();
+            float boundMin = bound.mMin[dim];
+            float boundMax = bound.mMax[dim];
+            float centroidMin = centroidBound.mMin[dim];
+            float centroidMax = centroidBound.mMax[dim];
+            for (int i = startIdx; i < endIdx; ++i)
+            {
+                float center = (minValues[i] + maxValues[i]) * 0.5f;
+                boundMin = glm::min(boundMin, minValues[i]);
+                boundMax = glm::max(boundMax, maxValues[i]);
+                centroidMin = glm::min(centroidMin, center);
+                centroidMax = glm::max(centroidMax, center);
+            }
+            bound.mMin[dim] = boundMin;
+            bound.mMax[dim] = boundMax;
+            centroidBound.mMin[dim] = centroidMin;
+            centroidBound.mMax[dim] = centroidMax;
+        }
+    }
+
+    static void computeBounds(ThreadPool* pool, const Bvh::PrimRefs& primRefs, int startIdx, int endIdx, BBox& bound, BBox& centroidBound)
+    {
+        int numPrims = endIdx - startIdx;
+        if (numPrims < gParallelRangeThreshold)
+        {
+            reduceBounds(primRefs, startIdx, endIdx, bound, centroidBound);
+            return;
+        }
+
+        int numChunks = (numPrims + gChunkSize - 1) / gChunkSize;
+        std::vector<BBox> chunkBounds(numChunks);
+        std::vector<BBox> chunkCentroidBounds(numChunks);
+        parallelFor(pool, 0, numChunks, 1, [&](int chunkBegin, int chunkEnd)
+        {
+            for (int c = chunkBegin; c < chunkEnd; ++c)
+            {
+                int end = std::min(startIdx + (c + 1) * gChunkSize, endIdx);
+                reduceBounds(primRefs, startIdx + c * gChunkSize, end, chunkBounds[c], chunkCentroidBounds[c]);
+            }
+        });
+
+        for (int c = 0; c < numChunks; ++c)
+        {
+            bound.grow(chunkBounds[c]);
+            centroidBound.grow(chunkCentroidBounds[c]);
+        }
+    }
+
+    static void swapPrims(Bvh::PrimRefs& primRefs, int i, int j)
+    {
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            std::swap(primRefs.min[dim][i], primRefs.min[dim][j]);
+            std::swap(primRefs.max[dim][i], primRefs.max[dim][j]);
+        }
+        std::swap(primRefs.idx[i], primRefs.idx[j]);
+    }
+
+    // Moves values[startIdx + i] to values[startIdx + dests[i]]
+    template<typename T>
+    static void scatterPrims(ThreadPool* pool, std::vector<T>& values, int startIdx, const std::vector<int>& dests)
+    {
+        int numPrims = dests.size();
+        std::vector<T> temp(numPrims);
+        parallelFor(pool, 0, numPrims, gChunkSize, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                temp[dests[i]] = values[startIdx + i];
+            }
+        });
+        parallelFor(pool, 0, numPrims, gChunkSize, [&](int begin, int end)
+        {
+            std::copy(temp.begin() + begin, temp.begin() + end, values.begin() + startIdx + begin);
+        });
+    }
+
+    // Stable chunked partition for large ranges, an in place swapping partition otherwise.
+    // pred is called with a primitive index
+    template<typename Predicate>
+    static int partitionPrims(ThreadPool* pool, Bvh::PrimRefs& primRefs, int startIdx, int endIdx, const Predicate& pred)
+    {
+        int numPrims = endIdx - startIdx;
+        if (numPrims < gParallelRangeThreshold)
+        {
+            int first = startIdx;
+            int last = endIdx;
+            while (true)
+            {
+                while (first < last && pred(first))
+                    first++;
+                while (first < last && !pred(last - 1))
+                    last--;
+                if (first >= last)
+                    return first;
+                swapPrims(primRefs, first++, --last);
+            }
+        }
+
+        int numChunks = (numPrims + gChunkSize - 1) / gChunkSize;
+        std::vector<uint8_t> flags(numPrims);
+        std::vector<int> leftCounts(numChunks);
+        parallelFor(pool, 0, numChunks, 1, [&](int chunkBegin, int chunkEnd)
+        {
+            for (int c = chunkBegin; c < chunkEnd; ++c)
+            {
+                int end = std::min((c + 1) * gChunkSize, numPrims);
+                int count = 0;
+                for (int i = c * gChunkSize; i < end; ++i)
+                {
+                    flags[i] = pred(startIdx + i) ? 1 : 0;
+                    count += flags[i];
+                }
+                leftCounts[c] = count;
+            }
+        });
+
+        std::vector<int> leftOffsets(numChunks);
+        std::vector<int> rightOffsets(numChunks);
+        int numLeft = std::accumulate(leftCounts.begin(), leftCounts.end(), 0);
+        int leftOffset = 0;
+        int rightOffset = numLeft;
+        for (int c = 0; c < numChunks; ++c)
+        {
+            int chunkPrims = std::min((c + 1) * gChunkSize, numPrims) - c * gChunkSize;
+            leftOffsets[c] = leftOffset;
+            rightOffsets[c] = rightOffset;
+            leftOffset += leftCounts[c];
+            rightOffset += chunkPrims - leftCounts[c];
+        }
+
+        // Destinations are computed once and applied to every array, so only one array
+        // worth of temporary memory is needed at a time
+        std::vector<int> dests(numPrims);
+        parallelFor(pool, 0, numChunks, 1, [&](int chunkBegin, int chunkEnd)
+        {
+            for (int c = chunkBegin; c < chunkEnd; ++c)
+            {
+                int left = leftOffsets[c];
+                int right = rightOffsets[c];
+                int end = std::min((c + 1) * gChunkSize, numPrims);
+                for (int i = c * gChunkSize; i < end; ++i)
+                {
+                    dests[i] = flags[i] ? left++ : right++;
+                }
+            }
+        });
+
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            scatterPrims(pool, primRefs.min[dim], startIdx, dests);
+            scatterPrims(pool, primRefs.max[dim], startIdx, dests);
+        }
+        scatterPrims(pool, primRefs.idx, startIdx, dests);
+        return startIdx + numLeft;
+    }
+
     Bvh::Bvh()
     {
     }
 
+    Bvh::Bvh(const BuildSettings& settings)
+        : mSettings(settings)
+    {
+    }
+
     Bvh::~Bvh()
     {
     }
@@ -16,101 +203,409 @@ namespace accel {
         mNodes.resize(maxNum);
     }
 
-    Bvh::Node* Bvh::allocateNode()
+    int Bvh::allocateNode()
     {
-        return &mNodes[mNodeCount++];
+        return mNodeCount++;
     }
 
     void Bvh::build(BBox *bounds, int numBound)
     {
+        mBound = BBox();
+        mHeight = 0;
+        mPackedIndices.clear();
+        mRoot = -1;
+        if (numBound <= 0)
+            return;
+
         for (int i = 0; i < numBound; ++i)
         {
             mBound.grow(bounds[i]);
         }
 
         buildImpl(bounds, numBound);
+        finalizeNodes();
+
+        mOptimizeReport = OptimizeReport();
+        if (mSettings.optimizeIterations > 0)
+        {
+            BvhOptimizer optimizer(this, mThreadPool);
+            mOptimizeReport = optimizer.optimize(mSettings.optimizeIterations, mSettings.treeletSize);
+        }
+    }
+
+    void Bvh::buildTriangles(const glm::vec3* vertices, int numTris, const uint32_t* indices)
+    {
+        std::vector<BBox> bounds;
+        if (mSettings.preSplitBudget > 0.0f && mSettings.mode != BuildMode::Spatial)
+        {
+            std::vector<uint32_t> triIndices;
+            PreSplitter splitter(mThreadPool);
+            splitter.split(vertices, indices, numTris, mSettings.preSplitBudget, bounds, triIndices);
+            build(bounds.data(), bounds.size());
+            remapReferences(triIndices);
+            return;
+        }
+
+        bounds.resize(numTris);
+        for (int i = 0; i < numTris; ++i)
+        {
+            glm::vec3 triangle[3];
+            loadTriangle(vertices, indices, i, triangle);
+            bounds[i].grow(triangle[0]);
+            bounds[i].grow(triangle[1]);
+            bounds[i].grow(triangle[2]);
+        }
+
+        mTriangleVertices = vertices;
+        mTriangleIndices = indices;
+        build(bounds.data(), numTris);
+        mTriangleVertices = nullptr;
+        mTriangleIndices = nullptr;
+    }
+
+    void Bvh::remapReferences(const std::vector<uint32_t>& triIndices)
+    {
+        if (mRoot < 0)
+            return;
+
+        // Pieces of one triangle that ended up in the same leaf are tested once
+        std::vector<uint32_t> packedIndices;
+        packedIndices.reserve(mPackedIndices.size());
+        for (uint32_t i = 0; i < mNodeCount; ++i)
+        {
+            Node& node = mNodes[i];
+            if (!node.isLeaf())
+                continue;
+
+            int startIdx = packedIndices.size();
+            for (int j = node.startIdx(); j < node.startIdx() + node.numPrims(); ++j)
+            {
+                uint32_t tri = triIndices[mPackedIndices[j]];
+                if (std::find(packedIndices.begin() + startIdx, packedIndices.end(), tri) == packedIndices.end())
+                    packedIndices.push_back(tri);
+            }
+            node.setLeaf(startIdx, packedIndices.size() - startIdx);
+        }
+        mPackedIndices.swap(packedIndices);
+    }
+
+    void Bvh::getBoundCut(int depth, std::vector<BBox>& bounds)
+    {
+        bounds.clear();
+        if (mRoot < 0)
+            return;
+
+        std::function<void(int, int)> visit = [&](int nodeIdx, int level)
+        {
+            const Node& node = mNodes[nodeIdx];
+            if (node.isLeaf() || level >= depth)
+            {
+                bounds.push_back(node.bound);
+                return;
+            }
+            visit(node.lc, level + 1);
+            visit(node.rc, level + 1);
+        };
+        visit(mRoot, 0);
     }
 
     void Bvh::buildImpl(BBox *bounds, int numBound)
     {
+        if (mSettings.mode == BuildMode::Spatial && mTriangleVertices)
+        {
+            SplitBuilder builder(this, mTriangleVertices, mTriangleIndices);
+            builder.build(bounds, numBound);
+            return;
+        }
+
+        if (mSettings.mode == BuildMode::Linear)
+        {
+            LinearBuilder builder(this, mThreadPool);
+            builder.build(bounds, numBound);
+            return;
+        }
+
+        if (mSettings.mode == BuildMode::Cluster)
+        {
+            ClusterBuilder builder(this, mThreadPool);
+            builder.build(bounds, numBound);
+            return;
+        }
+
         initNodeAllocator(2 * numBound - 1);
-        std::vector<PrimRef> primRefs(numBound);
+        PrimRefs primRefs;
+        primRefs.resize(numBound);
+        auto initRange = [&](int begin, int end, BBox& centroidBound)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                for (int dim = 0; dim < 3; ++dim)
+                {
+                    primRefs.min[dim][i] = bounds[i].mMin[dim];
+                    primRefs.max[dim][i] = bounds[i].mMax[dim];
+                }
+                primRefs.idx[i] = i;
+            }
+            BBox bound;
+            reduceBounds(primRefs, begin, end, bound, centroidBound);
+        };
 
         BBox centroidBound;
-        for (int i = 0; i < numBound; ++i)
+        if (numBound < gParallelRangeThreshold)
         {
-            primRefs[i] = PrimRef{ bounds[i], bounds[i].center(), i };
-            glm::vec3 c = bounds[i].center();
-            centroidBound.grow(c);
+            initRange(0, numBound, centroidBound);
+        }
+        else
+        {
+            int numChunks = (numBound + gChunkSize - 1) / gChunkSize;
+            std::vector<BBox> chunkCentroidBounds(numChunks);
+            parallelFor(mThreadPool, 0, numChunks, 1, [&](int chunkBegin, int chunkEnd)
+            {
+                for (int c = chunkBegin; c < chunkEnd; ++c)
+                {
+                    initRange(c * gChunkSize, std::min((c + 1) * gChunkSize, numBound), chunkCentroidBounds[c]);
+                }
+            });
+            for (int c = 0; c < numChunks; ++c)
+            {
+                centroidBound.grow(chunkCentroidBounds[c]);
+            }
         }
 
         SplitRequest init = { 0, numBound, mBound, centroidBound, 0 };
         mRoot = buildNode(init, primRefs);
+
+        // Leaves reference their primitive range directly
+        mPackedIndices.swap(primRefs.idx);
     }
 
-    Bvh::Node* Bvh::buildNode(SplitRequest &req, std::vector<PrimRef>& primRefs)
+    int Bvh::buildNode(SplitRequest &req, PrimRefs& primRefs)
     {
-        mHeight = glm::max(mHeight, req.level);
-
-        Node* node = allocateNode();
-        node->bound = req.bound;
+        int nodeIdx = allocateNode();
+        mNodes[nodeIdx].bound = req.bound;
 
         int numPrims = req.endIdx - req.startIdx;
         if (numPrims < 2)
         {
-            node->type = NodeType::Leaf;
-            node->startIdx = mPackedIndices.size();
-            node->numPrims = numPrims;
-            for (int i = req.startIdx; i < req.endIdx; ++i)
-            {
-                mPackedIndices.push_back(primRefs[i].idx);
-            }
-            return node;
+            return makeLeaf(nodeIdx, req);
+        }
+
+        int midIdx = mSettings.mode == BuildMode::Middle ? findMiddleSplit(req, primRefs) : findSAHSplit(req, primRefs);
+        if (midIdx < 0)
+        {
+            if (numPrims <= mSettings.maxLeafPrims)
+                return makeLeaf(nodeIdx, req);
+            midIdx = req.startIdx + numPrims / 2;
+        }
+
+        // Degenerate partition, fall back to splitting the range in half
+        if (midIdx == req.startIdx || midIdx == req.endIdx)
+        {
+            midIdx = req.startIdx + numPrims / 2;
+        }
+
+        BBox leftBound, rightBound, leftCentroidBound, rightCentroidBound;
+        computeBounds(mThreadPool, primRefs, req.startIdx, midIdx, leftBound, leftCentroidBound);
+        computeBounds(mThreadPool, primRefs, midIdx, req.endIdx, rightBound, rightCentroidBound);
+
+        // Left request
+        SplitRequest leftrequest = { req.startIdx, midIdx, leftBound, leftCentroidBound, req.level + 1 };
+        // Right request
+        SplitRequest rightrequest = { midIdx, req.endIdx, rightBound, rightCentroidBound, req.level + 1 };
+
+        int lc, rc;
+        if (mThreadPool && numPrims >= gParallelSubtreeThreshold)
+        {
+            TaskGroup group(mThreadPool);
+            group.run([&]() { lc = buildNode(leftrequest, primRefs); });
+            rc = buildNode(rightrequest, primRefs);
+            group.wait();
         }
         else
         {
-            int dim = req.centroidBound.maximumExtent();
-            int mid = (req.endIdx - req.startIdx) / 2;
-            if (req.centroidBound.mMax[dim] == req.centroidBound.mMin[dim])
+            lc = buildNode(leftrequest, primRefs);
+            rc = buildNode(rightrequest, primRefs);
+        }
+        mNodes[nodeIdx].setInternal(lc, rc);
+        return nodeIdx;
+    }
+
+    int Bvh::makeLeaf(int nodeIdx, SplitRequest& req)
+    {
+        mNodes[nodeIdx].setLeaf(req.startIdx, req.endIdx - req.startIdx);
+        return nodeIdx;
+    }
+
+    int Bvh::findMiddleSplit(SplitRequest& req, PrimRefs& primRefs)
+    {
+        int dim = req.centroidBound.maximumExtent();
+        if (req.centroidBound.mMax[dim] == req.centroidBound.mMin[dim])
+        {
+            return -1;
+        }
+
+        float midValue = (req.centroidBound.mMax[dim] + req.centroidBound.mMin[dim]) * 0.5f;
+        const float* minValues = primRefs.min[dim].data();
+        const float* maxValues = primRefs.max[dim].data();
+        return partitionPrims(mThreadPool, primRefs, req.startIdx, req.endIdx, [=](int i)
+        {
+            return (minValues[i] + maxValues[i]) * 0.5f < midValue;
+        });
+    }
+
+    int Bvh::findSAHSplit(SplitRequest& req, PrimRefs& primRefs)
+    {
+        int numPrims = req.endIdx - req.startIdx;
+        int numBins = glm::max(mSettings.numBins, 2);
+        glm::vec3 centroidMin = req.centroidBound.mMin;
+        glm::vec3 centroidExtent = req.centroidBound.diagonal();
+        glm::vec3 scale;
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            scale[dim] = centroidExtent[dim] > 0.0f ? numBins / centroidExtent[dim] : 0.0f;
+        }
+
+        float parentArea = req.bound.surfaceArea();
+        float invParentArea = parentArea > 0.0f ? 1.0f / parentArea : 0.0f;
+
+        // Bin all three axes in one pass, bins[dim * numBins + i]
+        auto binRange = [&](int startIdx, int endIdx, std::vector<Bin>& bins)
+        {
+            for (int i = startIdx; i < endIdx; ++i)
             {
-                node->type = NodeType::Leaf;
-                node->startIdx = mPackedIndices.size();
-                node->numPrims = numPrims;
-                for (int i = req.startIdx; i < req.endIdx; ++i)
+                BBox bound;
+                bound.mMin = glm::vec3(primRefs.min[0][i], primRefs.min[1][i], primRefs.min[2][i]);
+                bound.mMax = glm::vec3(primRefs.max[0][i], primRefs.max[1][i], primRefs.max[2][i]);
+                for (int dim = 0; dim < 3; ++dim)
                 {
-                    mPackedIndices.push_back(primRefs[i].idx);
+                    float center = (bound.mMin[dim] + bound.mMax[dim]) * 0.5f;
+                    int bin = glm::min((int)((center - centroidMin[dim]) * scale[dim]), numBins - 1);
+                    bins[dim * numBins + bin].count++;
+                    bins[dim * numBins + bin].bound.grow(bound);
                 }
-                return node;
             }
-            float midValue = (req.centroidBound.mMax[dim] + req.centroidBound.mMin[dim]) * 0.5f;
-            PrimRef* midPtr = std::partition(&primRefs[req.startIdx], &primRefs[req.endIdx - 1] + 1, [midValue, dim](const PrimRef& info)
+        };
+
+        std::vector<Bin> bins(3 * numBins);
+        if (numPrims < gParallelRangeThreshold)
+        {
+            binRange(req.startIdx, req.endIdx, bins);
+        }
+        else
+        {
+            int numChunks = (numPrims + gChunkSize - 1) / gChunkSize;
+            std::vector<std::vector<Bin>> chunkBins(numChunks, std::vector<Bin>(3 * numBins));
+            parallelFor(mThreadPool, 0, numChunks, 1, [&](int chunkBegin, int chunkEnd)
             {
-                return info.center[dim] < midValue;
+                for (int c = chunkBegin; c < chunkEnd; ++c)
+                {
+                    binRange(req.startIdx + c * gChunkSize, std::min(req.startIdx + (c + 1) * gChunkSize, req.endIdx), chunkBins[c]);
+                }
             });
-            int midIdx = midPtr - &primRefs[0];
+            for (int c = 0; c < numChunks; ++c)
+            {
+                for (int i = 0; i < 3 * numBins; ++i)
+                {
+                    bins[i].count += chunkBins[c][i].count;
+                    bins[i].bound.grow(chunkBins[c][i].bound);
+                }
+            }
+        }
+
+        std::vector<float> rightAreas(numBins);
+        std::vector<int> rightCounts(numBins);
+        float bestCost = std::numeric_limits<float>::max();
+        int bestDim = -1;
+        int bestBin = -1;
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            if (centroidExtent[dim] <= 0.0f)
+                continue;
+
+            Bin* dimBins = &bins[dim * numBins];
 
-            BBox leftBound, rightBound, leftCentroidBound, rightCentroidBound;
-            for (int i = req.startIdx; i < midIdx; ++i)
+            // Sweep from the right, rightAreas[i] covers bins [i, numBins)
+            BBox rightBound;
+            int rightCount = 0;
+            for (int i = numBins - 1; i > 0; --i)
             {
-                leftBound.grow(primRefs[i].bound);
-                leftCentroidBound.grow(primRefs[i].center);
+                rightBound.grow(dimBins[i].bound);
+                rightCount += dimBins[i].count;
+                rightAreas[i] = rightCount > 0 ? rightBound.surfaceArea() : 0.0f;
+                rightCounts[i] = rightCount;
             }
 
-            for (int i = midIdx; i < req.endIdx; ++i)
+            // Sweep from the left, a split at bin i puts bins [0, i) on the left
+            BBox leftBound;
+            int leftCount = 0;
+            for (int i = 1; i < numBins; ++i)
             {
-                rightBound.grow(primRefs[i].bound);
-                rightCentroidBound.grow(primRefs[i].center);
+                leftBound.grow(dimBins[i - 1].bound);
+                leftCount += dimBins[i - 1].count;
+                if (leftCount == 0 || rightCounts[i] == 0)
+                    continue;
+
+                float cost = mSettings.traversalCost + mSettings.intersectionCost * invParentArea *
+                        (leftBound.surfaceArea() * leftCount + rightAreas[i] * rightCounts[i]);
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestDim = dim;
+                    bestBin = i;
+                }
             }
+        }
 
-            // Left request
-            SplitRequest leftrequest = { req.startIdx, midIdx, leftBound, leftCentroidBound, req.level + 1 };
-            // Right request
-            SplitRequest rightrequest = { midIdx, req.endIdx, rightBound, rightCentroidBound, req.level + 1 };
+        float leafCost = mSettings.intersectionCost * numPrims;
+        if (numPrims <= mSettings.maxLeafPrims && (bestDim < 0 || leafCost <= bestCost))
+        {
+            return -1;
+        }
 
-            node->type = NodeType::Internal;
-            node->lc = buildNode(leftrequest, primRefs);
-            node->rc = buildNode(rightrequest, primRefs);
+        // All centroids coincide, split the range in half
+        if (bestDim < 0)
+        {
+            return req.startIdx + numPrims / 2;
         }
-        return node;
+
+        int dim = bestDim;
+        int splitBin = bestBin;
+        float minValue = centroidMin[dim];
+        float dimScale = scale[dim];
+        const float* minValues = primRefs.min[dim].data();
+        const float* maxValues = primRefs.max[dim].data();
+        return partitionPrims(mThreadPool, primRefs, req.startIdx, req.endIdx, [=](int i)
+        {
+            int bin = glm::min((int)(((minValues[i] + maxValues[i]) * 0.5f - minValue) * dimScale), numBins - 1);
+            return bin < splitBin;
+        });
+    }
+
+    void Bvh::finalizeNodes()
+    {
+        if (mRoot < 0)
+            return;
+
+        // Parallel builds allocate nodes in any order, lay them out in depth first order
+        // so the node array is identical for every thread count
+        std::vector<Node> nodes(mNodeCount);
+        uint32_t count = 0;
+        mHeight = 0;
+        std::function<int(int, int)> copyNode = [&](int src, int level) -> int
+        {
+            mHeight = glm::max(mHeight, level);
+            int dst = count++;
+            nodes[dst] = mNodes[src];
+            if (!mNodes[src].isLeaf())
+            {
+                int lc = copyNode(mNodes[src].lc, level + 1);
+                int rc = copyNode(mNodes[src].rc, level + 1);
+                nodes[dst].setInternal(lc, rc);
+            }
+            return dst;
+        };
+        mRoot = copyNode(mRoot, 0);
+        mNodes.swap(nodes);
+        mNodeCount = count;
     }
-}
\ No newline at end of file
+}
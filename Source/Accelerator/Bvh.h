@@ -1,43 +1,113 @@
 #ifndef STAR_BVH_H
 #define STAR_BVH_H
 #include <vector>
+#include <atomic>
 #include "BBox.h"
+#include "ThreadPool.h"
 
 namespace accel {
+    // Copies the corners of triangle tri. indices holds three vertex indices per triangle, or
+    // is null for a triangle soup with three vertices per triangle
+    inline void loadTriangle(const glm::vec3* vertices, const uint32_t* indices, int tri, glm::vec3* triangle)
+    {
+        for (int i = 0; i < 3; ++i)
+            triangle[i] = vertices[indices ? indices[tri * 3 + i] : tri * 3 + i];
+    }
+
     class Bvh
     {
     public:
-        enum class NodeType
+        enum class BuildMode
+        {
+            // Split at the spatial middle of the centroid bounds, one primitive per leaf
+            Middle,
+            // Binned surface area heuristic
+            SAH,
+            // Morton code ordered linear BVH
+            Linear,
+            // SAH with spatial splits, needs triangles and falls back to SAH for plain bounds
+            Spatial,
+            // Agglomerative clustering of Morton sorted primitives (PLOC)
+            Cluster
+        };
+
+        struct BuildSettings
+        {
+            BuildMode mode = BuildMode::SAH;
+            // Number of bins per axis used by the SAH builder
+            int numBins = 16;
+            // Cost of visiting an internal node relative to one primitive test
+            float traversalCost = 1.0f;
+            // Cost of testing one primitive
+            float intersectionCost = 1.0f;
+            // Nodes with more primitives than this are always split if possible
+            int maxLeafPrims = 4;
+            // Linear builder Morton code length, 30 or 63 bits
+            int mortonBits = 30;
+            // Linear builder builds the levels above treelets sharing the top treeletBits with SAH
+            bool linearTreelets = false;
+            int treeletBits = 12;
+            // Clustering builder looks for nearest neighbours this many clusters to each side
+            int clusterRadius = 16;
+            // Spatial split bins per axis
+            int numSpatialBins = 32;
+            // Spatial splits are tried when object split children overlap more than this fraction of the root area
+            float splitAlpha = 1e-5f;
+            // Extra references spatial splits may create, as a fraction of the triangle count
+            float splitBudget = 0.3f;
+            // Extra references pre-splitting of large, badly aligned triangles creates before a
+            // triangle build, as a fraction of the triangle count. Zero disables it, the spatial
+            // builder splits on its own and ignores it
+            float preSplitBudget = 0.0f;
+            // Treelet restructuring passes run after the build, zero disables it
+            int optimizeIterations = 0;
+            int treeletSize = 7;
+        };
+
+        struct OptimizeReport
         {
-            Internal,
-            Leaf
+            float costBefore = 0.0f;
+            float costAfter = 0.0f;
+            int numRestructured = 0;
         };
 
+        // 32 bytes and free of pointers, so a tree can be copied or stored as it is. Internal
+        // nodes hold the indices of their children in mNodes, leaves their range of mPackedIndices
+        // with the count stored as ~numPrims, which keeps rc of a leaf negative
         struct Node
         {
             BBox bound;
-            NodeType type;
-            union
-            {
-                struct
-                {
-                    Node* lc;
-                    Node* rc;
-                };
+            int32_t lc;
+            int32_t rc;
 
-                struct
-                {
-                    int startIdx;
-                    int numPrims;
-                };
-            };
+            bool isLeaf() const { return rc < 0; }
+            int startIdx() const { return lc; }
+            int numPrims() const { return ~rc; }
+            void setLeaf(int first, int count) { lc = first; rc = ~count; }
+            void setInternal(int left, int right) { lc = left; rc = right; }
         };
+        static_assert(sizeof(Node) == 32, "Bvh::Node is expected to be 32 bytes");
 
-        struct PrimRef
+        // Primitive bounds of the binned builders, one array per bound component so that
+        // binning, partitioning and bound reductions stream over plain floats. The centroid
+        // on an axis is (min + max) * 0.5 and is not stored
+        struct PrimRefs
         {
-            BBox bound;
-            glm::vec3 center;
-            int idx;
+            std::vector<float> min[3];
+            std::vector<float> max[3];
+            std::vector<uint32_t> idx;
+
+            void resize(int n)
+            {
+                for (int dim = 0; dim < 3; ++dim)
+                {
+                    min[dim].resize(n);
+                    max[dim].resize(n);
+                }
+                idx.resize(n);
+            }
+
+            float center(int i, int dim) const { return (min[dim][i] + max[dim][i]) * 0.5f; }
         };
 
         struct SplitRequest
@@ -50,21 +120,57 @@ namespace accel {
         };
     public:
         Bvh();
+        Bvh(const BuildSettings& settings);
         ~Bvh();
+        void setBuildSettings(const BuildSettings& settings) { mSettings = settings; }
+        const BuildSettings& getBuildSettings() { return mSettings; }
+        // Shares an external pool between builds, the pool must outlive them. Without a pool
+        // the build runs on the calling thread
+        void setThreadPool(ThreadPool* pool) { mThreadPool = pool; }
         void build(BBox* bounds, int numBound);
+        // Indexed triangles, indices holds three vertex indices per triangle. Without indices
+        // vertices is a triangle soup with three vertices per triangle. Packed indices are
+        // triangle indices, a pre-split triangle may be referenced by several leaves
+        void buildTriangles(const glm::vec3* vertices, int numTris, const uint32_t* indices = nullptr);
         BBox getBound() { return mBound; }
+        // Boxes of the nodes at depth and of the leaves above it, together they cover every
+        // primitive. Transforming them bounds an instance tighter than the root box alone
+        void getBoundCut(int depth, std::vector<BBox>& bounds);
+        // Depth of the deepest leaf, the root is at depth 0
+        int getHeight() { return mHeight; }
+        int getRoot() { return mRoot; }
+        const Node& getNode(int nodeIdx) { return mNodes[nodeIdx]; }
+        const OptimizeReport& getOptimizeReport() { return mOptimizeReport; }
         int getNumIndices() { return  mPackedIndices.size(); }
         uint32_t* getIndices() { return &mPackedIndices[0]; }
     protected:
         virtual void initNodeAllocator(uint32_t maxNum);
-        virtual Node* allocateNode();
+        virtual int allocateNode();
         virtual void buildImpl(BBox* bounds, int numBound);
-        Node* buildNode(SplitRequest& req, std::vector<PrimRef>& primRefs);
+        int buildNode(SplitRequest& req, PrimRefs& primRefs);
+        int makeLeaf(int nodeIdx, SplitRequest& req);
+        int findMiddleSplit(SplitRequest& req, PrimRefs& primRefs);
+        int findSAHSplit(SplitRequest& req, PrimRefs& primRefs);
+        void finalizeNodes();
+        // Turns reference indices into triangle indices after a pre-split build
+        void remapReferences(const std::vector<uint32_t>& triIndices);
     protected:
         friend class BvhTranslator;
-        Node* mRoot;
-        uint32_t mNodeCount;
-        int mHeight;
+        friend class LinearBuilder;
+        friend class ClusterBuilder;
+        friend class SplitBuilder;
+        friend class BvhOptimizer;
+        friend class BvhAnalyzer;
+        friend class BvhCache;
+        BuildSettings mSettings;
+        OptimizeReport mOptimizeReport;
+        ThreadPool* mThreadPool = nullptr;
+        const glm::vec3* mTriangleVertices = nullptr;
+        const uint32_t* mTriangleIndices = nullptr;
+        // Index of the root in mNodes, -1 for an empty tree
+        int mRoot = -1;
+        std::atomic<uint32_t> mNodeCount{ 0 };
+        int mHeight = 0;
         BBox mBound;
         std::vector<uint32_t> mIndices;
         std::vector<uint32_t> mPackedIndices;
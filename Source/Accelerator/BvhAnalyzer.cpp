@@ -0,0 +1,218 @@
+#include "BvhAnalyzer.h"
+#include "BvhOptimizer.h"
+#include <functional>
+
+namespace accel {
+    // Triangles clipped to a box have at most 9 vertices
+    static const int gMaxClipVertices = 9;
+
+    static void addHistogram(std::vector<int>& histogram, int value)
+    {
+        if (value >= histogram.size())
+            histogram.resize(value + 1, 0);
+        histogram[value]++;
+    }
+
+    static float triangleArea(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2)
+    {
+        return glm::length(glm::cross(v1 - v0, v2 - v0)) * 0.5f;
+    }
+
+    // Area of the part of a triangle inside a box, Sutherland-Hodgman against the six slabs
+    static float clippedArea(const glm::vec3* triangle, const BBox& box)
+    {
+        glm::vec3 polygon[gMaxClipVertices + 6];
+        glm::vec3 clipped[gMaxClipVertices + 6];
+        int numVertices = 3;
+        for (int i = 0; i < 3; ++i)
+            polygon[i] = triangle[i];
+
+        for (int plane = 0; plane < 6 && numVertices > 0; ++plane)
+        {
+            int axis = plane >> 1;
+            float sign = (plane & 1) ? -1.0f : 1.0f;
+            float offset = (plane & 1) ? box.mMax[axis] : box.mMin[axis];
+            int numClipped = 0;
+            for (int i = 0; i < numVertices; ++i)
+            {
+                const glm::vec3& a = polygon[i];
+                const glm::vec3& b = polygon[(i + 1) % numVertices];
+                float da = (a[axis] - offset) * sign;
+                float db = (b[axis] - offset) * sign;
+                if (da >= 0.0f)
+                    clipped[numClipped++] = a;
+                if ((da >= 0.0f) != (db >= 0.0f))
+                    clipped[numClipped++] = a + (b - a) * (da / (da - db));
+            }
+            numVertices = numClipped;
+            for (int i = 0; i < numVertices; ++i)
+                polygon[i] = clipped[i];
+        }
+
+        float area = 0.0f;
+        for (int i = 1; i + 1 < numVertices; ++i)
+            area += triangleArea(polygon[0], polygon[i], polygon[i + 1]);
+        return area;
+    }
+
+    BvhMetrics BvhAnalyzer::analyze(Bvh* bvh, const glm::vec3* vertices, const uint32_t* indices, ThreadPool* pool)
+    {
+        BvhMetrics metrics;
+        if (bvh->mRoot < 0)
+            return metrics;
+
+        std::function<void(int, int)> visit = [&](int nodeIdx, int depth)
+        {
+            const Bvh::Node& node = bvh->mNodes[nodeIdx];
+            metrics.numNodes++;
+            if (node.isLeaf())
+            {
+                metrics.numLeaves++;
+                metrics.numPrimRefs += node.numPrims();
+                addHistogram(metrics.leafSizeHistogram, node.numPrims());
+                addHistogram(metrics.depthHistogram, depth);
+                return;
+            }
+            visit(node.lc, depth + 1);
+            visit(node.rc, depth + 1);
+        };
+        visit(bvh->mRoot, 0);
+
+        metrics.sahCost = BvhOptimizer::computeCost(bvh);
+        metrics.height = bvh->getHeight();
+        metrics.memoryBytes = bvh->mNodeCount * sizeof(Bvh::Node) + bvh->mPackedIndices.size() * sizeof(uint32_t);
+        if (vertices)
+            metrics.epo = computeEPO(bvh, vertices, indices, pool);
+        return metrics;
+    }
+
+    BvhMetrics BvhAnalyzer::analyze(BvhTranslator* translator, int rootIndex, float traversalCost, float intersectionCost)
+    {
+        BvhMetrics metrics;
+        const std::vector<BvhTranslator::Node>& nodes = translator->mNodes;
+        auto area = [](const BvhTranslator::Node& node)
+        {
+            glm::vec3 d = node.bboxMax - node.bboxMin;
+            return (d.x * d.y + d.x * d.z + d.y * d.z) * 2.0f;
+        };
+
+        float cost = 0.0f;
+        std::function<void(int, int)> visit = [&](int index, int depth)
+        {
+            const BvhTranslator::Node& node = nodes[index];
+            metrics.numNodes++;
+            metrics.height = glm::max(metrics.height, depth);
+            if (node.leaf != 0)
+            {
+                int numPrims = node.leaf == 2 ? 1 : node.rightIndex;
+                metrics.numLeaves++;
+                metrics.numPrimRefs += numPrims;
+                addHistogram(metrics.leafSizeHistogram, numPrims);
+                addHistogram(metrics.depthHistogram, depth);
+                cost += intersectionCost * area(node) * numPrims;
+                return;
+            }
+            cost += traversalCost * area(node);
+            visit(node.leftIndex, depth + 1);
+            visit(node.rightIndex, depth + 1);
+        };
+        visit(rootIndex, 0);
+
+        float rootArea = area(nodes[rootIndex]);
+        metrics.sahCost = rootArea > 0.0f ? cost / rootArea : 0.0f;
+        metrics.memoryBytes = metrics.numNodes * sizeof(BvhTranslator::Node);
+        return metrics;
+    }
+
+    float BvhAnalyzer::computeEPO(Bvh* bvh, const glm::vec3* vertices, const uint32_t* indices, ThreadPool* pool)
+    {
+        // Nodes are in depth first order after finalizeNodes, so a subtree is the index range
+        // [i, subtreeEnd[i]) and a triangle lies below a node if one of its leaves is in it
+        int numNodes = bvh->mNodeCount;
+        const Bvh::Node* nodes = bvh->mNodes.data();
+        std::vector<int> subtreeEnd(numNodes);
+        for (int i = numNodes - 1; i >= 0; --i)
+        {
+            subtreeEnd[i] = nodes[i].isLeaf() ? i + 1 : subtreeEnd[nodes[i].rc];
+        }
+
+        int numTris = 0;
+        for (int i = 0; i < bvh->mPackedIndices.size(); ++i)
+            numTris = glm::max(numTris, (int)bvh->mPackedIndices[i] + 1);
+        std::vector<std::vector<int>> triangleLeaves(numTris);
+        for (int i = 0; i < numNodes; ++i)
+        {
+            if (!nodes[i].isLeaf())
+                continue;
+            for (int j = 0; j < nodes[i].numPrims(); ++j)
+                triangleLeaves[bvh->mPackedIndices[nodes[i].startIdx() + j]].push_back(i);
+        }
+
+        // EPO weights the triangle area inside foreign nodes with the node cost, internal
+        // nodes cost traversalCost and leaves intersectionCost per primitive like the SAH
+        const Bvh::BuildSettings& settings = bvh->mSettings;
+        auto triangleOverlap = [&](int tri)
+        {
+            glm::vec3 triangle[3];
+            loadTriangle(vertices, indices, tri, triangle);
+            const std::vector<int>& leaves = triangleLeaves[tri];
+            float overlap = 0.0f;
+            std::vector<int> stack;
+            stack.push_back(0);
+            while (!stack.empty())
+            {
+                int index = stack.back();
+                stack.pop_back();
+                const Bvh::Node& node = nodes[index];
+                float area = clippedArea(triangle, node.bound);
+                if (area <= 0.0f)
+                    continue;
+
+                bool contains = false;
+                for (int i = 0; i < leaves.size(); ++i)
+                    contains |= leaves[i] >= index && leaves[i] < subtreeEnd[index];
+                if (!contains)
+                {
+                    if (node.isLeaf())
+                        overlap += settings.intersectionCost * node.numPrims() * area;
+                    else
+                        overlap += settings.traversalCost * area;
+                }
+                if (!node.isLeaf())
+                {
+                    stack.push_back(node.lc);
+                    stack.push_back(node.rc);
+                }
+            }
+            return overlap;
+        };
+
+        // Fixed chunks keep the sum independent of the thread count
+        const int chunkSize = 1024;
+        int numChunks = (numTris + chunkSize - 1) / chunkSize;
+        std::vector<double> chunkOverlap(numChunks, 0.0);
+        std::vector<double> chunkArea(numChunks, 0.0);
+        parallelFor(pool, 0, numChunks, 1, [&](int begin, int end)
+        {
+            for (int c = begin; c < end; ++c)
+            {
+                for (int tri = c * chunkSize; tri < glm::min((c + 1) * chunkSize, numTris); ++tri)
+                {
+                    glm::vec3 triangle[3];
+                    loadTriangle(vertices, indices, tri, triangle);
+                    chunkOverlap[c] += triangleOverlap(tri);
+                    chunkArea[c] += triangleArea(triangle[0], triangle[1], triangle[2]);
+                }
+            }
+        });
+
+        double overlap = 0.0;
+        double totalArea = 0.0;
+        for (int c = 0; c < numChunks; ++c)
+        {
+            overlap += chunkOverlap[c];
+            totalArea += chunkArea[c];
+        }
+        return totalArea > 0.0 ? (float)(overlap / totalArea) : 0.0f;
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef STAR_BVHANALYZER_H
+#define STAR_BVHANALYZER_H
+#include <vector>
+#include "Bvh.h"
+#include "BvhTranslator.h"
+
+namespace accel {
+    struct BvhMetrics
+    {
+        // SAH cost relative to the root surface area, same as BvhOptimizer::computeCost
+        float sahCost = 0.0f;
+        // End point overlap (Aila et al. 2013), -1 when it was not computed
+        float epo = -1.0f;
+        int numNodes = 0;
+        int numLeaves = 0;
+        // Primitive references in leaves, more than the primitive count with spatial splits
+        int numPrimRefs = 0;
+        int height = 0;
+        size_t memoryBytes = 0;
+        // leafSizeHistogram[k] leaves hold k primitives, depthHistogram[d] leaves are at depth d
+        std::vector<int> leafSizeHistogram;
+        std::vector<int> depthHistogram;
+    };
+
+    // Tree quality numbers used to compare builders and settings
+    class BvhAnalyzer
+    {
+    public:
+        // Metrics of a built Bvh. The EPO needs the triangles the Bvh was built from, indices is
+        // null for a triangle soup as in Bvh::buildTriangles
+        static BvhMetrics analyze(Bvh* bvh, const glm::vec3* vertices = nullptr, const uint32_t* indices = nullptr, ThreadPool* pool = nullptr);
+        // Metrics of the flattened tree below rootIndex, instance leaves count as one primitive
+        static BvhMetrics analyze(BvhTranslator* translator, int rootIndex, float traversalCost = 1.0f, float intersectionCost = 1.0f);
+    private:
+        static float computeEPO(Bvh* bvh, const glm::vec3* vertices, const uint32_t* indices, ThreadPool* pool);
+    };
+}
+
+#endif
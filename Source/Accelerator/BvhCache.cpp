@@ -0,0 +1,272 @@
+#include "BvhCache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace accel {
+    // Bump when the file layout or the meaning of a build setting changes
+    static const uint32_t gCacheVersion = 2;
+    static const uint32_t gCacheMagic = 0x48564253; // "SBVH"
+    static const int gHashChunkSize = 1 << 20;
+
+    struct CacheHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t key;
+        // Hash of everything after the header, catches corruption that still parses
+        uint64_t payloadHash;
+        uint32_t numNodes;
+        uint32_t numIndices;
+        int32_t height;
+        float boundMin[3];
+        float boundMax[3];
+    };
+
+    static uint64_t hashBytes(uint64_t hash, const void* data, size_t size)
+    {
+        // FNV-1a style over 64 bit words, folding the high half down after every word so
+        // all input bits reach the whole state. Bytes that do not fill a word are hashed one by one
+        const uint64_t prime = 0x100000001b3ull;
+        const uint8_t* bytes = (const uint8_t*)data;
+        size_t numWords = size / sizeof(uint64_t);
+        for (size_t i = 0; i < numWords; ++i)
+        {
+            uint64_t word;
+            memcpy(&word, bytes + i * sizeof(uint64_t), sizeof(uint64_t));
+            hash = (hash ^ word) * prime;
+            hash ^= hash >> 32;
+        }
+        for (size_t i = numWords * sizeof(uint64_t); i < size; ++i)
+        {
+            hash = (hash ^ bytes[i]) * prime;
+        }
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    BvhCache::BvhCache(const std::string& directory)
+        : mDirectory(directory)
+    {
+    }
+
+    BvhCache::~BvhCache()
+    {
+    }
+
+    static void hashChunks(const void* data, size_t size, ThreadPool* pool, std::vector<uint64_t>& chunkHashes)
+    {
+        // Chunks are hashed in parallel and combined in order, so the key does not depend on
+        // the thread count
+        int numChunks = (int)((size + gHashChunkSize - 1) / gHashChunkSize);
+        chunkHashes.resize(numChunks);
+        parallelFor(pool, 0, numChunks, 1, [&](int begin, int end)
+        {
+            for (int c = begin; c < end; ++c)
+            {
+                size_t offset = (size_t)c * gHashChunkSize;
+                chunkHashes[c] = hashBytes(0xcbf29ce484222325ull, (const uint8_t*)data + offset, std::min((size_t)gHashChunkSize, size - offset));
+            }
+        });
+    }
+
+    uint64_t BvhCache::computeKey(const glm::vec3* vertices, int numVertices, const uint32_t* indices, int numIndices, const Bvh::BuildSettings& settings, ThreadPool* pool)
+    {
+        std::vector<uint64_t> chunkHashes;
+        hashChunks(vertices, numVertices * sizeof(glm::vec3), pool, chunkHashes);
+        uint64_t hash = hashBytes(0xcbf29ce484222325ull, &gCacheVersion, sizeof(gCacheVersion));
+        hash = hashBytes(hash, &numVertices, sizeof(numVertices));
+        hash = hashBytes(hash, chunkHashes.data(), chunkHashes.size() * sizeof(uint64_t));
+
+        // A triangle soup hashes as before, so its cached Bvhs stay valid
+        if (indices)
+        {
+            hashChunks(indices, numIndices * sizeof(uint32_t), pool, chunkHashes);
+            hash = hashBytes(hash, &numIndices, sizeof(numIndices));
+            hash = hashBytes(hash, chunkHashes.data(), chunkHashes.size() * sizeof(uint64_t));
+        }
+
+        // Field by field, padding bytes of the struct are undefined
+        int mode = (int)settings.mode;
+        int flags = settings.linearTreelets ? 1 : 0;
+        hash = hashBytes(hash, &mode, sizeof(mode));
+        hash = hashBytes(hash, &settings.numBins, sizeof(settings.numBins));
+        hash = hashBytes(hash, &settings.traversalCost, sizeof(settings.traversalCost));
+        hash = hashBytes(hash, &settings.intersectionCost, sizeof(settings.intersectionCost));
+        hash = hashBytes(hash, &settings.maxLeafPrims, sizeof(settings.maxLeafPrims));
+        hash = hashBytes(hash, &settings.mortonBits, sizeof(settings.mortonBits));
+        hash = hashBytes(hash, &flags, sizeof(flags));
+        hash = hashBytes(hash, &settings.treeletBits, sizeof(settings.treeletBits));
+        hash = hashBytes(hash, &settings.clusterRadius, sizeof(settings.clusterRadius));
+        hash = hashBytes(hash, &settings.numSpatialBins, sizeof(settings.numSpatialBins));
+        hash = hashBytes(hash, &settings.splitAlpha, sizeof(settings.splitAlpha));
+        hash = hashBytes(hash, &settings.splitBudget, sizeof(settings.splitBudget));
+        hash = hashBytes(hash, &settings.preSplitBudget, sizeof(settings.preSplitBudget));
+        hash = hashBytes(hash, &settings.optimizeIterations, sizeof(settings.optimizeIterations));
+        hash = hashBytes(hash, &settings.treeletSize, sizeof(settings.treeletSize));
+        return hash;
+    }
+
+    std::string BvhCache::getPath(uint64_t key)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+        return mDirectory + "/" + name;
+    }
+
+    bool BvhCache::load(uint64_t key, Bvh* bvh, int numPrims)
+    {
+        std::string path = getPath(key);
+        size_t size = 0;
+        const uint8_t* data = nullptr;
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER fileSize;
+        HANDLE mapping = nullptr;
+        if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+        {
+            size = (size_t)fileSize.QuadPart;
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping)
+                data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+#else
+        int file = open(path.c_str(), O_RDONLY);
+        if (file < 0)
+            return false;
+        struct stat fileStat;
+        if (fstat(file, &fileStat) == 0 && fileStat.st_size > 0)
+        {
+            size = fileStat.st_size;
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (mapped != MAP_FAILED)
+                data = (const uint8_t*)mapped;
+        }
+#endif
+
+        bool valid = data != nullptr && size >= sizeof(CacheHeader);
+        CacheHeader header;
+        if (valid)
+        {
+            memcpy(&header, data, sizeof(CacheHeader));
+            valid = header.magic == gCacheMagic && header.version == gCacheVersion && header.key == key
+                && header.numNodes > 0
+                && size == sizeof(CacheHeader) + (size_t)header.numNodes * sizeof(Bvh::Node) + (size_t)header.numIndices * sizeof(uint32_t);
+        }
+
+        if (valid)
+        {
+            size_t nodesSize = (size_t)header.numNodes * sizeof(Bvh::Node);
+            uint64_t hash = hashBytes(0xcbf29ce484222325ull, data + sizeof(CacheHeader), nodesSize);
+            hash = hashBytes(hash, data + sizeof(CacheHeader) + nodesSize, (size_t)header.numIndices * sizeof(uint32_t));
+            valid = hash == header.payloadHash;
+        }
+
+        if (valid)
+        {
+            // Nodes are stored as they are, in the depth first order of finalizeNodes
+            const uint8_t* nodeData = data + sizeof(CacheHeader);
+            const uint32_t* indices = (const uint32_t*)(nodeData + (size_t)header.numNodes * sizeof(Bvh::Node));
+            for (uint32_t i = 0; i < header.numIndices && valid; ++i)
+            {
+                valid = indices[i] < (uint32_t)numPrims;
+            }
+
+            // Children always come after their parent in depth first order, which also rules out cycles
+            bvh->mNodes.resize(header.numNodes);
+            memcpy(bvh->mNodes.data(), nodeData, (size_t)header.numNodes * sizeof(Bvh::Node));
+            for (uint32_t i = 0; i < header.numNodes && valid; ++i)
+            {
+                const Bvh::Node& node = bvh->mNodes[i];
+                if (node.isLeaf())
+                    valid = node.startIdx() >= 0 && (int64_t)node.startIdx() + node.numPrims() <= header.numIndices;
+                else
+                    valid = node.lc > (int32_t)i && node.rc > (int32_t)i && node.lc < (int32_t)header.numNodes && node.rc < (int32_t)header.numNodes;
+            }
+
+            if (valid)
+            {
+                bvh->mPackedIndices.assign(indices, indices + header.numIndices);
+                bvh->mRoot = 0;
+                bvh->mNodeCount = header.numNodes;
+                bvh->mHeight = header.height;
+                bvh->mBound.mMin = glm::vec3(header.boundMin[0], header.boundMin[1], header.boundMin[2]);
+                bvh->mBound.mMax = glm::vec3(header.boundMax[0], header.boundMax[1], header.boundMax[2]);
+                bvh->mOptimizeReport = Bvh::OptimizeReport();
+            }
+            else
+            {
+                bvh->mNodes.clear();
+            }
+        }
+
+#ifdef _WIN32
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        if (data)
+            munmap((void*)data, size);
+        close(file);
+#endif
+        return valid;
+    }
+
+    bool BvhCache::store(uint64_t key, Bvh* bvh)
+    {
+        if (bvh->mRoot < 0)
+            return false;
+
+        CacheHeader header;
+        header.magic = gCacheMagic;
+        header.version = gCacheVersion;
+        header.key = key;
+        header.numNodes = bvh->mNodeCount;
+        header.numIndices = bvh->mPackedIndices.size();
+        header.height = bvh->mHeight;
+        for (int i = 0; i < 3; ++i)
+        {
+            header.boundMin[i] = bvh->mBound.mMin[i];
+            header.boundMax[i] = bvh->mBound.mMax[i];
+        }
+
+        const Bvh::Node* nodes = bvh->mNodes.data();
+        uint64_t hash = hashBytes(0xcbf29ce484222325ull, nodes, (size_t)header.numNodes * sizeof(Bvh::Node));
+        header.payloadHash = hashBytes(hash, bvh->mPackedIndices.data(), bvh->mPackedIndices.size() * sizeof(uint32_t));
+
+        // Write to a temporary file per Bvh and rename it, readers never see a partial file
+        std::string path = getPath(key);
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%p.tmp", (void*)bvh);
+        std::string tempPath = path + suffix;
+        FILE* file = fopen(tempPath.c_str(), "wb");
+        if (!file)
+            return false;
+        bool written = fwrite(&header, sizeof(CacheHeader), 1, file) == 1
+            && fwrite(nodes, sizeof(Bvh::Node), header.numNodes, file) == header.numNodes
+            && fwrite(bvh->mPackedIndices.data(), sizeof(uint32_t), bvh->mPackedIndices.size(), file) == bvh->mPackedIndices.size();
+        written = fclose(file) == 0 && written;
+        if (!written)
+        {
+            remove(tempPath.c_str());
+            return false;
+        }
+        remove(path.c_str());
+        return rename(tempPath.c_str(), path.c_str()) == 0;
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef STAR_BVHCACHE_H
+#define STAR_BVHCACHE_H
+#include <string>
+#include "Bvh.h"
+
+namespace accel {
+    // Stores built Bvhs in a directory, one file per key. Files are memory mapped on load and
+    // rejected when the version, key or any node or index is invalid, the caller then builds
+    // and stores again
+    class BvhCache
+    {
+    public:
+        BvhCache(const std::string& directory);
+        ~BvhCache();
+        // Hash of the triangles and every build setting that changes the tree, indices is null
+        // for a triangle soup as in Bvh::buildTriangles
+        static uint64_t computeKey(const glm::vec3* vertices, int numVertices, const uint32_t* indices, int numIndices, const Bvh::BuildSettings& settings, ThreadPool* pool = nullptr);
+        // Fills bvh from the cache, numPrims is the primitive count the Bvh has to cover
+        bool load(uint64_t key, Bvh* bvh, int numPrims);
+        bool store(uint64_t key, Bvh* bvh);
+    private:
+        std::string getPath(uint64_t key);
+    private:
+        std::string mDirectory;
+    };
+}
+
+#endif
@@ -0,0 +1,196 @@
+#include "BvhOptimizer.h"
+#include <functional>
+#include <limits>
+
+namespace accel {
+    static const int gMaxTreeletSize = 8;
+    // Subtrees above this depth are processed as separate tasks
+    static const int gParallelDepth = 8;
+
+    BvhOptimizer::BvhOptimizer(Bvh* bvh, ThreadPool* pool)
+        : mBvh(bvh), mPool(pool), mTreeletSize(7), mNumRestructured(0)
+    {
+    }
+
+    BvhOptimizer::~BvhOptimizer()
+    {
+    }
+
+    Bvh::OptimizeReport BvhOptimizer::optimize(int numIterations, int treeletSize)
+    {
+        Bvh::OptimizeReport report;
+        if (mBvh->mRoot < 0)
+            return report;
+
+        mTreeletSize = glm::clamp(treeletSize, 3, gMaxTreeletSize);
+        mCosts.resize(mBvh->mNodes.size());
+        mNumRestructured = 0;
+
+        report.costBefore = computeCost(mBvh);
+        for (int i = 0; i < numIterations; ++i)
+        {
+            int numRestructured = mNumRestructured;
+            processNode(mBvh->mRoot, 0);
+            if (mNumRestructured == numRestructured)
+                break;
+        }
+        mBvh->finalizeNodes();
+        report.costAfter = computeCost(mBvh);
+        report.numRestructured = mNumRestructured;
+        return report;
+    }
+
+    float BvhOptimizer::computeCost(Bvh* bvh)
+    {
+        if (bvh->mRoot < 0)
+            return 0.0f;
+
+        const Bvh::BuildSettings& settings = bvh->mSettings;
+        std::function<float(int)> nodeCost = [&](int nodeIdx) -> float
+        {
+            Bvh::Node& node = bvh->mNodes[nodeIdx];
+            float area = node.bound.surfaceArea();
+            if (node.isLeaf())
+                return settings.intersectionCost * area * node.numPrims();
+            return settings.traversalCost * area + nodeCost(node.lc) + nodeCost(node.rc);
+        };
+
+        float rootArea = bvh->mNodes[bvh->mRoot].bound.surfaceArea();
+        return rootArea > 0.0f ? nodeCost(bvh->mRoot) / rootArea : 0.0f;
+    }
+
+    int BvhOptimizer::processNode(int nodeIdx, int level)
+    {
+        const Bvh::BuildSettings& settings = mBvh->mSettings;
+        Bvh::Node& node = mBvh->mNodes[nodeIdx];
+        if (node.isLeaf())
+        {
+            mCosts[nodeIdx] = settings.intersectionCost * node.bound.surfaceArea() * node.numPrims();
+            return node.numPrims();
+        }
+
+        // Children first, a treelet is only restructured once its subtrees are final
+        int leftCount, rightCount;
+        if (level < gParallelDepth)
+        {
+            TaskGroup group(mPool);
+            group.run([&]() { leftCount = processNode(node.lc, level + 1); });
+            rightCount = processNode(node.rc, level + 1);
+            group.wait();
+        }
+        else
+        {
+            leftCount = processNode(node.lc, level + 1);
+            rightCount = processNode(node.rc, level + 1);
+        }
+
+        mCosts[nodeIdx] = settings.traversalCost * node.bound.surfaceArea() + mCosts[node.lc] + mCosts[node.rc];
+        if (leftCount + rightCount >= mTreeletSize && restructure(nodeIdx))
+            mNumRestructured++;
+        return leftCount + rightCount;
+    }
+
+    bool BvhOptimizer::restructure(int rootIdx)
+    {
+        const Bvh::BuildSettings& settings = mBvh->mSettings;
+        Bvh::Node* nodes = &mBvh->mNodes[0];
+
+        // Grow the treelet by expanding the leaf with the largest surface area
+        int leaves[gMaxTreeletSize];
+        int internals[gMaxTreeletSize];
+        int numLeaves = 2;
+        int numInternals = 1;
+        leaves[0] = nodes[rootIdx].lc;
+        leaves[1] = nodes[rootIdx].rc;
+        internals[0] = rootIdx;
+        while (numLeaves < mTreeletSize)
+        {
+            int best = -1;
+            float bestArea = -1.0f;
+            for (int i = 0; i < numLeaves; ++i)
+            {
+                if (!nodes[leaves[i]].isLeaf() && nodes[leaves[i]].bound.surfaceArea() > bestArea)
+                {
+                    best = i;
+                    bestArea = nodes[leaves[i]].bound.surfaceArea();
+                }
+            }
+            if (best < 0)
+                break;
+
+            int nodeIdx = leaves[best];
+            internals[numInternals++] = nodeIdx;
+            leaves[best] = nodes[nodeIdx].lc;
+            leaves[numLeaves++] = nodes[nodeIdx].rc;
+        }
+
+        if (numLeaves < 3)
+            return false;
+
+        // Optimal topology for every subset of the treelet leaves, proper subsets of s are
+        // numerically smaller than s so a single increasing pass is enough
+        int numSubsets = 1 << numLeaves;
+        BBox bounds[1 << gMaxTreeletSize];
+        float costs[1 << gMaxTreeletSize];
+        int partitions[1 << gMaxTreeletSize];
+        for (int s = 1; s < numSubsets; ++s)
+        {
+            int lowBit = s & -s;
+            int lowIdx = 0;
+            while ((1 << lowIdx) != lowBit)
+                lowIdx++;
+
+            if (s == lowBit)
+            {
+                bounds[s] = nodes[leaves[lowIdx]].bound;
+                costs[s] = mCosts[leaves[lowIdx]];
+                continue;
+            }
+
+            bounds[s] = BBox::grow(bounds[s ^ lowBit], nodes[leaves[lowIdx]].bound);
+            float bestCost = std::numeric_limits<float>::max();
+            int bestPartition = 0;
+            // Partitions containing the lowest leaf cover every split exactly once
+            for (int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+            {
+                if (!(p & lowBit))
+                    continue;
+                float c = costs[p] + costs[s ^ p];
+                if (c < bestCost)
+                {
+                    bestCost = c;
+                    bestPartition = p;
+                }
+            }
+            costs[s] = settings.traversalCost * bounds[s].surfaceArea() + bestCost;
+            partitions[s] = bestPartition;
+        }
+
+        int fullSet = numSubsets - 1;
+        if (costs[fullSet] >= mCosts[rootIdx] * (1.0f - 1e-5f))
+            return false;
+
+        // Rebuild the treelet reusing its internal nodes, the root keeps its place
+        int nextInternal = 0;
+        std::function<int(int)> rebuild = [&](int s) -> int
+        {
+            if ((s & (s - 1)) == 0)
+            {
+                int idx = 0;
+                while ((1 << idx) != s)
+                    idx++;
+                return leaves[idx];
+            }
+
+            int nodeIdx = internals[nextInternal++];
+            int lc = rebuild(partitions[s]);
+            int rc = rebuild(s ^ partitions[s]);
+            nodes[nodeIdx].setInternal(lc, rc);
+            nodes[nodeIdx].bound = bounds[s];
+            mCosts[nodeIdx] = costs[s];
+            return nodeIdx;
+        };
+        rebuild(fullSet);
+        return true;
+    }
+}
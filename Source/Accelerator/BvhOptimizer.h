@@ -0,0 +1,30 @@
+#ifndef STAR_BVHOPTIMIZER_H
+#define STAR_BVHOPTIMIZER_H
+#include <vector>
+#include "Bvh.h"
+
+namespace accel {
+    // Treelet restructuring (Karras and Aila 2013). Every node with enough primitives below it
+    // roots a treelet of up to treeletSize subtrees whose topology is replaced by the one with
+    // the lowest SAH cost. Leaves are never touched, so mPackedIndices stays valid.
+    class BvhOptimizer
+    {
+    public:
+        BvhOptimizer(Bvh* bvh, ThreadPool* pool = nullptr);
+        ~BvhOptimizer();
+        Bvh::OptimizeReport optimize(int numIterations, int treeletSize);
+        // SAH cost of the tree relative to the root surface area
+        static float computeCost(Bvh* bvh);
+    private:
+        int processNode(int nodeIdx, int level);
+        bool restructure(int rootIdx);
+    private:
+        Bvh* mBvh;
+        ThreadPool* mPool;
+        int mTreeletSize;
+        std::vector<float> mCosts;
+        std::atomic<int> mNumRestructured;
+    };
+}
+
+#endif
@@ -1,5 +1,12 @@
 #include "BvhTranslator.h"
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <limits>
 namespace accel {
+    // Sibling pairs per treelet of the Treelet layout, 85 nodes of 48 bytes fill a 4 KB page
+    static const int gTreeletLayoutPairs = 42;
+
     BvhTranslator::BvhTranslator()
     {
     }
@@ -8,11 +15,46 @@ namespace accel {
     {
     }
 
-    void BvhTranslator::process(Bvh* topBvh, std::vector<Bvh*> bvhs, std::vector<BvhInstance> bvhInstances)
+    void BvhTranslator::setThreaded(bool threaded)
+    {
+        if (threaded && !mThreaded && !mNodes.empty())
+        {
+            for (int i = 0; i < mBvhRootStartIndices.size(); i++)
+            {
+                if (mBvhRootStartIndices[i] >= 0)
+                    processMissLinks(mBvhRootStartIndices[i]);
+            }
+            processMissLinks(mTopIndex);
+        }
+        mThreaded = threaded;
+    }
+
+    void BvhTranslator::process(Bvh* topBvh, std::vector<Bvh*> bvhs, std::vector<BvhInstance> bvhInstances, std::vector<BvhReference> bvhReferences)
     {
         mTopBvh = topBvh;
         mBvhs = bvhs;
         mBvhInstances = bvhInstances;
+        mBvhReferences = bvhReferences;
+
+        // Nothing of a previous process is kept, the wide and compressed nodes are built again
+        // by processWide and processCompressed if they are still wanted
+        mNodes.clear();
+        mBvhRootStartIndices.clear();
+        mBvhNodeStartIndices.clear();
+        mBvhHeights.clear();
+        mWidth = 2;
+        mWideNodes2.clear();
+        mWideNodes4.clear();
+        mWideNodes8.clear();
+        mWideBvhRootStartIndices.clear();
+        mWideNodeIndices.clear();
+        mWideTopIndex = 0;
+        mWideNodeBase = 0;
+        mWideParents.clear();
+        mWideInstanceSlots.clear();
+        mCompressedNodes4.clear();
+        mCompressedNodes8.clear();
+        mCompressedInstances.clear();
         processBLAS();
         processTLAS();
     }
@@ -24,70 +66,191 @@ namespace accel {
         for (int i = 0; i < mBvhs.size(); i++)
             nodeCount += mBvhs[i]->mNodeCount;
         mTopIndex = nodeCount;
-        nodeCount += 2 * mBvhInstances.size();
+        // An empty TLAS still needs its root
+        nodeCount += std::max<int>(2 * std::max(mBvhInstances.size(), mBvhReferences.size()), 1);
         mNodes.resize(nodeCount);
+        mBlasNodeIndices.resize(mTopIndex);
 
         int bvhRootIndex = 0;
         mCurPrimIndex = 0;
+        mPrimIndices.clear();
 
         for (int i = 0; i < mBvhs.size(); i++)
         {
             Bvh* bvh = mBvhs[i];
             mCurNodeIndex = bvhRootIndex;
+            computeNodeOrder(bvh, mCurNodeIndex);
 
-            mBvhRootStartIndices.push_back(bvhRootIndex);
+            mBvhRootStartIndices.push_back(bvh->mRoot < 0 ? -1 : mBlasNodeIndices[bvhRootIndex + bvh->mRoot]);
+            mBvhNodeStartIndices.push_back(bvhRootIndex);
             bvhRootIndex += bvh->mNodeCount;
 
-            processBLASNodes(bvh->mRoot);
+            processBLASNodes(bvh, mCurNodeIndex);
+            if (mThreaded && mBvhRootStartIndices.back() >= 0)
+                processMissLinks(mBvhRootStartIndices.back());
+            mBvhHeights.push_back(mBvhRootStartIndices.back() >= 0 ? computeHeight(mBvhRootStartIndices.back()) : 0);
+            mPrimIndices.insert(mPrimIndices.end(), bvh->mPackedIndices.begin(), bvh->mPackedIndices.end());
             mCurPrimIndex += bvh->getNumIndices();
         }
     }
 
-    int BvhTranslator::processBLASNodes(Bvh::Node *node)
+    void BvhTranslator::computeNodeOrder(Bvh* bvh, int nodeOffset)
     {
-        BBox bound = node->bound;
-        mNodes[mCurNodeIndex].bboxMin = bound.mMin;
-        mNodes[mCurNodeIndex].bboxMax = bound.mMax;
-        mNodes[mCurNodeIndex].leaf = 0;
+        int* nodeIndices = &mBlasNodeIndices[nodeOffset];
+        if (mNodeLayout == NodeLayout::DepthFirst || bvh->mRoot < 0)
+        {
+            for (int i = 0; i < bvh->mNodeCount; ++i)
+                nodeIndices[i] = nodeOffset + i;
+            return;
+        }
 
-        int index = mCurNodeIndex;
+        int maxPairs = std::numeric_limits<int>::max();
+        if (mNodeLayout == NodeLayout::Siblings)
+            maxPairs = 1;
+        else if (mNodeLayout == NodeLayout::Treelet)
+            maxPairs = gTreeletLayoutPairs;
 
-        if(node->type == Bvh::NodeType::Leaf)
+        // A treelet takes the pairs below its root with the largest boxes first. Nodes whose
+        // children did not fit root the next treelets
+        int nextIndex = nodeOffset;
+        nodeIndices[bvh->mRoot] = nextIndex++;
+        std::vector<int> treeletRoots;
+        treeletRoots.push_back(bvh->mRoot);
+        std::vector<std::pair<float, int>> queue;
+        std::vector<int> parents;
+        std::vector<bool> inTreelet(mNodeLayout == NodeLayout::Treelet ? (int)bvh->mNodeCount : 0, false);
+        while (!treeletRoots.empty())
         {
-            mNodes[mCurNodeIndex].leftIndex = mCurPrimIndex + node->startIdx;
-            mNodes[mCurNodeIndex].rightIndex = node->numPrims;
-            mNodes[mCurNodeIndex].leaf = 1;
+            int treeletRoot = treeletRoots.back();
+            treeletRoots.pop_back();
+            if (bvh->mNodes[treeletRoot].isLeaf())
+                continue;
+
+            queue.clear();
+            parents.clear();
+            queue.push_back({ bvh->mNodes[treeletRoot].bound.surfaceArea(), treeletRoot });
+            for (int numPairs = 0; numPairs < maxPairs && !queue.empty(); ++numPairs)
+            {
+                std::pop_heap(queue.begin(), queue.end());
+                int parent = queue.back().second;
+                queue.pop_back();
+                parents.push_back(parent);
+
+                const Bvh::Node& node = bvh->mNodes[parent];
+                int children[2] = { node.lc, node.rc };
+                for (int i = 0; i < 2; ++i)
+                {
+                    BBox bound = bvh->mNodes[children[i]].bound;
+                    if (!bvh->mNodes[children[i]].isLeaf())
+                    {
+                        queue.push_back({ bound.surfaceArea(), children[i] });
+                        std::push_heap(queue.begin(), queue.end());
+                    }
+                }
+            }
+
+            if (mNodeLayout == NodeLayout::Treelet)
+            {
+                // Inside a page the pairs follow depth first, so a pair is usually close to its parent
+                for (int i = 0; i < parents.size(); ++i)
+                    inTreelet[parents[i]] = true;
+                parents.clear();
+                std::vector<int> stack(1, treeletRoot);
+                while (!stack.empty())
+                {
+                    int parent = stack.back();
+                    stack.pop_back();
+                    parents.push_back(parent);
+                    const Bvh::Node& node = bvh->mNodes[parent];
+                    if (inTreelet[node.rc])
+                        stack.push_back(node.rc);
+                    if (inTreelet[node.lc])
+                        stack.push_back(node.lc);
+                }
+            }
+            for (int i = 0; i < parents.size(); ++i)
+            {
+                const Bvh::Node& node = bvh->mNodes[parents[i]];
+                nodeIndices[node.lc] = nextIndex++;
+                nodeIndices[node.rc] = nextIndex++;
+            }
+
+            // The largest remaining subtree is laid out right after this treelet
+            std::sort(queue.begin(), queue.end());
+            for (int i = 0; i < queue.size(); ++i)
+                treeletRoots.push_back(queue[i].second);
         }
-        else
+    }
+
+    void BvhTranslator::processBLASNodes(Bvh* bvh, int nodeOffset)
+    {
+        const int* nodeIndices = &mBlasNodeIndices[nodeOffset];
+        for (int i = 0; i < bvh->mNodeCount; ++i)
         {
-            mCurNodeIndex++;
-            mNodes[index].leftIndex = processBLASNodes(node->lc);
-            mCurNodeIndex++;
-            mNodes[index].rightIndex = processBLASNodes(node->rc);
+            const Bvh::Node& src = bvh->mNodes[i];
+            Node& dst = mNodes[nodeIndices[i]];
+            dst.bboxMin = src.bound.mMin;
+            dst.bboxMax = src.bound.mMax;
+            dst.missIndex = -1;
+            if (src.isLeaf())
+            {
+                dst.leftIndex = mCurPrimIndex + src.startIdx();
+                dst.rightIndex = src.numPrims();
+                dst.leaf = 1;
+            }
+            else
+            {
+                dst.leftIndex = nodeIndices[src.lc];
+                dst.rightIndex = nodeIndices[src.rc];
+                dst.leaf = 0;
+            }
         }
-        return index;
     }
 
     void BvhTranslator::processTLAS()
     {
+        mParents.assign(mNodes.size(), -1);
+        mInstanceNodes.assign(mBvhInstances.size(), -1);
+        mFreeNodes.clear();
+        mTLASPreorder = true;
         mCurNodeIndex = mTopIndex;
-        processTLASNodes(mTopBvh->mRoot);
+        if (mTopBvh->mRoot >= 0)
+        {
+            processTLASNodes(mTopBvh->mRoot);
+        }
+        else
+        {
+            // An empty TLAS is a primitive leaf without primitives, see insertInstance
+            Node& root = mNodes[mTopIndex];
+            root.bboxMin = glm::vec3(std::numeric_limits<float>::max());
+            root.bboxMax = glm::vec3(-std::numeric_limits<float>::max());
+            root.leaf = 1;
+            root.leftIndex = 0;
+            root.rightIndex = 0;
+            root.missIndex = -1;
+        }
+
+        // Slots reserved for a larger TLAS are handed out by insertions
+        for (int i = mNodes.size() - 1; i > mCurNodeIndex; --i)
+            freeTLASNode(i);
+        if (mThreaded)
+            processMissLinks(mTopIndex);
+        takeDirtyRange();
     }
 
-    int BvhTranslator::processTLASNodes(Bvh::Node *node)
+    int BvhTranslator::processTLASNodes(int nodeIdx)
     {
+        const Bvh::Node* node = &mTopBvh->mNodes[nodeIdx];
         BBox bound = node->bound;
         mNodes[mCurNodeIndex].bboxMin = bound.mMin;
         mNodes[mCurNodeIndex].bboxMax = bound.mMax;
         mNodes[mCurNodeIndex].leaf = 0;
+        mNodes[mCurNodeIndex].missIndex = -1;
 
         int index = mCurNodeIndex;
-        if(node->type == Bvh::NodeType::Leaf)
+        if(node->isLeaf())
         {
-            int instanceIndex = mTopBvh->mPackedIndices[node->startIdx];
-            mNodes[mCurNodeIndex].leftIndex = mBvhRootStartIndices[mBvhInstances[instanceIndex].bvhIdx];
-            mNodes[mCurNodeIndex].rightIndex = instanceIndex;
-            mNodes[mCurNodeIndex].leaf = 2;
+            return processTLASLeaf(bound, node->startIdx(), node->numPrims(), false);
         }
         else
         {
@@ -95,7 +258,1019 @@ namespace accel {
             mNodes[index].leftIndex = processTLASNodes(node->lc);
             mCurNodeIndex++;
             mNodes[index].rightIndex = processTLASNodes(node->rc);
+            mParents[mNodes[index].leftIndex] = index;
+            mParents[mNodes[index].rightIndex] = index;
+        }
+        return index;
+    }
+
+    static BBox transformBound(const glm::vec3& minBound, const glm::vec3& maxBound, const glm::mat4& matrix)
+    {
+        BBox bound;
+        for (int i = 0; i < 8; ++i)
+        {
+            glm::vec3 corner((i & 1) ? maxBound.x : minBound.x, (i & 2) ? maxBound.y : minBound.y, (i & 4) ? maxBound.z : minBound.z);
+            bound.grow(glm::vec3(matrix * glm::vec4(corner, 1.0f)));
+        }
+        return bound;
+    }
+
+    int BvhTranslator::processTLASLeaf(const BBox& bound, int first, int count, bool clip)
+    {
+        int index = mCurNodeIndex;
+        mNodes[index].missIndex = -1;
+        if (count > 1)
+        {
+            // SAH leaves may hold several instances but an instance leaf references one BLAS, so
+            // the leaf is split into a subtree. A box is clipped to the leaf box, both contain
+            // the instance
+            mNodes[index].leaf = 0;
+            mCurNodeIndex++;
+            mNodes[index].leftIndex = processTLASLeaf(bound, first, count / 2, true);
+            mCurNodeIndex++;
+            mNodes[index].rightIndex = processTLASLeaf(bound, first + count / 2, count - count / 2, true);
+            const Node& left = mNodes[mNodes[index].leftIndex];
+            const Node& right = mNodes[mNodes[index].rightIndex];
+            mNodes[index].bboxMin = glm::min(left.bboxMin, right.bboxMin);
+            mNodes[index].bboxMax = glm::max(left.bboxMax, right.bboxMax);
+            mParents[mNodes[index].leftIndex] = index;
+            mParents[mNodes[index].rightIndex] = index;
+            return index;
+        }
+
+        int instanceIndex = mTopBvh->mPackedIndices[first];
+        int bvhNodeIndex;
+        if (mBvhReferences.empty())
+        {
+            bvhNodeIndex = mBvhRootStartIndices[mBvhInstances[instanceIndex].bvhIdx];
+        }
+        else
+        {
+            const BvhReference& reference = mBvhReferences[instanceIndex];
+            instanceIndex = reference.instance;
+            bvhNodeIndex = mBlasNodeIndices[mBvhNodeStartIndices[mBvhInstances[instanceIndex].bvhIdx] + reference.node];
+        }
+        mNodes[index].bboxMin = bound.mMin;
+        mNodes[index].bboxMax = bound.mMax;
+        if (clip)
+        {
+            const Node& bvhNode = mNodes[bvhNodeIndex];
+            BBox instanceBound = transformBound(bvhNode.bboxMin, bvhNode.bboxMax, mBvhInstances[instanceIndex].transform);
+            mNodes[index].bboxMin = glm::max(instanceBound.mMin, bound.mMin);
+            mNodes[index].bboxMax = glm::min(instanceBound.mMax, bound.mMax);
+        }
+        mNodes[index].leftIndex = bvhNodeIndex;
+        mNodes[index].rightIndex = instanceIndex;
+        mNodes[index].leaf = 2;
+        if (isRootReference(mNodes[index]))
+            mInstanceNodes[instanceIndex] = index;
+        return index;
+    }
+
+    bool BvhTranslator::isRootReference(const Node& node)
+    {
+        return node.leftIndex == mBvhRootStartIndices[mBvhInstances[node.rightIndex].bvhIdx];
+    }
+
+    void BvhTranslator::processMissLinks(int rootIndex)
+    {
+        // Only changed links are marked dirty, so threading the TLAS again after an update
+        // uploads the nodes whose successor moved
+        std::vector<std::pair<int, int>> stack(1, { rootIndex, -1 });
+        while (!stack.empty())
+        {
+            int index = stack.back().first;
+            int missIndex = stack.back().second;
+            stack.pop_back();
+            Node& node = mNodes[index];
+            if (node.missIndex != missIndex)
+            {
+                node.missIndex = missIndex;
+                markDirty(index);
+            }
+            if (node.leaf == 0)
+            {
+                stack.push_back({ node.rightIndex, missIndex });
+                stack.push_back({ node.leftIndex, node.rightIndex });
+            }
+        }
+    }
+
+    int BvhTranslator::computeHeight(int index)
+    {
+        int height = 0;
+        std::vector<std::pair<int, int>> stack(1, { index, 0 });
+        while (!stack.empty())
+        {
+            const Node& node = mNodes[stack.back().first];
+            int depth = stack.back().second;
+            stack.pop_back();
+            height = std::max(height, depth);
+            if (node.leaf == 0)
+            {
+                stack.push_back({ node.leftIndex, depth + 1 });
+                stack.push_back({ node.rightIndex, depth + 1 });
+            }
+        }
+        return height;
+    }
+
+    int BvhTranslator::computeStackSize()
+    {
+        // Below an inner node at depth d the stack holds at most one sibling per level above it
+        // and the two children, d + 2 entries. An instance at depth d adds the root of its BLAS
+        // to d entries, the BLAS nodes then add their own depth. Rebraided references start below
+        // the BLAS root, its height still bounds them
+        int stackSize = 1;
+        std::vector<std::pair<int, int>> stack(1, { mTopIndex, 0 });
+        while (!stack.empty())
+        {
+            const Node& node = mNodes[stack.back().first];
+            int depth = stack.back().second;
+            stack.pop_back();
+            if (node.leaf == 0)
+            {
+                stackSize = std::max(stackSize, depth + 2);
+                stack.push_back({ node.leftIndex, depth + 1 });
+                stack.push_back({ node.rightIndex, depth + 1 });
+            }
+            else if (node.leaf == 2)
+            {
+                stackSize = std::max(stackSize, depth + 1 + mBvhHeights[mBvhInstances[node.rightIndex].bvhIdx]);
+            }
+        }
+        return stackSize;
+    }
+
+    void BvhTranslator::processWide(int width)
+    {
+        mWidth = width;
+        mWideNodes2.clear();
+        mWideNodes4.clear();
+        mWideNodes8.clear();
+        mWideBvhRootStartIndices.clear();
+        mWideNodeIndices.assign(mTopIndex, -1);
+        mWideNodeBase = 0;
+
+        // mCurNodeIndex is the first mNodes index of the BLAS being collapsed
+        std::vector<int> primOffsets;
+        int primOffset = 0;
+        for (int i = 0; i < mBvhs.size(); i++)
+        {
+            mCurNodeIndex = mBvhNodeStartIndices[i];
+            primOffsets.push_back(primOffset);
+            if (mBvhs[i]->mRoot < 0)
+                mWideBvhRootStartIndices.push_back(-1);
+            else if (width == 8)
+                mWideBvhRootStartIndices.push_back(processWideNodes(mWideNodes8, mBvhs[i], mBvhs[i]->mRoot, primOffset, false));
+            else if (width == 4)
+                mWideBvhRootStartIndices.push_back(processWideNodes(mWideNodes4, mBvhs[i], mBvhs[i]->mRoot, primOffset, false));
+            else
+                mWideBvhRootStartIndices.push_back(processWideNodes(mWideNodes2, mBvhs[i], mBvhs[i]->mRoot, primOffset, false));
+            primOffset += mBvhs[i]->getNumIndices();
+        }
+
+        // Rebraided references can start at a node that was collapsed into its parent, it gets
+        // a wide node of its own that shares the wide nodes below it, see fillWideNode
+        for (int i = 0; i < mBvhReferences.size(); i++)
+        {
+            int bvhIdx = mBvhInstances[mBvhReferences[i].instance].bvhIdx;
+            mCurNodeIndex = mBvhNodeStartIndices[bvhIdx];
+            if (mWideNodeIndices[mBlasNodeIndices[mCurNodeIndex + mBvhReferences[i].node]] >= 0)
+                continue;
+            if (width == 8)
+                processWideNodes(mWideNodes8, mBvhs[bvhIdx], mBvhReferences[i].node, primOffsets[bvhIdx], true);
+            else if (width == 4)
+                processWideNodes(mWideNodes4, mBvhs[bvhIdx], mBvhReferences[i].node, primOffsets[bvhIdx], true);
+            else
+                processWideNodes(mWideNodes2, mBvhs[bvhIdx], mBvhReferences[i].node, primOffsets[bvhIdx], true);
+        }
+
+        if (width == 8)
+            mWideTopIndex = mWideNodes8.size();
+        else if (width == 4)
+            mWideTopIndex = mWideNodes4.size();
+        else
+            mWideTopIndex = mWideNodes2.size();
+        processWideTLAS();
+    }
+
+    void BvhTranslator::processWideTLAS()
+    {
+        // The TLAS is collapsed from mNodes rather than the top Bvh so that it follows
+        // refits, insertions and removals. Its wide nodes are the ones after mWideTopIndex
+        mWideParents.assign(mWideTopIndex, -1);
+        mWideInstanceSlots.assign(mBvhInstances.size(), -1);
+        if (mWidth == 8)
+        {
+            mWideNodes8.resize(mWideTopIndex - mWideNodeBase);
+            processWideTLASNodes(mWideNodes8, mTopIndex);
+            if (!mCompressedNodes8.empty())
+                compressWideTLAS(mWideNodes8, mCompressedNodes8);
         }
+        else if (mWidth == 4)
+        {
+            mWideNodes4.resize(mWideTopIndex - mWideNodeBase);
+            processWideTLASNodes(mWideNodes4, mTopIndex);
+            if (!mCompressedNodes4.empty())
+                compressWideTLAS(mWideNodes4, mCompressedNodes4);
+        }
+        else if (mWidth == 2)
+        {
+            mWideNodes2.resize(mWideTopIndex - mWideNodeBase);
+            processWideTLASNodes(mWideNodes2, mTopIndex);
+        }
+    }
+
+    template<int N>
+    int BvhTranslator::processWideTLASNodes(std::vector<WideNode<N>>& nodes, int nodeIndex)
+    {
+        int index = mWideNodeBase + nodes.size();
+        nodes.push_back(WideNode<N>());
+        mWideParents.push_back(-1);
+        fillWideTLASNode(nodes, nodeIndex, index);
         return index;
     }
+
+    template<int N>
+    void BvhTranslator::fillWideTLASNode(std::vector<WideNode<N>>& nodes, int nodeIndex, int index)
+    {
+        // Same greedy collapse as processWideNodes over the flattened binary TLAS
+        int children[N];
+        int numChildren = 0;
+        const Node& node = mNodes[nodeIndex];
+        if (node.leaf == 0)
+        {
+            children[numChildren++] = node.leftIndex;
+            children[numChildren++] = node.rightIndex;
+        }
+        else if (node.leaf == 2)
+        {
+            children[numChildren++] = nodeIndex;
+        }
+
+        while (numChildren < N)
+        {
+            int best = -1;
+            float bestArea = -1.0f;
+            for (int i = 0; i < numChildren; ++i)
+            {
+                const Node& child = mNodes[children[i]];
+                glm::vec3 d = child.bboxMax - child.bboxMin;
+                float area = d.x * d.y + d.x * d.z + d.y * d.z;
+                if (child.leaf == 0 && area > bestArea)
+                {
+                    best = i;
+                    bestArea = area;
+                }
+            }
+            if (best < 0)
+                break;
+
+            const Node& opened = mNodes[children[best]];
+            children[best] = opened.leftIndex;
+            children[numChildren++] = opened.rightIndex;
+        }
+
+        // Inner children get consecutive nodes, which compressed nodes rely on
+        int childIndex = mWideNodeBase + nodes.size();
+        for (int i = 0; i < numChildren; ++i)
+        {
+            if (mNodes[children[i]].leaf != 2)
+                nodes.push_back(WideNode<N>());
+        }
+        mWideParents.resize(mWideNodeBase + nodes.size(), -1);
+
+        for (int i = 0; i < N; ++i)
+        {
+            WideNode<N>& wideNode = nodes[index - mWideNodeBase];
+            if (i >= numChildren)
+            {
+                wideNode.bboxMinX[i] = wideNode.bboxMinY[i] = wideNode.bboxMinZ[i] = 1.0f;
+                wideNode.bboxMaxX[i] = wideNode.bboxMaxY[i] = wideNode.bboxMaxZ[i] = -1.0f;
+                wideNode.children[i] = -1;
+                wideNode.counts[i] = 0;
+                continue;
+            }
+
+            const Node& child = mNodes[children[i]];
+            wideNode.bboxMinX[i] = child.bboxMin.x;
+            wideNode.bboxMinY[i] = child.bboxMin.y;
+            wideNode.bboxMinZ[i] = child.bboxMin.z;
+            wideNode.bboxMaxX[i] = child.bboxMax.x;
+            wideNode.bboxMaxY[i] = child.bboxMax.y;
+            wideNode.bboxMaxZ[i] = child.bboxMax.z;
+
+            if (child.leaf == 2)
+            {
+                int instanceIndex = child.rightIndex;
+                wideNode.children[i] = mWideNodeIndices[child.leftIndex];
+                wideNode.counts[i] = -(instanceIndex + 1);
+                if (isRootReference(child))
+                    mWideInstanceSlots[instanceIndex] = index * N + i;
+            }
+            else
+            {
+                wideNode.children[i] = childIndex;
+                wideNode.counts[i] = 0;
+                mWideParents[childIndex] = index * N + i;
+                fillWideTLASNode(nodes, children[i], childIndex);
+                childIndex++;
+            }
+        }
+    }
+
+    template<int N>
+    int BvhTranslator::processWideNodes(std::vector<WideNode<N>>& nodes, Bvh* bvh, int nodeIdx, int primOffset, bool shared)
+    {
+        int index = nodes.size();
+        nodes.push_back(WideNode<N>());
+        fillWideNode(nodes, bvh, nodeIdx, primOffset, index, shared);
+        return index;
+    }
+
+    template<int N>
+    void BvhTranslator::fillWideNode(std::vector<WideNode<N>>& nodes, Bvh* bvh, int nodeIdx, int primOffset, int index, bool shared)
+    {
+        // Open the largest inner child until all N slots are used. This is the greedy SAH
+        // choice: the N slots are tested together, so opening a child only removes the visit
+        // of its node, whose SAH cost is proportional to its surface area. Leaves and their
+        // primitive tests cost the same in any slot
+        const Bvh::Node* bvhNodes = bvh->mNodes.data();
+        const Bvh::Node* children[N];
+        int numChildren = 0;
+        const Bvh::Node* node = &bvhNodes[nodeIdx];
+        if (node->isLeaf())
+        {
+            children[numChildren++] = node;
+        }
+        else
+        {
+            children[numChildren++] = &bvhNodes[node->lc];
+            children[numChildren++] = &bvhNodes[node->rc];
+        }
+
+        while (numChildren < N)
+        {
+            int best = -1;
+            float bestArea = -1.0f;
+            for (int i = 0; i < numChildren; ++i)
+            {
+                BBox bound = children[i]->bound;
+                if (!children[i]->isLeaf() && bound.surfaceArea() > bestArea)
+                {
+                    best = i;
+                    bestArea = bound.surfaceArea();
+                }
+            }
+            if (best < 0)
+                break;
+
+            const Bvh::Node* opened = children[best];
+            children[best] = &bvhNodes[opened->lc];
+            children[numChildren++] = &bvhNodes[opened->rc];
+        }
+
+        int& wideIndex = mWideNodeIndices[mBlasNodeIndices[mCurNodeIndex + nodeIdx]];
+        if (wideIndex < 0)
+            wideIndex = index;
+
+        // Inner children get consecutive nodes, which compressed nodes rely on. The leaves of a
+        // shared node also belong to a node of the main tree, whose primitives processCompressed
+        // keeps together, so each gets a node of its own. Children that already have a node
+        // are copied into the block
+        int childIndex = nodes.size();
+        for (int i = 0; i < numChildren; ++i)
+        {
+            if (shared || !children[i]->isLeaf())
+                nodes.push_back(WideNode<N>());
+        }
+
+        for (int i = 0; i < N; ++i)
+        {
+            WideNode<N>& wideNode = nodes[index];
+            if (i >= numChildren)
+            {
+                // Empty slots get an inverted box so they never pass the slab test
+                wideNode.bboxMinX[i] = wideNode.bboxMinY[i] = wideNode.bboxMinZ[i] = 1.0f;
+                wideNode.bboxMaxX[i] = wideNode.bboxMaxY[i] = wideNode.bboxMaxZ[i] = -1.0f;
+                wideNode.children[i] = -1;
+                wideNode.counts[i] = 0;
+                continue;
+            }
+
+            const Bvh::Node* child = children[i];
+            wideNode.bboxMinX[i] = child->bound.mMin.x;
+            wideNode.bboxMinY[i] = child->bound.mMin.y;
+            wideNode.bboxMinZ[i] = child->bound.mMin.z;
+            wideNode.bboxMaxX[i] = child->bound.mMax.x;
+            wideNode.bboxMaxY[i] = child->bound.mMax.y;
+            wideNode.bboxMaxZ[i] = child->bound.mMax.z;
+
+            if (child->isLeaf() && !shared)
+            {
+                wideNode.children[i] = primOffset + child->startIdx();
+                wideNode.counts[i] = child->numPrims();
+                continue;
+            }
+
+            wideNode.children[i] = childIndex;
+            wideNode.counts[i] = 0;
+            int existing = mWideNodeIndices[mBlasNodeIndices[mCurNodeIndex + (child - bvhNodes)]];
+            if (existing >= 0)
+            {
+                assert(shared);
+                nodes[childIndex] = nodes[existing];
+            }
+            else
+            {
+                fillWideNode(nodes, bvh, child - bvhNodes, primOffset, childIndex, shared && !child->isLeaf());
+            }
+            childIndex++;
+        }
+    }
+
+    BvhTranslator::NodeRange BvhTranslator::refit(const std::vector<int>& instances, const std::vector<glm::mat4>& transforms, const std::vector<BBox>& bounds)
+    {
+        for (int i = 0; i < instances.size(); ++i)
+        {
+            int instance = instances[i];
+            mBvhInstances[instance].transform = transforms[i];
+
+            int index = mInstanceNodes[instance];
+            mNodes[index].bboxMin = bounds[i].mMin;
+            mNodes[index].bboxMax = bounds[i].mMax;
+            markDirty(index);
+
+            if (mWidth == 4 && !mWideNodes4.empty())
+                refitWide(mWideNodes4, mCompressedNodes4, instance, bounds[i]);
+            else if (mWidth == 8 && !mWideNodes8.empty())
+                refitWide(mWideNodes8, mCompressedNodes8, instance, bounds[i]);
+            else if (mWidth == 2 && !mWideNodes2.empty())
+                refitWide(mWideNodes2, mCompressedNodes2, instance, bounds[i]);
+        }
+
+        // TLAS nodes are stored in preorder, so one backwards sweep refits children before
+        // parents. That is cheaper than walking up from every leaf once many instances moved
+        if (mTLASPreorder && instances.size() * 4 > mBvhInstances.size())
+        {
+            for (int index = mNodes.size() - 1; index >= mTopIndex; --index)
+            {
+                Node& node = mNodes[index];
+                if (node.leaf != 0)
+                    continue;
+                node.bboxMin = glm::min(mNodes[node.leftIndex].bboxMin, mNodes[node.rightIndex].bboxMin);
+                node.bboxMax = glm::max(mNodes[node.leftIndex].bboxMax, mNodes[node.rightIndex].bboxMax);
+            }
+            markDirty(mTopIndex);
+            markDirty(mNodes.size() - 1);
+        }
+        else
+        {
+            for (int i = 0; i < instances.size(); ++i)
+            {
+                // Stop as soon as a parent box does not change, everything above it is still valid
+                int parent = mParents[mInstanceNodes[instances[i]]];
+                while (parent >= 0)
+                {
+                    Node& node = mNodes[parent];
+                    const Node& lc = mNodes[node.leftIndex];
+                    const Node& rc = mNodes[node.rightIndex];
+                    glm::vec3 bboxMin = glm::min(lc.bboxMin, rc.bboxMin);
+                    glm::vec3 bboxMax = glm::max(lc.bboxMax, rc.bboxMax);
+                    if (bboxMin == node.bboxMin && bboxMax == node.bboxMax)
+                        break;
+                    node.bboxMin = bboxMin;
+                    node.bboxMax = bboxMax;
+                    markDirty(parent);
+                    parent = mParents[parent];
+                }
+            }
+        }
+
+        return takeDirtyRange();
+    }
+
+    void BvhTranslator::insertInstance(int instance, const BvhInstance& bvhInstance, const BBox& bound)
+    {
+        if (instance >= mBvhInstances.size())
+        {
+            mBvhInstances.resize(instance + 1);
+            mInstanceNodes.resize(instance + 1, -1);
+        }
+        mBvhInstances[instance] = bvhInstance;
+        mTLASPreorder = false;
+
+        Node leaf;
+        leaf.bboxMin = bound.mMin;
+        leaf.bboxMax = bound.mMax;
+        leaf.leaf = 2;
+        leaf.leftIndex = mBvhRootStartIndices[bvhInstance.bvhIdx];
+        leaf.rightIndex = instance;
+        leaf.missIndex = -1;
+
+        // An empty TLAS is a primitive leaf without primitives at the root
+        if (mNodes[mTopIndex].leaf == 1)
+        {
+            mNodes[mTopIndex] = leaf;
+            mInstanceNodes[instance] = mTopIndex;
+            markDirty(mTopIndex);
+            return;
+        }
+
+        // Branch and bound search for the sibling that adds the least area to the tree. A
+        // subtree is only opened if the area it inherits from its ancestors plus the leaf area
+        // can still beat the best cost found so far
+        glm::vec3 leafMin = bound.mMin;
+        glm::vec3 leafMax = bound.mMax;
+        auto area = [](const glm::vec3& bboxMin, const glm::vec3& bboxMax)
+        {
+            glm::vec3 d = bboxMax - bboxMin;
+            return d.x * d.y + d.x * d.z + d.y * d.z;
+        };
+        float leafArea = area(leafMin, leafMax);
+        int bestSibling = mTopIndex;
+        float bestCost = std::numeric_limits<float>::max();
+
+        std::vector<std::pair<float, int>> queue;
+        queue.push_back({ 0.0f, mTopIndex });
+        while (!queue.empty())
+        {
+            std::pop_heap(queue.begin(), queue.end(), std::greater<std::pair<float, int>>());
+            float inheritedCost = queue.back().first;
+            int index = queue.back().second;
+            queue.pop_back();
+            if (inheritedCost + leafArea >= bestCost)
+                break;
+
+            const Node& node = mNodes[index];
+            float unionArea = area(glm::min(node.bboxMin, leafMin), glm::max(node.bboxMax, leafMax));
+            float cost = unionArea + inheritedCost;
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestSibling = index;
+            }
+
+            float childInheritedCost = inheritedCost + unionArea - area(node.bboxMin, node.bboxMax);
+            if (node.leaf == 0 && childInheritedCost + leafArea < bestCost)
+            {
+                queue.push_back({ childInheritedCost, node.leftIndex });
+                std::push_heap(queue.begin(), queue.end(), std::greater<std::pair<float, int>>());
+                queue.push_back({ childInheritedCost, node.rightIndex });
+                std::push_heap(queue.begin(), queue.end(), std::greater<std::pair<float, int>>());
+            }
+        }
+
+        // The root has to stay at mTopIndex, so a root sibling moves out to a new slot
+        int leafIndex = allocateTLASNode();
+        int parent;
+        if (bestSibling == mTopIndex)
+        {
+            int sibling = allocateTLASNode();
+            moveTLASNode(mTopIndex, sibling);
+            parent = mTopIndex;
+            bestSibling = sibling;
+        }
+        else
+        {
+            parent = allocateTLASNode();
+            int oldParent = mParents[bestSibling];
+            if (mNodes[oldParent].leftIndex == bestSibling)
+                mNodes[oldParent].leftIndex = parent;
+            else
+                mNodes[oldParent].rightIndex = parent;
+            mParents[parent] = oldParent;
+            markDirty(oldParent);
+        }
+
+        mNodes[leafIndex] = leaf;
+        mParents[leafIndex] = parent;
+        mInstanceNodes[instance] = leafIndex;
+        markDirty(leafIndex);
+
+        mNodes[parent].leaf = 0;
+        mNodes[parent].leftIndex = bestSibling;
+        mNodes[parent].rightIndex = leafIndex;
+        mParents[bestSibling] = parent;
+
+        for (int index = parent; index >= 0; index = mParents[index])
+        {
+            refitTLASNode(index);
+            rotateTLASNode(index);
+        }
+    }
+
+    void BvhTranslator::removeInstance(int instance)
+    {
+        int leafIndex = mInstanceNodes[instance];
+        mInstanceNodes[instance] = -1;
+        mTLASPreorder = false;
+
+        if (leafIndex == mTopIndex)
+        {
+            mNodes[mTopIndex].leaf = 1;
+            mNodes[mTopIndex].leftIndex = 0;
+            mNodes[mTopIndex].rightIndex = 0;
+            markDirty(mTopIndex);
+            return;
+        }
+
+        int parent = mParents[leafIndex];
+        int sibling = mNodes[parent].leftIndex == leafIndex ? mNodes[parent].rightIndex : mNodes[parent].leftIndex;
+        freeTLASNode(leafIndex);
+        if (parent == mTopIndex)
+        {
+            moveTLASNode(sibling, mTopIndex);
+            mParents[mTopIndex] = -1;
+            freeTLASNode(sibling);
+            return;
+        }
+
+        int grandParent = mParents[parent];
+        if (mNodes[grandParent].leftIndex == parent)
+            mNodes[grandParent].leftIndex = sibling;
+        else
+            mNodes[grandParent].rightIndex = sibling;
+        mParents[sibling] = grandParent;
+        freeTLASNode(parent);
+
+        for (int index = grandParent; index >= 0; index = mParents[index])
+        {
+            refitTLASNode(index);
+        }
+    }
+
+    BvhTranslator::NodeRange BvhTranslator::takeDirtyRange()
+    {
+        NodeRange range;
+        if (mDirtyLast >= 0)
+        {
+            range.first = mDirtyFirst;
+            range.count = mDirtyLast - mDirtyFirst + 1;
+        }
+        mDirtyFirst = std::numeric_limits<int>::max();
+        mDirtyLast = -1;
+        return range;
+    }
+
+    int BvhTranslator::allocateTLASNode()
+    {
+        if (!mFreeNodes.empty())
+        {
+            int index = mFreeNodes.back();
+            mFreeNodes.pop_back();
+            return index;
+        }
+        mNodes.push_back(Node());
+        mParents.push_back(-1);
+        return mNodes.size() - 1;
+    }
+
+    void BvhTranslator::freeTLASNode(int index)
+    {
+        // Free slots become empty leaves so that nothing reads stale links
+        mNodes[index].bboxMin = glm::vec3(0.0f);
+        mNodes[index].bboxMax = glm::vec3(0.0f);
+        mNodes[index].leaf = 1;
+        mNodes[index].leftIndex = 0;
+        mNodes[index].rightIndex = 0;
+        mNodes[index].missIndex = -1;
+        mParents[index] = -1;
+        mFreeNodes.push_back(index);
+        markDirty(index);
+    }
+
+    void BvhTranslator::moveTLASNode(int src, int dst)
+    {
+        mNodes[dst] = mNodes[src];
+        mParents[dst] = mParents[src];
+        if (mNodes[dst].leaf == 2)
+        {
+            if (isRootReference(mNodes[dst]))
+                mInstanceNodes[mNodes[dst].rightIndex] = dst;
+        }
+        else if (mNodes[dst].leaf == 0)
+        {
+            mParents[mNodes[dst].leftIndex] = dst;
+            mParents[mNodes[dst].rightIndex] = dst;
+        }
+        markDirty(dst);
+    }
+
+    void BvhTranslator::refitTLASNode(int index)
+    {
+        Node& node = mNodes[index];
+        node.bboxMin = glm::min(mNodes[node.leftIndex].bboxMin, mNodes[node.rightIndex].bboxMin);
+        node.bboxMax = glm::max(mNodes[node.leftIndex].bboxMax, mNodes[node.rightIndex].bboxMax);
+        markDirty(index);
+    }
+
+    void BvhTranslator::rotateTLASNode(int index)
+    {
+        // Tree rotations: swap a child with a grandchild on the other side when that shrinks
+        // the box of the other child, the node box itself does not change
+        auto area = [](const glm::vec3& bboxMin, const glm::vec3& bboxMax)
+        {
+            glm::vec3 d = bboxMax - bboxMin;
+            return d.x * d.y + d.x * d.z + d.y * d.z;
+        };
+
+        Node& node = mNodes[index];
+        int children[2] = { node.leftIndex, node.rightIndex };
+        float bestGain = 0.0f;
+        int bestChild = -1;
+        int bestGrandChild = -1;
+        for (int side = 0; side < 2; ++side)
+        {
+            int child = children[side];
+            const Node& other = mNodes[children[1 - side]];
+            if (other.leaf != 0)
+                continue;
+
+            float otherArea = area(other.bboxMin, other.bboxMax);
+            int grandChildren[2] = { other.leftIndex, other.rightIndex };
+            for (int i = 0; i < 2; ++i)
+            {
+                // child takes the place of grandChildren[i] next to grandChildren[1 - i]
+                const Node& kept = mNodes[grandChildren[1 - i]];
+                float rotatedArea = area(glm::min(kept.bboxMin, mNodes[child].bboxMin), glm::max(kept.bboxMax, mNodes[child].bboxMax));
+                if (otherArea - rotatedArea > bestGain)
+                {
+                    bestGain = otherArea - rotatedArea;
+                    bestChild = child;
+                    bestGrandChild = grandChildren[i];
+                }
+            }
+        }
+        if (bestChild < 0)
+            return;
+
+        int other = mParents[bestGrandChild];
+        if (node.leftIndex == bestChild)
+            node.leftIndex = bestGrandChild;
+        else
+            node.rightIndex = bestGrandChild;
+        if (mNodes[other].leftIndex == bestGrandChild)
+            mNodes[other].leftIndex = bestChild;
+        else
+            mNodes[other].rightIndex = bestChild;
+        mParents[bestGrandChild] = index;
+        mParents[bestChild] = other;
+        refitTLASNode(other);
+        markDirty(index);
+    }
+
+    void BvhTranslator::markDirty(int index)
+    {
+        mDirtyFirst = glm::min(mDirtyFirst, index);
+        mDirtyLast = glm::max(mDirtyLast, index);
+    }
+
+    template<int N>
+    void BvhTranslator::refitWide(std::vector<WideNode<N>>& nodes, std::vector<CompressedNode<N>>& compressedNodes, int instance, const BBox& bound)
+    {
+        int slot = mWideInstanceSlots[instance];
+        glm::vec3 bboxMin = bound.mMin;
+        glm::vec3 bboxMax = bound.mMax;
+        while (slot >= 0)
+        {
+            int index = slot / N;
+            int i = slot % N;
+            WideNode<N>& node = nodes[index - mWideNodeBase];
+            node.bboxMinX[i] = bboxMin.x;
+            node.bboxMinY[i] = bboxMin.y;
+            node.bboxMinZ[i] = bboxMin.z;
+            node.bboxMaxX[i] = bboxMax.x;
+            node.bboxMaxY[i] = bboxMax.y;
+            node.bboxMaxZ[i] = bboxMax.z;
+            if (!compressedNodes.empty())
+                compressNode(node, compressedNodes[index], compressedNodes[index].primBase);
+
+            bboxMin = glm::vec3(std::numeric_limits<float>::max());
+            bboxMax = glm::vec3(-std::numeric_limits<float>::max());
+            for (int j = 0; j < N; ++j)
+            {
+                if (node.children[j] < 0 && node.counts[j] == 0)
+                    continue;
+                bboxMin = glm::min(bboxMin, glm::vec3(node.bboxMinX[j], node.bboxMinY[j], node.bboxMinZ[j]));
+                bboxMax = glm::max(bboxMax, glm::vec3(node.bboxMaxX[j], node.bboxMaxY[j], node.bboxMaxZ[j]));
+            }
+            slot = mWideParents[index];
+        }
+    }
+
+    void BvhTranslator::processCompressed()
+    {
+        if (mWidth == 4)
+            processCompressedNodes(mWideNodes4, mCompressedNodes4);
+        else if (mWidth == 8)
+            processCompressedNodes(mWideNodes8, mCompressedNodes8);
+    }
+
+    template<int N>
+    void BvhTranslator::processCompressedNodes(std::vector<WideNode<N>>& nodes, std::vector<CompressedNode<N>>& compressedNodes)
+    {
+        assert(mWideNodeBase == 0);
+        reorderLeaves(nodes);
+        compressedNodes.resize(nodes.size());
+        for (int i = 0; i < mWideTopIndex; ++i)
+        {
+            compressNode(nodes[i], compressedNodes[i], 0);
+        }
+
+        // The traversal only reads the compressed BLAS nodes from now on
+        nodes.erase(nodes.begin(), nodes.begin() + mWideTopIndex);
+        nodes.shrink_to_fit();
+        mWideNodeBase = mWideTopIndex;
+        compressWideTLAS(nodes, compressedNodes);
+    }
+
+    template<int N>
+    void BvhTranslator::reorderLeaves(std::vector<WideNode<N>>& nodes)
+    {
+        // Every leaf is a slot of exactly one node below a BLAS root, visiting those nodes
+        // depth first gives the new start of each leaf. Nodes of rebraided references only
+        // hold leaves in nodes of their own, so they stay contiguous too
+        std::vector<int> newStarts(mPrimIndices.size(), -1);
+        std::vector<uint32_t> primIndices(mPrimIndices.size());
+        int primOffset = 0;
+        for (int i = 0; i < mBvhs.size(); ++i)
+        {
+            Bvh* bvh = mBvhs[i];
+            if (bvh->mRoot < 0)
+                continue;
+
+            int first = primOffset;
+            std::vector<int> stack(1, mWideBvhRootStartIndices[i]);
+            while (!stack.empty())
+            {
+                const WideNode<N>& node = nodes[stack.back()];
+                stack.pop_back();
+                for (int j = 0; j < N; ++j)
+                {
+                    if (node.counts[j] > 0)
+                    {
+                        newStarts[node.children[j]] = first;
+                        std::copy_n(&mPrimIndices[node.children[j]], node.counts[j], &primIndices[first]);
+                        first += node.counts[j];
+                    }
+                }
+                for (int j = N - 1; j >= 0; --j)
+                {
+                    if (node.counts[j] == 0 && node.children[j] >= 0)
+                        stack.push_back(node.children[j]);
+                }
+            }
+            assert(first == primOffset + bvh->getNumIndices());
+            primOffset += bvh->getNumIndices();
+        }
+        mPrimIndices.swap(primIndices);
+
+        for (int i = 0; i < mWideTopIndex; ++i)
+        {
+            for (int j = 0; j < N; ++j)
+            {
+                if (nodes[i].counts[j] > 0)
+                    nodes[i].children[j] = newStarts[nodes[i].children[j]];
+            }
+        }
+        for (int i = 0; i < mTopIndex; ++i)
+        {
+            if (mNodes[i].leaf == 1)
+                mNodes[i].leftIndex = newStarts[mNodes[i].leftIndex];
+        }
+    }
+
+    template<int N>
+    void BvhTranslator::compressWideTLAS(const std::vector<WideNode<N>>& nodes, std::vector<CompressedNode<N>>& compressedNodes)
+    {
+        mCompressedInstances.clear();
+        compressedNodes.resize(mWideNodeBase + nodes.size());
+        for (int i = mWideTopIndex; i < compressedNodes.size(); ++i)
+        {
+            compressNode(nodes[i - mWideNodeBase], compressedNodes[i], mCompressedInstances.size());
+        }
+    }
+
+    template<int N>
+    void BvhTranslator::compressNode(const WideNode<N>& src, CompressedNode<N>& dst, int instanceBase)
+    {
+        const float* srcMin[3] = { src.bboxMinX, src.bboxMinY, src.bboxMinZ };
+        const float* srcMax[3] = { src.bboxMaxX, src.bboxMaxY, src.bboxMaxZ };
+        uint8_t* qMin[3] = { dst.qMinX, dst.qMinY, dst.qMinZ };
+        uint8_t* qMax[3] = { dst.qMaxX, dst.qMaxY, dst.qMaxZ };
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float lo = std::numeric_limits<float>::max();
+            float hi = -std::numeric_limits<float>::max();
+            for (int i = 0; i < N; ++i)
+            {
+                if (src.children[i] < 0 && src.counts[i] == 0)
+                    continue;
+                lo = glm::min(lo, srcMin[axis][i]);
+                hi = glm::max(hi, srcMax[axis][i]);
+            }
+            if (lo > hi)
+                lo = hi = 0.0f;
+
+            // Smallest power of two grid with 255 steps covering the node. The exponent is
+            // clamped to [-126, 126] so that exponentScale(-exponent) stays a normal float, a
+            // node wider than 255 * 2^126 does not fit
+            assert(std::isfinite(hi - lo));
+            int exponent = -126;
+            if (hi > lo)
+                exponent = glm::clamp((int)std::ceil(std::log2((hi - lo) / 255.0f)), -126, 126);
+            while (exponent < 126 && dequantize(lo, exponent, 255) < hi)
+                exponent++;
+            assert(dequantize(lo, exponent, 255) >= hi);
+
+            dst.origin[axis] = lo;
+            dst.exponents[axis] = (int8_t)exponent;
+            float scale = exponentScale(-exponent);
+            for (int i = 0; i < N; ++i)
+            {
+                if (src.children[i] < 0 && src.counts[i] == 0)
+                {
+                    qMin[axis][i] = 255;
+                    qMax[axis][i] = 0;
+                    continue;
+                }
+
+                // Round outwards, then step further out until the decoded box is conservative
+                int qLo = glm::clamp((int)std::floor((srcMin[axis][i] - lo) * scale), 0, 255);
+                int qHi = glm::clamp((int)std::ceil((srcMax[axis][i] - lo) * scale), 0, 255);
+                while (qLo > 0 && dequantize(lo, exponent, qLo) > srcMin[axis][i])
+                    qLo--;
+                while (qHi < 255 && dequantize(lo, exponent, qHi) < srcMax[axis][i])
+                    qHi++;
+                qMin[axis][i] = (uint8_t)qLo;
+                qMax[axis][i] = (uint8_t)qHi;
+            }
+        }
+
+        // Inner children and leaf primitives have to follow each other in slot order, which
+        // fillWideNode, fillWideTLASNode and reorderLeaves take care of
+        dst.padding = 0;
+        dst.childBase = -1;
+        dst.primBase = -1;
+        int numInner = 0;
+        int numPrims = 0;
+        int numInstances = 0;
+        for (int i = 0; i < N; ++i)
+        {
+            if (src.counts[i] == 0 && src.children[i] < 0)
+            {
+                dst.meta[i] = 0;
+            }
+            else if (src.counts[i] == 0)
+            {
+                if (dst.childBase < 0)
+                    dst.childBase = src.children[i];
+                assert(src.children[i] == dst.childBase + numInner);
+                numInner++;
+                dst.meta[i] = gInnerSlot;
+            }
+            else if (src.counts[i] < 0)
+            {
+                assert(numPrims == 0);
+                dst.primBase = instanceBase;
+                int record = instanceBase + numInstances++;
+                if (record >= mCompressedInstances.size())
+                    mCompressedInstances.resize(record + 1);
+                mCompressedInstances[record] = { src.children[i], src.counts[i] };
+                dst.meta[i] = gInstanceSlot;
+            }
+            else
+            {
+                assert(numInstances == 0 && src.counts[i] <= gMaxLeafPrims);
+                if (dst.primBase < 0)
+                    dst.primBase = src.children[i];
+                assert(src.children[i] == dst.primBase + numPrims);
+                numPrims += src.counts[i];
+                dst.meta[i] = (uint8_t)src.counts[i];
+            }
+        }
+        dst.childBase = glm::max(dst.childBase, 0);
+        dst.primBase = glm::max(dst.primBase, 0);
+    }
+
+    template<int N>
+    void BvhTranslator::decompressNode(const CompressedNode<N>& src, WideNode<N>& dst)
+    {
+        for (int i = 0; i < N; ++i)
+        {
+            dst.bboxMinX[i] = dequantize(src.origin[0], src.exponents[0], src.qMinX[i]);
+            dst.bboxMinY[i] = dequantize(src.origin[1], src.exponents[1], src.qMinY[i]);
+            dst.bboxMinZ[i] = dequantize(src.origin[2], src.exponents[2], src.qMinZ[i]);
+            dst.bboxMaxX[i] = dequantize(src.origin[0], src.exponents[0], src.qMaxX[i]);
+            dst.bboxMaxY[i] = dequantize(src.origin[1], src.exponents[1], src.qMaxY[i]);
+            dst.bboxMaxZ[i] = dequantize(src.origin[2], src.exponents[2], src.qMaxZ[i]);
+        }
+        decodeLinks(src, dst.children, dst.counts);
+    }
+
+    template void BvhTranslator::decompressNode<4>(const CompressedNode<4>& src, WideNode<4>& dst);
+    template void BvhTranslator::decompressNode<8>(const CompressedNode<8>& src, WideNode<8>& dst);
 }
@@ -3,6 +3,10 @@
 
 #include "BBox.h"
 #include "Bvh.h"
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
 
 namespace accel {
     struct BvhInstance
@@ -11,9 +15,31 @@ namespace accel {
         glm::mat4 transform;
     };
 
+    // A TLAS primitive, the subtree below node of the instance BLAS. Rebraiding replaces the
+    // root reference of large instances by several references to their top nodes
+    struct BvhReference
+    {
+        int instance;
+        int node;
+    };
+
     class BvhTranslator
     {
     public:
+        // Order of the BLAS nodes in mNodes. Except for DepthFirst, the order of Bvh, both children
+        // of a node are stored next to each other because the binary traversal tests them together
+        //   Siblings:    depth first over the sibling pairs, the larger child first
+        //   Treelet:     page sized treelets grown by surface area, laid out depth first
+        //   Probability: all pairs by decreasing surface area, the SAH estimate of the access
+        //                probability, so the hottest nodes share cache lines and pages
+        enum class NodeLayout
+        {
+            DepthFirst,
+            Siblings,
+            Treelet,
+            Probability
+        };
+
         struct Node
         {
             alignas(16) glm::vec3 bboxMin;
@@ -21,26 +47,268 @@ namespace accel {
             alignas(4) int leaf;
             alignas(4) int leftIndex;
             alignas(4) int rightIndex;
+            // Next node after the subtree of this node in depth first order, -1 past the end of
+            // the tree. A stackless traversal goes to leftIndex when it hits an inner node box
+            // and follows the miss link otherwise. It fills the padding, Node stays 48 bytes
+            alignas(4) int missIndex;
+        };
+
+        static_assert(sizeof(Node) == 48, "Node is expected to be 48 bytes");
+
+        // Collapsed node with N children, child bounds are stored per axis so one node fetch
+        // feeds all N box tests. A child slot is
+        //   counts > 0:  primitive leaf, children is the first primitive and counts the number of primitives
+        //   counts == 0: inner node, children is the wide node index, or -1 for an empty slot
+        //   counts < 0:  instance -counts - 1, children is the wide root of its BLAS
+        // The inner children of a node are consecutive wide nodes in slot order
+        template<int N>
+        struct WideNode
+        {
+            float bboxMinX[N];
+            float bboxMinY[N];
+            float bboxMinZ[N];
+            float bboxMaxX[N];
+            float bboxMaxY[N];
+            float bboxMaxZ[N];
+            int children[N];
+            int counts[N];
+        };
+
+        // WideNode<2> is the 64 byte child-bounds-in-parent node, one fetch feeds both box tests
+        // of a binary node instead of the three reads of Node. GLSL std430 reads it as six vec2
+        // bounds followed by ivec2 children and counts
+        static_assert(sizeof(WideNode<2>) == 64, "WideNode<2> is expected to be 64 bytes");
+
+        // WideNode with child bounds quantized to 8 bits inside the node box. A child box
+        // decodes to origin + q * 2^exponent per axis and always contains the original box.
+        // Empty slots have qMin > qMax. Instead of children and counts a slot has one meta byte
+        //   0:                   empty slot
+        //   1 to gMaxLeafPrims:  primitive leaf with that many primitives
+        //   gInnerSlot:          inner node
+        //   gInstanceSlot:       instance, its children and counts are in mCompressedInstances
+        // Inner children are the consecutive nodes from childBase. Leaf primitives, or the
+        // instance records of a TLAS node, follow each other from primBase. Both are taken in
+        // slot order, see decodeLinks
+        template<int N>
+        struct CompressedNode
+        {
+            float origin[3];
+            int8_t exponents[3];
+            uint8_t padding;
+            uint8_t qMinX[N];
+            uint8_t qMinY[N];
+            uint8_t qMinZ[N];
+            uint8_t qMaxX[N];
+            uint8_t qMaxY[N];
+            uint8_t qMaxZ[N];
+            int childBase;
+            int primBase;
+            uint8_t meta[N];
+        };
+
+        static_assert(sizeof(CompressedNode<4>) == 52, "CompressedNode<4> is expected to be 52 bytes");
+        static_assert(sizeof(CompressedNode<8>) == 80, "CompressedNode<8> is expected to be 80 bytes");
+        static const uint8_t gMaxLeafPrims = 253;
+        static const uint8_t gInstanceSlot = 254;
+        static const uint8_t gInnerSlot = 255;
+
+        // Instance slot of a compressed TLAS node, children and counts as in WideNode
+        struct CompressedInstance
+        {
+            int children;
+            int counts;
+        };
+
+        // Range of mNodes that has to be uploaded again
+        struct NodeRange
+        {
+            int first = 0;
+            int count = 0;
         };
     public:
         BvhTranslator();
         ~BvhTranslator();
-        void process(Bvh* topBvh, std::vector<Bvh*> bvhs, std::vector<BvhInstance> bvhInstances);
+        // Takes effect on the next process
+        void setNodeLayout(NodeLayout layout) { mNodeLayout = layout; }
+        // Writes the miss links of every tree for the stackless traversals, the other traversals
+        // do not read them. Threads a processed translator right away
+        void setThreaded(bool threaded);
+        // TLAS primitives index bvhReferences, or bvhInstances directly if it is empty
+        void process(Bvh* topBvh, std::vector<Bvh*> bvhs, std::vector<BvhInstance> bvhInstances, std::vector<BvhReference> bvhReferences = std::vector<BvhReference>());
         void processBLAS();
-        int processBLASNodes(Bvh::Node* node);
+        // Fills mBlasNodeIndices for the nodes of a BLAS according to mNodeLayout
+        void computeNodeOrder(Bvh* bvh, int nodeOffset);
+        // Bvh nodes already hold child indices, so a BLAS is translated node by node
+        void processBLASNodes(Bvh* bvh, int nodeOffset);
         void processTLAS();
-        int processTLASNodes(Bvh::Node* node);
+        int processTLASNodes(int nodeIdx);
+        // Translates primitives [first, first + count) of a TLAS leaf with box bound. Several
+        // primitives become a subtree with one instance per leaf, clip bounds them by their BLAS box
+        int processTLASLeaf(const BBox& bound, int first, int count, bool clip);
+        // Only a leaf referencing the BLAS root stands for a whole instance, instances split
+        // by rebraiding have no single leaf to refit or remove
+        bool isRootReference(const Node& node);
+        // Sets the miss links below rootIndex, left children skip to their sibling and right
+        // children inherit the link of their parent. process threads every tree if mThreaded is
+        // set, the TLAS then has to be threaded again after insertions and removals
+        void processMissLinks(int rootIndex);
+        // Height of the binary subtree below index in edges
+        int computeHeight(int index);
+        // Most entries a stack shared by the TLAS and the BLASes holds when the closer child is
+        // visited first and the other one pushed, as the stack traversals of trace.comp do. Pair
+        // nodes have the shape of the binary nodes, so the bound holds for both
+        int computeStackSize();
+        // Collapses the BLASes and the TLAS into 4 or 8 wide nodes, needs process to run first.
+        // A width of 2 converts the binary nodes into WideNode<2> without collapsing
+        void processWide(int width);
+        // Quantizes the wide nodes of processWide, node indices are unchanged. The leaves of every
+        // BLAS are reordered first so that the primitives of the leaves of a wide node follow each
+        // other. mPrimIndices and all leaves are remapped, so hit.primIdx of this layout differs
+        // from the one of a scene without compression, the Bvhs keep their order. Afterwards only
+        // the TLAS part of the full precision wide nodes is kept, see mWideNodeBase
+        void processCompressed();
+        template<int N>
+        void processCompressedNodes(std::vector<WideNode<N>>& nodes, std::vector<CompressedNode<N>>& compressedNodes);
+        template<int N>
+        void reorderLeaves(std::vector<WideNode<N>>& nodes);
+        // Compresses the TLAS part of the wide nodes and rebuilds mCompressedInstances
+        template<int N>
+        void compressWideTLAS(const std::vector<WideNode<N>>& nodes, std::vector<CompressedNode<N>>& compressedNodes);
+        // instanceBase is the first mCompressedInstances record of the instance slots of src
+        template<int N>
+        void compressNode(const WideNode<N>& src, CompressedNode<N>& dst, int instanceBase);
+        template<int N>
+        void decompressNode(const CompressedNode<N>& src, WideNode<N>& dst);
+        // children and counts of every slot of a compressed node, as in WideNode
+        template<int N>
+        void decodeLinks(const CompressedNode<N>& node, int* children, int* counts) const
+        {
+            int child = node.childBase;
+            int prim = node.primBase;
+            for (int i = 0; i < N; ++i)
+            {
+                uint8_t meta = node.meta[i];
+                if (meta == 0)
+                {
+                    children[i] = -1;
+                    counts[i] = 0;
+                }
+                else if (meta == gInnerSlot)
+                {
+                    children[i] = child++;
+                    counts[i] = 0;
+                }
+                else if (meta == gInstanceSlot)
+                {
+                    const CompressedInstance& instance = mCompressedInstances[prim++];
+                    children[i] = instance.children;
+                    counts[i] = instance.counts;
+                }
+                else
+                {
+                    children[i] = prim;
+                    counts[i] = meta;
+                    prim += meta;
+                }
+            }
+        }
+        // Allocates a wide node for nodeIdx and collapses the subtree below it. shared is set
+        // below rebraided references, see fillWideNode
+        template<int N>
+        int processWideNodes(std::vector<WideNode<N>>& nodes, Bvh* bvh, int nodeIdx, int primOffset, bool shared);
+        template<int N>
+        void fillWideNode(std::vector<WideNode<N>>& nodes, Bvh* bvh, int nodeIdx, int primOffset, int index, bool shared);
+        // Collapses the TLAS part of mNodes again, after insertions or removals
+        void processWideTLAS();
+        template<int N>
+        int processWideTLASNodes(std::vector<WideNode<N>>& nodes, int nodeIndex);
+        template<int N>
+        void fillWideTLASNode(std::vector<WideNode<N>>& nodes, int nodeIndex, int index);
+        // Moves instances and refits the TLAS nodes above them bottom-up in place, bounds are the
+        // world space bounds of the instances. Wide and compressed TLAS nodes are refitted as well
+        NodeRange refit(const std::vector<int>& instances, const std::vector<glm::mat4>& transforms, const std::vector<BBox>& bounds);
+        // Inserts an instance into the TLAS next to the sibling with the lowest SAH cost and
+        // rotates the tree on the way up. instance is the stable id, usually a free slot or the
+        // end of mBvhInstances
+        void insertInstance(int instance, const BvhInstance& bvhInstance, const BBox& bound);
+        // Removes an instance from the TLAS, its sibling takes the place of the parent
+        void removeInstance(int instance);
+        // Changed mNodes since the last call, covers refits, insertions and removals
+        NodeRange takeDirtyRange();
+        int allocateTLASNode();
+        void freeTLASNode(int index);
+        // Copies a TLAS node to another slot and fixes the links pointing to it
+        void moveTLASNode(int src, int dst);
+        void refitTLASNode(int index);
+        void rotateTLASNode(int index);
+        void markDirty(int index);
+        template<int N>
+        void refitWide(std::vector<WideNode<N>>& nodes, std::vector<CompressedNode<N>>& compressedNodes, int instance, const BBox& bound);
 
     public:
         std::vector<Node> mNodes;
         std::vector<int> mBvhRootStartIndices;
+        std::vector<int> mBvhNodeStartIndices;
+        // Height of every BLAS, see computeStackSize
+        std::vector<int> mBvhHeights;
+        // mNodes index of every BLAS node, indexed by mBvhNodeStartIndices[bvh] + Bvh node index
+        std::vector<int> mBlasNodeIndices;
+        // Packed index of every primitive of mNodes leaves, the BLAS packed indices one after the
+        // other. processCompressed reorders this copy with the leaves
+        std::vector<uint32_t> mPrimIndices;
+        NodeLayout mNodeLayout = NodeLayout::DepthFirst;
+        bool mThreaded = false;
         int mCurNodeIndex = 0;
         int mCurPrimIndex = 0;
         int mTopIndex = 0;
         Bvh* mTopBvh;
         std::vector<Bvh*> mBvhs;
         std::vector<BvhInstance> mBvhInstances;
+        std::vector<BvhReference> mBvhReferences;
+        // Parent of every TLAS node (-1 for the root and BLAS nodes) and the TLAS leaf of every instance
+        std::vector<int> mParents;
+        std::vector<int> mInstanceNodes;
+        std::vector<int> mFreeNodes;
+        // Cleared by insertions and removals, the preorder refit sweep relies on it
+        bool mTLASPreorder = true;
+        int mDirtyFirst = std::numeric_limits<int>::max();
+        int mDirtyLast = -1;
+
+        int mWidth = 2;
+        std::vector<WideNode<2>> mWideNodes2;
+        std::vector<WideNode<4>> mWideNodes4;
+        std::vector<WideNode<8>> mWideNodes8;
+        std::vector<int> mWideBvhRootStartIndices;
+        // Wide node of every BLAS node by mNodes index, -1 for nodes collapsed into their parent
+        std::vector<int> mWideNodeIndices;
+        int mWideTopIndex = 0;
+        // Wide node index of mWideNodesN[0]. Refits and TLAS updates need the full precision TLAS
+        // nodes only, so processCompressed frees the BLAS ones and it becomes mWideTopIndex
+        int mWideNodeBase = 0;
+        // Same links for the wide TLAS, slots are stored as node * width + slot
+        std::vector<int> mWideParents;
+        std::vector<int> mWideInstanceSlots;
+        // Pair nodes are not quantized, mCompressedNodes2 stays empty
+        std::vector<CompressedNode<2>> mCompressedNodes2;
+        std::vector<CompressedNode<4>> mCompressedNodes4;
+        std::vector<CompressedNode<8>> mCompressedNodes8;
+        std::vector<CompressedInstance> mCompressedInstances;
     };
+
+    // 2^exponent built from the float exponent bits, exponent must be in [-126, 127]
+    inline float exponentScale(int exponent)
+    {
+        assert(exponent >= -126 && exponent <= 127);
+        uint32_t bits = (uint32_t)(exponent + 127) << 23;
+        float scale;
+        std::memcpy(&scale, &bits, sizeof(float));
+        return scale;
+    }
+
+    inline float dequantize(float origin, int8_t exponent, uint8_t q)
+    {
+        return origin + (float)q * exponentScale(exponent);
+    }
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,24 @@
+#include "BvhTraversal.h"
+
+namespace accel {
+    BvhTraversal::BvhTraversal(BvhTranslator* translator)
+        : mTranslator(translator)
+    {
+        mInvTransforms.resize(translator->mBvhInstances.size());
+        for (int i = 0; i < translator->mBvhInstances.size(); ++i)
+        {
+            mInvTransforms[i] = glm::inverse(translator->mBvhInstances[i].transform);
+        }
+    }
+
+    BvhTraversal::~BvhTraversal()
+    {
+    }
+
+    void BvhTraversal::updateInstance(int instanceIdx)
+    {
+        if (instanceIdx >= mInvTransforms.size())
+            mInvTransforms.resize(instanceIdx + 1);
+        mInvTransforms[instanceIdx] = glm::inverse(mTranslator->mBvhInstances[instanceIdx].transform);
+    }
+}
@@ -0,0 +1,804 @@
+#ifndef STAR_BVHTRAVERSAL_H
+#define STAR_BVHTRAVERSAL_H
+#include <vector>
+#include <limits>
+#include "BvhTranslator.h"
+#include "Simd.h"
+
+namespace accel {
+    static const int gTraversalStackSize = 256;
+
+    // Traversal stack keeping gTraversalStackSize entries inline. Nothing bounds the tree height
+    // (midpoint splits of clustered primitives, insertions into the TLAS), deeper entries spill
+    // to the heap
+    template<typename T>
+    class TraversalStack
+    {
+    public:
+        bool empty() const
+        {
+            return mSize == 0;
+        }
+
+        void push(const T& entry)
+        {
+            if (mSize < gTraversalStackSize)
+                mEntries[mSize] = entry;
+            else
+                mOverflow.push_back(entry);
+            mSize++;
+        }
+
+        T pop()
+        {
+            mSize--;
+            if (mSize < gTraversalStackSize)
+                return mEntries[mSize];
+            T entry = mOverflow.back();
+            mOverflow.pop_back();
+            return entry;
+        }
+    private:
+        T mEntries[gTraversalStackSize];
+        std::vector<T> mOverflow;
+        int mSize = 0;
+    };
+
+    struct Ray
+    {
+        glm::vec3 origin;
+        glm::vec3 direction;
+        float tMax = std::numeric_limits<float>::max();
+    };
+
+    struct Hit
+    {
+        float t = std::numeric_limits<float>::max();
+        float u = 0.0f;
+        float v = 0.0f;
+        // Index into the flattened primitive array, same as BvhTranslator leaf indices
+        int primIdx = -1;
+        int instanceIdx = -1;
+    };
+
+    // Up to N rays in SoA layout for the packet traversal
+    template<int N>
+    struct alignas(64) RayPacket
+    {
+        float originX[N] = {};
+        float originY[N] = {};
+        float originZ[N] = {};
+        float directionX[N] = {};
+        float directionY[N] = {};
+        float directionZ[N] = {};
+        float invDirX[N] = {};
+        float invDirY[N] = {};
+        float invDirZ[N] = {};
+        float tMax[N] = {};
+
+        void setRay(int i, const Ray& ray)
+        {
+            originX[i] = ray.origin.x;
+            originY[i] = ray.origin.y;
+            originZ[i] = ray.origin.z;
+            directionX[i] = ray.direction.x;
+            directionY[i] = ray.direction.y;
+            directionZ[i] = ray.direction.z;
+            invDirX[i] = 1.0f / ray.direction.x;
+            invDirY[i] = 1.0f / ray.direction.y;
+            invDirZ[i] = 1.0f / ray.direction.z;
+            tMax[i] = ray.tMax;
+        }
+
+        Ray getRay(int i) const
+        {
+            Ray ray;
+            ray.origin = glm::vec3(originX[i], originY[i], originZ[i]);
+            ray.direction = glm::vec3(directionX[i], directionY[i], directionZ[i]);
+            ray.tMax = tMax[i];
+            return ray;
+        }
+    };
+
+    struct TraversalStats
+    {
+        uint64_t numRays = 0;
+        uint64_t nodeVisits = 0;
+        uint64_t boxTests = 0;
+        uint64_t primTests = 0;
+        // Instance leaves entered, each one transforms the ray and walks a BLAS
+        uint64_t instanceVisits = 0;
+        // Addresses of the nodes read in traversal order, for cache simulations. Only recorded if set
+        std::vector<const void*>* nodeFetches = nullptr;
+    };
+
+    // Slab test, returns the entry distance clamped to the ray origin or -1 on a miss.
+    // Boxes behind the origin or beyond tMax are misses
+    inline float intersectAABB(const glm::vec3& minCorner, const glm::vec3& maxCorner, const glm::vec3& origin, const glm::vec3& invDir, float tMax)
+    {
+        glm::vec3 f = (maxCorner - origin) * invDir;
+        glm::vec3 n = (minCorner - origin) * invDir;
+
+        glm::vec3 tmax = glm::max(f, n);
+        glm::vec3 tmin = glm::min(f, n);
+
+        float t1 = glm::min(tmax.x, glm::min(tmax.y, tmax.z));
+        float t0 = glm::max(tmin.x, glm::max(tmin.y, tmin.z));
+        t0 = glm::max(t0, 0.0f);
+
+        return (t1 >= t0 && t0 < tMax) ? t0 : -1.0f;
+    }
+
+    // Moller-Trumbore test matching the one in trace.comp, on the first vertex and the edges
+    // to the other two
+    inline bool intersectTriangleEdges(const glm::vec3& v0, const glm::vec3& e0, const glm::vec3& e1, const Ray& ray, float& t, float& u, float& v)
+    {
+        glm::vec3 p = glm::cross(ray.direction, e1);
+        float a = glm::dot(e0, p);
+        if (glm::abs(a) < 0.0001f)
+            return false;
+        float f = 1.0f / a;
+        glm::vec3 s = ray.origin - v0;
+        u = f * glm::dot(s, p);
+        if (u < 0.0f || u > 1.0f)
+            return false;
+        glm::vec3 q = glm::cross(s, e0);
+        v = f * glm::dot(ray.direction, q);
+        if (v < 0.0f || (u + v) > 1.0f)
+            return false;
+        t = glm::dot(e1, q) * f;
+        return t > 0.0f;
+    }
+
+    inline bool intersectTriangle(const glm::vec3& v0, const glm::vec3& v1, const glm::vec3& v2, const Ray& ray, float& t, float& u, float& v)
+    {
+        return intersectTriangleEdges(v0, v1 - v0, v2 - v0, ray, t, u, v);
+    }
+
+    // intersectAABB for every lane of a packet, returns the mask of lanes that hit and their
+    // entry distances. Operand order keeps NaN lanes identical to the scalar test
+    template<int N>
+    inline int intersectAABBPacket(const glm::vec3& minCorner, const glm::vec3& maxCorner, const SimdFloat<N>* origin, const SimdFloat<N>* invDir, const SimdFloat<N>& tMax, SimdFloat<N>& tEntry)
+    {
+        SimdFloat<N> tmin[3];
+        SimdFloat<N> tmax[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            SimdFloat<N> f = simdMul(simdSub(simdBroadcast<N>(maxCorner[axis]), origin[axis]), invDir[axis]);
+            SimdFloat<N> n = simdMul(simdSub(simdBroadcast<N>(minCorner[axis]), origin[axis]), invDir[axis]);
+            tmax[axis] = simdMax(n, f);
+            tmin[axis] = simdMin(n, f);
+        }
+        SimdFloat<N> t1 = simdMin(simdMin(tmax[2], tmax[1]), tmax[0]);
+        SimdFloat<N> t0 = simdMax(simdMax(tmin[2], tmin[1]), tmin[0]);
+        t0 = simdMax(simdBroadcast<N>(0.0f), t0);
+        tEntry = t0;
+        return simdGreaterEqual(t1, t0) & simdLess(t0, tMax);
+    }
+
+    // Box tests of all N child slots of a wide node at once, the bounds hold one axis each.
+    // Returns the mask of slots with a child the ray enters before tMax and stores their entry
+    // distances. Same results as intersectAABB slot by slot
+    template<int N>
+    inline int intersectWideChildren(const SimdFloat<N>* bboxMin, const SimdFloat<N>* bboxMax, int validMask, const SimdFloat<N>* origin, const SimdFloat<N>* invDir, const SimdFloat<N>& tMax, float* dists)
+    {
+        SimdFloat<N> tmin[3];
+        SimdFloat<N> tmax[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            SimdFloat<N> f = simdMul(simdSub(bboxMax[axis], origin[axis]), invDir[axis]);
+            SimdFloat<N> n = simdMul(simdSub(bboxMin[axis], origin[axis]), invDir[axis]);
+            tmax[axis] = simdMax(n, f);
+            tmin[axis] = simdMin(n, f);
+        }
+        SimdFloat<N> t1 = simdMin(simdMin(tmax[2], tmax[1]), tmax[0]);
+        SimdFloat<N> t0 = simdMax(simdMax(tmin[2], tmin[1]), tmin[0]);
+        t0 = simdMax(simdBroadcast<N>(0.0f), t0);
+        simdStore(dists, t0);
+
+        // Empty slots are inverted boxes, which the slab test would still enter, validMask
+        // has the bits of the used slots
+        return simdGreaterEqual(t1, t0) & simdLess(t0, tMax) & validMask;
+    }
+
+    template<int N>
+    inline int intersectWideChildren(const BvhTranslator::WideNode<N>& node, const SimdFloat<N>* origin, const SimdFloat<N>* invDir, const SimdFloat<N>& tMax, float* dists)
+    {
+        SimdFloat<N> bboxMin[3] = { simdLoad<N>(node.bboxMinX), simdLoad<N>(node.bboxMinY), simdLoad<N>(node.bboxMinZ) };
+        SimdFloat<N> bboxMax[3] = { simdLoad<N>(node.bboxMaxX), simdLoad<N>(node.bboxMaxY), simdLoad<N>(node.bboxMaxZ) };
+        int validMask = 0;
+        for (int i = 0; i < N; ++i)
+            validMask |= node.children[i] >= 0 ? 1 << i : 0;
+        return intersectWideChildren<N>(bboxMin, bboxMax, validMask, origin, invDir, tMax, dists);
+    }
+
+    // Compressed child bounds are dequantized in registers, the box tests are the same
+    template<int N>
+    inline int intersectWideChildren(const BvhTranslator::CompressedNode<N>& node, const SimdFloat<N>* origin, const SimdFloat<N>* invDir, const SimdFloat<N>& tMax, float* dists)
+    {
+        const uint8_t* qMin[3] = { node.qMinX, node.qMinY, node.qMinZ };
+        const uint8_t* qMax[3] = { node.qMaxX, node.qMaxY, node.qMaxZ };
+        SimdFloat<N> bboxMin[3];
+        SimdFloat<N> bboxMax[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            SimdFloat<N> boxOrigin = simdBroadcast<N>(node.origin[axis]);
+            SimdFloat<N> scale = simdBroadcast<N>(exponentScale(node.exponents[axis]));
+            bboxMin[axis] = simdAdd(boxOrigin, simdMul(simdLoadBytes<N>(qMin[axis]), scale));
+            bboxMax[axis] = simdAdd(boxOrigin, simdMul(simdLoadBytes<N>(qMax[axis]), scale));
+        }
+        int validMask = 0;
+        for (int i = 0; i < N; ++i)
+            validMask |= node.meta[i] != 0 ? 1 << i : 0;
+        return intersectWideChildren<N>(bboxMin, bboxMax, validMask, origin, invDir, tMax, dists);
+    }
+
+    // CPU reference traversal of the flattened nodes produced by BvhTranslator. Leaves of type 1
+    // call intersector(primIdx, ray, hit) which updates hit and returns true when it got closer,
+    // leaves of type 2 continue in the instance BLAS with the ray in object space.
+    class BvhTraversal
+    {
+    public:
+        BvhTraversal(BvhTranslator* translator);
+        ~BvhTraversal();
+        // Picks up a transform changed by BvhTranslator::refit or a newly inserted instance
+        void updateInstance(int instanceIdx);
+
+        template<typename PrimIntersector>
+        bool intersect(const Ray& ray, Hit& hit, PrimIntersector& intersector, TraversalStats* stats = nullptr)
+        {
+            if (stats)
+                stats->numRays++;
+            return traverse<PrimIntersector, false>(mTranslator->mTopIndex, ray, -1, hit, intersector, stats);
+        }
+
+        template<typename PrimIntersector>
+        bool occluded(const Ray& ray, PrimIntersector& intersector, TraversalStats* stats = nullptr)
+        {
+            if (stats)
+                stats->numRays++;
+            Hit hit;
+            hit.t = ray.tMax;
+            return traverse<PrimIntersector, true>(mTranslator->mTopIndex, ray, -1, hit, intersector, stats);
+        }
+        // Same queries without a stack, following the miss links of BvhTranslator::Node. Children
+        // are visited in their stored order instead of the closer one first
+        template<typename PrimIntersector>
+        bool intersectThreaded(const Ray& ray, Hit& hit, PrimIntersector& intersector, TraversalStats* stats = nullptr)
+        {
+            if (stats)
+                stats->numRays++;
+            return traverseThreaded<PrimIntersector, false>(ray, hit, intersector, stats);
+        }
+
+        template<typename PrimIntersector>
+        bool occludedThreaded(const Ray& ray, PrimIntersector& intersector, TraversalStats* stats = nullptr)
+        {
+            if (stats)
+                stats->numRays++;
+            Hit hit;
+            hit.t = ray.tMax;
+            return traverseThreaded<PrimIntersector, true>(ray, hit, intersector, stats);
+        }
+
+        // Queries of up to N coherent rays over the binary nodes, N is 4, 8 or 16. The packet shares
+        // every node fetch and box test, lanes whose ray misses a node are masked out below it.
+        // Lanes outside activeMask are ignored, hits are updated like in intersect. Returns the
+        // mask of lanes that found a hit
+        template<int N, typename PrimIntersector>
+        int intersectPacket(const RayPacket<N>& packet, int activeMask, Hit* hits, PrimIntersector& intersector, TraversalStats* stats = nullptr)
+        {
+            if (stats)
+                stats->numRays += laneCount(activeMask);
+            alignas(64) float hitT[N];
+            for (int i = 0; i < N; ++i)
+                hitT[i] = hits[i].t;
+            int doneMask = 0;
+            return traversePacket<N, PrimIntersector, false>(mTranslator->mTopIndex, packet, activeMask, -1, hits, hitT, doneMask, intersector, stats);
+        }
+
+        template<int N, typename PrimIntersector>
+        int occludedPacket(const RayPacket<N>& packet, int activeMask, PrimIntersector& intersector, TraversalStats* stats = nullptr)
+        {
+            if (stats)
+                stats->numRays += laneCount(activeMask);
+            Hit hits[N];
+            alignas(64) float hitT[N];
+            for (int i = 0; i < N; ++i)
+            {
+                hits[i].t = packet.tMax[i];
+                hitT[i] = packet.tMax[i];
+            }
+            int doneMask = 0;
+            return traversePacket<N, PrimIntersector, true>(mTranslator->mTopIndex, packet, activeMask, -1, hits, hitT, doneMask, intersector, stats);
+        }
+
+        // Same queries over the wide nodes of BvhTranslator::processWide, which processCompressed
+        // partly frees
+        template<int N, typename PrimIntersector>
+        bool intersectWide(const Ray& ray, Hit& hit, PrimIntersector& intersector, TraversalStats* stats = nullptr)
+        {
+            if (stats)
+                stats->numRays++;
+            return traverseWide<N, PrimIntersector, false>(wideNodes<N>(), mTranslator->mWideTopIndex, ray, -1, hit, intersector, stats);
+        }
+
+        template<int N, typename PrimIntersector>
+        bool occludedWide(const Ray& ray, PrimIntersector& intersector, TraversalStats* stats = nullptr)
+        {
+            if (stats)
+                stats->numRays++;
+            Hit hit;
+            hit.t = ray.tMax;
+            return traverseWide<N, PrimIntersector, true>(wideNodes<N>(), mTranslator->mWideTopIndex, ray, -1, hit, intersector, stats);
+        }
+
+        // Same queries over the quantized nodes of BvhTranslator::processCompressed
+        template<int N, typename PrimIntersector>
+        bool intersectCompressed(const Ray& ray, Hit& hit, PrimIntersector& intersector, TraversalStats* stats = nullptr)
+        {
+            if (stats)
+                stats->numRays++;
+            return traverseWide<N, PrimIntersector, false>(compressedNodes<N>(), mTranslator->mWideTopIndex, ray, -1, hit, intersector, stats);
+        }
+
+        template<int N, typename PrimIntersector>
+        bool occludedCompressed(const Ray& ray, PrimIntersector& intersector, TraversalStats* stats = nullptr)
+        {
+            if (stats)
+                stats->numRays++;
+            Hit hit;
+            hit.t = ray.tMax;
+            return traverseWide<N, PrimIntersector, true>(compressedNodes<N>(), mTranslator->mWideTopIndex, ray, -1, hit, intersector, stats);
+        }
+    private:
+        template<int N>
+        const BvhTranslator::WideNode<N>* wideNodes();
+
+        template<int N>
+        const BvhTranslator::CompressedNode<N>* compressedNodes();
+
+        // children and counts of the slots of a wide node, compressed nodes decode them into
+        // the buffers
+        template<int N>
+        void nodeLinks(const BvhTranslator::WideNode<N>& node, const int*& children, const int*& counts, int* childBuffer, int* countBuffer)
+        {
+            children = node.children;
+            counts = node.counts;
+        }
+
+        template<int N>
+        void nodeLinks(const BvhTranslator::CompressedNode<N>& node, const int*& children, const int*& counts, int* childBuffer, int* countBuffer)
+        {
+            mTranslator->decodeLinks(node, childBuffer, countBuffer);
+            children = childBuffer;
+            counts = countBuffer;
+        }
+
+        template<int N, typename PrimIntersector, bool anyHit, typename WideNodeType>
+        bool traverseWide(const WideNodeType* nodes, int rootIdx, const Ray& ray, int instanceIdx, Hit& hit, PrimIntersector& intersector, TraversalStats* stats)
+        {
+            glm::vec3 invDir = 1.0f / ray.direction;
+            SimdFloat<N> origin[3] = { simdBroadcast<N>(ray.origin.x), simdBroadcast<N>(ray.origin.y), simdBroadcast<N>(ray.origin.z) };
+            SimdFloat<N> invDirs[3] = { simdBroadcast<N>(invDir.x), simdBroadcast<N>(invDir.y), simdBroadcast<N>(invDir.z) };
+            bool found = false;
+
+            // Entries are (children, counts) pairs of a node slot plus its entry distance
+            struct Entry
+            {
+                int children;
+                int counts;
+                float t;
+            };
+            TraversalStack<Entry> stack;
+            stack.push({ rootIdx, 0, 0.0f });
+            while (!stack.empty())
+            {
+                Entry entry = stack.pop();
+                if (entry.t >= hit.t)
+                    continue;
+                if (stats)
+                    stats->nodeVisits++;
+
+                if (entry.counts > 0)
+                {
+                    for (int i = 0; i < entry.counts; ++i)
+                    {
+                        if (stats)
+                            stats->primTests++;
+                        if (intersector(entry.children + i, ray, hit))
+                        {
+                            hit.primIdx = entry.children + i;
+                            hit.instanceIdx = instanceIdx;
+                            found = true;
+                            if (anyHit)
+                                return true;
+                        }
+                    }
+                    continue;
+                }
+
+                if (entry.counts < 0)
+                {
+                    if (stats)
+                        stats->instanceVisits++;
+                    int instance = -entry.counts - 1;
+                    const glm::mat4& invTransform = mInvTransforms[instance];
+                    Ray localRay;
+                    localRay.origin = glm::vec3(invTransform * glm::vec4(ray.origin, 1.0f));
+                    localRay.direction = glm::vec3(invTransform * glm::vec4(ray.direction, 0.0f));
+                    localRay.tMax = ray.tMax;
+                    if (traverseWide<N, PrimIntersector, anyHit>(nodes, entry.children, localRay, instance, hit, intersector, stats))
+                    {
+                        found = true;
+                        if (anyHit)
+                            return true;
+                    }
+                    continue;
+                }
+
+                const WideNodeType& node = nodes[entry.children];
+                if (stats && stats->nodeFetches)
+                    stats->nodeFetches->push_back(&node);
+                alignas(64) float dists[N];
+                int hitMask = intersectWideChildren<N>(node, origin, invDirs, simdBroadcast<N>(hit.t), dists);
+                if (stats)
+                    stats->boxTests += N;
+                if (hitMask == 0)
+                    continue;
+                const int* children;
+                const int* counts;
+                int childBuffer[N];
+                int countBuffer[N];
+                nodeLinks<N>(node, children, counts, childBuffer, countBuffer);
+
+                // Push hit children far to near so the nearest is popped first
+                int order[N];
+                int numHits = 0;
+                for (int lanes = hitMask; lanes != 0; lanes &= lanes - 1)
+                {
+                    int i = firstLane(lanes);
+                    int j = numHits++;
+                    while (j > 0 && dists[order[j - 1]] < dists[i])
+                    {
+                        order[j] = order[j - 1];
+                        j--;
+                    }
+                    order[j] = i;
+                }
+                for (int i = 0; i < numHits; ++i)
+                {
+                    int slot = order[i];
+                    stack.push({ children[slot], counts[slot], dists[slot] });
+                }
+            }
+            return found;
+        }
+
+        template<typename PrimIntersector, bool anyHit>
+        bool traverse(int rootIdx, const Ray& ray, int instanceIdx, Hit& hit, PrimIntersector& intersector, TraversalStats* stats)
+        {
+            const BvhTranslator::Node* nodes = mTranslator->mNodes.data();
+            glm::vec3 invDir = 1.0f / ray.direction;
+            bool found = false;
+
+            TraversalStack<int> stack;
+            stack.push(rootIdx);
+            while (!stack.empty())
+            {
+                const BvhTranslator::Node& node = nodes[stack.pop()];
+                if (stats)
+                    stats->nodeVisits++;
+                if (stats && stats->nodeFetches)
+                    stats->nodeFetches->push_back(&node);
+
+                if (node.leaf == 1)
+                {
+                    for (int i = 0; i < node.rightIndex; ++i)
+                    {
+                        if (stats)
+                            stats->primTests++;
+                        if (intersector(node.leftIndex + i, ray, hit))
+                        {
+                            hit.primIdx = node.leftIndex + i;
+                            hit.instanceIdx = instanceIdx;
+                            found = true;
+                            if (anyHit)
+                                return true;
+                        }
+                    }
+                }
+                else if (node.leaf == 2)
+                {
+                    if (stats)
+                        stats->instanceVisits++;
+                    const glm::mat4& invTransform = mInvTransforms[node.rightIndex];
+                    Ray localRay;
+                    localRay.origin = glm::vec3(invTransform * glm::vec4(ray.origin, 1.0f));
+                    localRay.direction = glm::vec3(invTransform * glm::vec4(ray.direction, 0.0f));
+                    localRay.tMax = ray.tMax;
+                    if (traverse<PrimIntersector, anyHit>(node.leftIndex, localRay, node.rightIndex, hit, intersector, stats))
+                    {
+                        found = true;
+                        if (anyHit)
+                            return true;
+                    }
+                }
+                else
+                {
+                    const BvhTranslator::Node& lc = nodes[node.leftIndex];
+                    const BvhTranslator::Node& rc = nodes[node.rightIndex];
+                    if (stats && stats->nodeFetches)
+                    {
+                        stats->nodeFetches->push_back(&lc);
+                        stats->nodeFetches->push_back(&rc);
+                    }
+                    float leftHit = intersectAABB(lc.bboxMin, lc.bboxMax, ray.origin, invDir, hit.t);
+                    float rightHit = intersectAABB(rc.bboxMin, rc.bboxMax, ray.origin, invDir, hit.t);
+                    if (stats)
+                        stats->boxTests += 2;
+
+                    bool traverseLeft = leftHit >= 0.0f;
+                    bool traverseRight = rightHit >= 0.0f;
+                    if (traverseLeft && traverseRight)
+                    {
+                        // Visit the closer child first
+                        if (leftHit > rightHit)
+                        {
+                            stack.push(node.leftIndex);
+                            stack.push(node.rightIndex);
+                        }
+                        else
+                        {
+                            stack.push(node.rightIndex);
+                            stack.push(node.leftIndex);
+                        }
+                    }
+                    else if (traverseLeft)
+                    {
+                        stack.push(node.leftIndex);
+                    }
+                    else if (traverseRight)
+                    {
+                        stack.push(node.rightIndex);
+                    }
+                }
+            }
+            return found;
+        }
+
+        // hitT mirrors hits[i].t for the box tests, any hit queries retire lanes in doneMask
+        template<int N, typename PrimIntersector, bool anyHit>
+        int traversePacket(int rootIdx, const RayPacket<N>& packet, int activeMask, int instanceIdx, Hit* hits, float* hitT, int& doneMask, PrimIntersector& intersector, TraversalStats* stats)
+        {
+            const BvhTranslator::Node* nodes = mTranslator->mNodes.data();
+            SimdFloat<N> origin[3] = { simdLoad<N>(packet.originX), simdLoad<N>(packet.originY), simdLoad<N>(packet.originZ) };
+            SimdFloat<N> invDir[3] = { simdLoad<N>(packet.invDirX), simdLoad<N>(packet.invDirY), simdLoad<N>(packet.invDirZ) };
+            int foundMask = 0;
+
+            struct Entry
+            {
+                int index;
+                int mask;
+            };
+            TraversalStack<Entry> stack;
+            stack.push({ rootIdx, activeMask });
+            while (!stack.empty() && (activeMask & ~doneMask) != 0)
+            {
+                Entry entry = stack.pop();
+                int mask = entry.mask & ~doneMask;
+                if (mask == 0)
+                    continue;
+                const BvhTranslator::Node& node = nodes[entry.index];
+                if (stats)
+                    stats->nodeVisits++;
+                if (stats && stats->nodeFetches)
+                    stats->nodeFetches->push_back(&node);
+
+                if (node.leaf == 1)
+                {
+                    for (int lanes = mask; lanes != 0; lanes &= lanes - 1)
+                    {
+                        int lane = firstLane(lanes);
+                        Ray ray = packet.getRay(lane);
+                        for (int i = 0; i < node.rightIndex; ++i)
+                        {
+                            if (stats)
+                                stats->primTests++;
+                            if (intersector(node.leftIndex + i, ray, hits[lane]))
+                            {
+                                hits[lane].primIdx = node.leftIndex + i;
+                                hits[lane].instanceIdx = instanceIdx;
+                                foundMask |= 1 << lane;
+                                if (anyHit)
+                                {
+                                    doneMask |= 1 << lane;
+                                    break;
+                                }
+                            }
+                        }
+                        hitT[lane] = hits[lane].t;
+                    }
+                }
+                else if (node.leaf == 2)
+                {
+                    if (stats)
+                        stats->instanceVisits++;
+                    // Same transform as the single ray traversal, lane by lane in SIMD
+                    const glm::mat4& m = mInvTransforms[node.rightIndex];
+                    SimdFloat<N> direction[3] = { simdLoad<N>(packet.directionX), simdLoad<N>(packet.directionY), simdLoad<N>(packet.directionZ) };
+                    RayPacket<N> localPacket;
+                    float* localOrigin[3] = { localPacket.originX, localPacket.originY, localPacket.originZ };
+                    float* localDirection[3] = { localPacket.directionX, localPacket.directionY, localPacket.directionZ };
+                    for (int axis = 0; axis < 3; ++axis)
+                    {
+                        SimdFloat<N> m0 = simdBroadcast<N>(m[0][axis]);
+                        SimdFloat<N> m1 = simdBroadcast<N>(m[1][axis]);
+                        SimdFloat<N> m2 = simdBroadcast<N>(m[2][axis]);
+                        SimdFloat<N> o = simdAdd(simdAdd(simdMul(m0, origin[0]), simdMul(m1, origin[1])), simdAdd(simdMul(m2, origin[2]), simdBroadcast<N>(m[3][axis])));
+                        SimdFloat<N> d = simdAdd(simdAdd(simdMul(m0, direction[0]), simdMul(m1, direction[1])), simdMul(m2, direction[2]));
+                        simdStore(localOrigin[axis], o);
+                        simdStore(localDirection[axis], d);
+                    }
+                    for (int i = 0; i < N; ++i)
+                    {
+                        localPacket.invDirX[i] = 1.0f / localPacket.directionX[i];
+                        localPacket.invDirY[i] = 1.0f / localPacket.directionY[i];
+                        localPacket.invDirZ[i] = 1.0f / localPacket.directionZ[i];
+                        localPacket.tMax[i] = packet.tMax[i];
+                    }
+                    foundMask |= traversePacket<N, PrimIntersector, anyHit>(node.leftIndex, localPacket, mask, node.rightIndex, hits, hitT, doneMask, intersector, stats);
+                }
+                else
+                {
+                    const BvhTranslator::Node& lc = nodes[node.leftIndex];
+                    const BvhTranslator::Node& rc = nodes[node.rightIndex];
+                    if (stats && stats->nodeFetches)
+                    {
+                        stats->nodeFetches->push_back(&lc);
+                        stats->nodeFetches->push_back(&rc);
+                    }
+                    SimdFloat<N> tHit = simdLoad<N>(hitT);
+                    SimdFloat<N> leftT, rightT;
+                    int leftMask = mask & intersectAABBPacket<N>(lc.bboxMin, lc.bboxMax, origin, invDir, tHit, leftT);
+                    int rightMask = mask & intersectAABBPacket<N>(rc.bboxMin, rc.bboxMax, origin, invDir, tHit, rightT);
+                    if (stats)
+                        stats->boxTests += 2 * laneCount(mask);
+
+                    // The child that most lanes entering both reach first is visited first
+                    int bothMask = leftMask & rightMask;
+                    bool rightFirst = 2 * laneCount(simdLess(rightT, leftT) & bothMask) > laneCount(bothMask);
+                    int firstIndex = rightFirst ? node.rightIndex : node.leftIndex;
+                    int firstMask = rightFirst ? rightMask : leftMask;
+                    int secondIndex = rightFirst ? node.leftIndex : node.rightIndex;
+                    int secondMask = rightFirst ? leftMask : rightMask;
+                    if (secondMask != 0)
+                        stack.push({ secondIndex, secondMask });
+                    if (firstMask != 0)
+                        stack.push({ firstIndex, firstMask });
+                }
+            }
+            return foundMask;
+        }
+
+        template<typename PrimIntersector, bool anyHit>
+        bool traverseThreaded(const Ray& ray, Hit& hit, PrimIntersector& intersector, TraversalStats* stats)
+        {
+            const BvhTranslator::Node* nodes = mTranslator->mNodes.data();
+            glm::vec3 worldInvDir = 1.0f / ray.direction;
+            bool found = false;
+
+            // Besides the current node the only state is the instance being traversed. Its BLAS
+            // subtree is done when the traversal reaches the miss link of the subtree root, then
+            // it resumes in the TLAS after the instance leaf
+            Ray localRay = ray;
+            glm::vec3 invDir = worldInvDir;
+            int instanceIdx = -1;
+            int exitIdx = -1;
+            int returnIdx = -1;
+            int index = mTranslator->mTopIndex;
+            while (true)
+            {
+                if (index == exitIdx)
+                {
+                    if (instanceIdx < 0)
+                        break;
+                    localRay = ray;
+                    invDir = worldInvDir;
+                    instanceIdx = -1;
+                    exitIdx = -1;
+                    index = returnIdx;
+                    continue;
+                }
+
+                const BvhTranslator::Node& node = nodes[index];
+                if (stats)
+                {
+                    stats->nodeVisits++;
+                    stats->boxTests++;
+                }
+                if (stats && stats->nodeFetches)
+                    stats->nodeFetches->push_back(&node);
+                if (intersectAABB(node.bboxMin, node.bboxMax, localRay.origin, invDir, hit.t) < 0.0f)
+                {
+                    index = node.missIndex;
+                    continue;
+                }
+
+                if (node.leaf == 0)
+                {
+                    index = node.leftIndex;
+                }
+                else if (node.leaf == 1)
+                {
+                    for (int i = 0; i < node.rightIndex; ++i)
+                    {
+                        if (stats)
+                            stats->primTests++;
+                        if (intersector(node.leftIndex + i, localRay, hit))
+                        {
+                            hit.primIdx = node.leftIndex + i;
+                            hit.instanceIdx = instanceIdx;
+                            found = true;
+                            if (anyHit)
+                                return true;
+                        }
+                    }
+                    index = node.missIndex;
+                }
+                else
+                {
+                    if (stats)
+                        stats->instanceVisits++;
+                    const glm::mat4& invTransform = mInvTransforms[node.rightIndex];
+                    localRay.origin = glm::vec3(invTransform * glm::vec4(ray.origin, 1.0f));
+                    localRay.direction = glm::vec3(invTransform * glm::vec4(ray.direction, 0.0f));
+                    invDir = 1.0f / localRay.direction;
+                    instanceIdx = node.rightIndex;
+                    returnIdx = node.missIndex;
+                    exitIdx = nodes[node.leftIndex].missIndex;
+                    index = node.leftIndex;
+                }
+            }
+            return found;
+        }
+    private:
+        BvhTranslator* mTranslator;
+        std::vector<glm::mat4> mInvTransforms;
+    };
+
+    template<>
+    inline const BvhTranslator::WideNode<2>* BvhTraversal::wideNodes<2>()
+    {
+        assert(mTranslator->mWideNodeBase == 0);
+        return mTranslator->mWideNodes2.data();
+    }
+
+    template<>
+    inline const BvhTranslator::WideNode<4>* BvhTraversal::wideNodes<4>()
+    {
+        assert(mTranslator->mWideNodeBase == 0);
+        return mTranslator->mWideNodes4.data();
+    }
+
+    template<>
+    inline const BvhTranslator::WideNode<8>* BvhTraversal::wideNodes<8>()
+    {
+        assert(mTranslator->mWideNodeBase == 0);
+        return mTranslator->mWideNodes8.data();
+    }
+
+    template<>
+    inline const BvhTranslator::CompressedNode<4>* BvhTraversal::compressedNodes<4>()
+    {
+        return mTranslator->mCompressedNodes4.data();
+    }
+
+    template<>
+    inline const BvhTranslator::CompressedNode<8>* BvhTraversal::compressedNodes<8>()
+    {
+        return mTranslator->mCompressedNodes8.data();
+    }
+}
+
+#endif
@@ -0,0 +1,206 @@
+#include "ClusterBuilder.h"
+#include "Morton.h"
+#include <limits>
+
+namespace accel {
+    static const int gChunkSize = 16 * 1024;
+
+    ClusterBuilder::ClusterBuilder(Bvh* bvh, ThreadPool* pool)
+        : mBvh(bvh), mPool(pool)
+    {
+    }
+
+    ClusterBuilder::~ClusterBuilder()
+    {
+    }
+
+    void ClusterBuilder::build(BBox* bounds, int numBound)
+    {
+        const Bvh::BuildSettings& settings = mBvh->mSettings;
+        mBvh->initNodeAllocator(2 * numBound - 1);
+        mBvh->mNodeCount = 2 * numBound - 1;
+
+        std::vector<uint64_t> codes;
+        computeMortonCodes(mPool, bounds, numBound, settings.mortonBits, codes, mOrder);
+        sortMortonCodes(mPool, settings.mortonBits, codes, mOrder);
+
+        // Leaves take the first numBound nodes in Morton order, merged nodes follow
+        Bvh::Node* nodes = &mBvh->mNodes[0];
+        mClusters.resize(numBound);
+        mClusterBounds.resize(numBound);
+        mNumPrims.resize(2 * numBound - 1);
+        mCosts.resize(2 * numBound - 1);
+        parallelFor(mPool, 0, numBound, gChunkSize, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                nodes[i].bound = bounds[mOrder[i]];
+                nodes[i].setLeaf(i, 1);
+                mClusters[i] = i;
+                mClusterBounds[i] = nodes[i].bound;
+                mNumPrims[i] = 1;
+                mCosts[i] = settings.intersectionCost * nodes[i].bound.surfaceArea();
+            }
+        });
+
+        int nextNode = numBound;
+        while (mClusters.size() > 1)
+        {
+            findNearestNeighbours();
+            nextNode = mergeClusters(nextNode);
+        }
+
+        // Merged subtrees are not contiguous in Morton order, so the leaves are renumbered in
+        // depth first order while small subtrees are collapsed
+        mPackedIndices.clear();
+        mPackedIndices.reserve(numBound);
+        mBvh->mRoot = mClusters[0];
+        collapseLeaves(mBvh->mRoot);
+        mBvh->mPackedIndices.swap(mPackedIndices);
+    }
+
+    void ClusterBuilder::findNearestNeighbours()
+    {
+        int numClusters = mClusters.size();
+        int radius = glm::max(mBvh->mSettings.clusterRadius, 1);
+        mNearest.resize(numClusters);
+        parallelFor(mPool, 0, numClusters, gChunkSize / 16, [&](int begin, int end)
+        {
+            // Every pair is measured once per chunk, row i holds the areas to i + 1 ... i + radius
+            int first = glm::max(begin - radius, 0);
+            std::vector<float> areas((end - first) * radius, std::numeric_limits<float>::max());
+            for (int i = first; i < end; ++i)
+            {
+                int last = glm::min(i + radius, numClusters - 1);
+                float* row = &areas[(i - first) * radius];
+                for (int j = i + 1; j <= last; ++j)
+                    row[j - i - 1] = BBox::grow(mClusterBounds[i], mClusterBounds[j]).surfaceArea();
+            }
+
+            for (int i = begin; i < end; ++i)
+            {
+                // Ties go to the lower index, which keeps the globally closest pair mutual
+                float bestArea = std::numeric_limits<float>::max();
+                int best = -1;
+                for (int j = glm::max(i - radius, first); j < i; ++j)
+                {
+                    float area = areas[(j - first) * radius + i - j - 1];
+                    if (area < bestArea)
+                    {
+                        bestArea = area;
+                        best = j;
+                    }
+                }
+                const float* row = &areas[(i - first) * radius];
+                for (int k = 0; k < radius && i + k + 1 < numClusters; ++k)
+                {
+                    if (row[k] < bestArea)
+                    {
+                        bestArea = row[k];
+                        best = i + k + 1;
+                    }
+                }
+                mNearest[i] = best;
+            }
+        });
+    }
+
+    int ClusterBuilder::mergeClusters(int nextNode)
+    {
+        // A mutual pair is merged by its lower index, node slots follow the cluster order so
+        // the tree does not depend on the thread count
+        const Bvh::BuildSettings& settings = mBvh->mSettings;
+        Bvh::Node* nodes = &mBvh->mNodes[0];
+        int numClusters = mClusters.size();
+        std::vector<int> nodeSlots(numClusters);
+        int numMerged = 0;
+        for (int i = 0; i < numClusters; ++i)
+        {
+            nodeSlots[i] = nextNode + numMerged;
+            if (mNearest[mNearest[i]] == i && i < mNearest[i])
+                numMerged++;
+        }
+
+        parallelFor(mPool, 0, numClusters, gChunkSize, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                int j = mNearest[i];
+                if (mNearest[j] != i)
+                    continue;
+                if (i > j)
+                {
+                    mClusters[i] = -1;
+                    continue;
+                }
+
+                int index = nodeSlots[i];
+                Bvh::Node& node = nodes[index];
+                node.setInternal(mClusters[i], mClusters[j]);
+                node.bound = BBox::grow(mClusterBounds[i], mClusterBounds[j]);
+
+                int numPrims = mNumPrims[mClusters[i]] + mNumPrims[mClusters[j]];
+                float area = node.bound.surfaceArea();
+                float cost = settings.traversalCost * area + mCosts[mClusters[i]] + mCosts[mClusters[j]];
+                if (numPrims <= settings.maxLeafPrims)
+                    cost = glm::min(cost, settings.intersectionCost * area * numPrims);
+                mNumPrims[index] = numPrims;
+                mCosts[index] = cost;
+
+                mClusters[i] = index;
+                mClusterBounds[i] = node.bound;
+            }
+        });
+
+        int numKept = 0;
+        for (int i = 0; i < numClusters; ++i)
+        {
+            if (mClusters[i] < 0)
+                continue;
+            mClusters[numKept] = mClusters[i];
+            mClusterBounds[numKept] = mClusterBounds[i];
+            numKept++;
+        }
+        mClusters.resize(numKept);
+        mClusterBounds.resize(numKept);
+        return nextNode + numMerged;
+    }
+
+    void ClusterBuilder::emitLeaves(int nodeIdx, std::vector<uint32_t>& order)
+    {
+        const Bvh::Node& node = mBvh->mNodes[nodeIdx];
+        if (node.isLeaf())
+        {
+            for (int i = 0; i < node.numPrims(); ++i)
+                order.push_back(mOrder[node.startIdx() + i]);
+            return;
+        }
+        emitLeaves(node.lc, order);
+        emitLeaves(node.rc, order);
+    }
+
+    void ClusterBuilder::collapseLeaves(int nodeIdx)
+    {
+        const Bvh::BuildSettings& settings = mBvh->mSettings;
+        Bvh::Node& node = mBvh->mNodes[nodeIdx];
+        if (node.isLeaf())
+        {
+            mPackedIndices.push_back(mOrder[node.startIdx()]);
+            node.setLeaf(mPackedIndices.size() - 1, 1);
+            return;
+        }
+
+        // The subtree becomes one leaf if that was its cheapest option
+        float leafCost = settings.intersectionCost * node.bound.surfaceArea() * mNumPrims[nodeIdx];
+        if (mNumPrims[nodeIdx] <= settings.maxLeafPrims && leafCost <= mCosts[nodeIdx])
+        {
+            int startIdx = mPackedIndices.size();
+            emitLeaves(nodeIdx, mPackedIndices);
+            node.setLeaf(startIdx, mPackedIndices.size() - startIdx);
+            return;
+        }
+
+        collapseLeaves(node.lc);
+        collapseLeaves(node.rc);
+    }
+}
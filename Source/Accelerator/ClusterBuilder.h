@@ -0,0 +1,37 @@
+#ifndef STAR_CLUSTERBUILDER_H
+#define STAR_CLUSTERBUILDER_H
+#include <vector>
+#include "Bvh.h"
+
+namespace accel {
+    // Parallel locally ordered clustering (Meister and Bittner 2018). Starts with one cluster
+    // per primitive in Morton order, every cluster looks for the neighbour within clusterRadius
+    // positions whose merged box has the smallest area, and mutual nearest neighbours are
+    // merged until one cluster is left. Leaves are collapsed bottom up with the SAH afterwards
+    class ClusterBuilder
+    {
+    public:
+        ClusterBuilder(Bvh* bvh, ThreadPool* pool);
+        ~ClusterBuilder();
+        void build(BBox* bounds, int numBound);
+    private:
+        void findNearestNeighbours();
+        int mergeClusters(int nextNode);
+        void emitLeaves(int nodeIdx, std::vector<uint32_t>& order);
+        void collapseLeaves(int nodeIdx);
+    private:
+        Bvh* mBvh;
+        ThreadPool* mPool;
+        std::vector<uint32_t> mOrder;
+        // Current clusters as node indices with their bounds, and the nearest neighbour of each
+        std::vector<int> mClusters;
+        std::vector<BBox> mClusterBounds;
+        std::vector<int> mNearest;
+        // Per node primitive count and best SAH cost for the leaf collapse
+        std::vector<int> mNumPrims;
+        std::vector<float> mCosts;
+        std::vector<uint32_t> mPackedIndices;
+    };
+}
+
+#endif
@@ -0,0 +1,241 @@
+#include "LinearBuilder.h"
+#include "Morton.h"
+#include <algorithm>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace accel {
+    static const int gChunkSize = 16 * 1024;
+    // Bounds of subtrees above this depth are computed as separate tasks
+    static const int gParallelBoundsDepth = 8;
+
+    static int countLeadingZeros(uint64_t x)
+    {
+        if (x == 0)
+            return 64;
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanReverse64(&index, x);
+        return 63 - (int)index;
+#else
+        return __builtin_clzll(x);
+#endif
+    }
+
+    LinearBuilder::LinearBuilder(Bvh* bvh, ThreadPool* pool)
+        : mBvh(bvh), mPool(pool)
+    {
+    }
+
+    LinearBuilder::~LinearBuilder()
+    {
+    }
+
+    void LinearBuilder::build(BBox* bounds, int numBound)
+    {
+        const Bvh::BuildSettings& settings = mBvh->mSettings;
+        mBvh->initNodeAllocator(2 * numBound - 1);
+        mBvh->mNodeCount = 2 * numBound - 1;
+
+        computeMortonCodes(bounds, numBound);
+        sortMortonCodes();
+
+        mBvh->mPackedIndices.assign(mOrder.begin(), mOrder.end());
+
+        if (!settings.linearTreelets)
+        {
+            mBvh->mRoot = emitHierarchy(0, numBound, 0);
+            computeNodeBounds(mBvh->mRoot, bounds, 0);
+            return;
+        }
+
+        // Split the sorted primitives into treelets sharing the top Morton bits
+        int mortonBits = settings.mortonBits > 30 ? 63 : 30;
+        int shift = mortonBits - glm::clamp(settings.treeletBits, 1, mortonBits);
+        std::vector<int> treeletStarts;
+        for (int i = 0; i < numBound; ++i)
+        {
+            if (i == 0 || (mCodes[i] >> shift) != (mCodes[i - 1] >> shift))
+                treeletStarts.push_back(i);
+        }
+        int numTreelets = treeletStarts.size();
+        treeletStarts.push_back(numBound);
+
+        // Treelet t with k primitives owns 2k-1 nodes starting at 2 * start - t
+        std::vector<int> treeletRoots(numTreelets);
+        std::vector<BBox> treeletBounds(numTreelets);
+        parallelFor(mPool, 0, numTreelets, 1, [&](int begin, int end)
+        {
+            for (int t = begin; t < end; ++t)
+            {
+                int first = treeletStarts[t];
+                int numPrims = treeletStarts[t + 1] - first;
+                treeletRoots[t] = emitHierarchy(first, numPrims, 2 * first - t);
+                computeNodeBounds(treeletRoots[t], bounds, gParallelBoundsDepth);
+                treeletBounds[t] = mBvh->mNodes[treeletRoots[t]].bound;
+            }
+        });
+
+        if (numTreelets == 1)
+        {
+            mBvh->mRoot = treeletRoots[0];
+            return;
+        }
+
+        // SAH over the treelets, its leaves are replaced by the treelet roots
+        Bvh::BuildSettings upperSettings = settings;
+        upperSettings.mode = Bvh::BuildMode::SAH;
+        upperSettings.maxLeafPrims = 1;
+        Bvh upper(upperSettings);
+        upper.build(&treeletBounds[0], numTreelets);
+
+        int nextNode = 2 * numBound - numTreelets;
+        mBvh->mRoot = emitUpperLevels(upper, upper.mRoot, treeletRoots, nextNode);
+    }
+
+    void LinearBuilder::computeMortonCodes(BBox* bounds, int numBound)
+    {
+        accel::computeMortonCodes(mPool, bounds, numBound, mBvh->mSettings.mortonBits, mCodes, mOrder);
+    }
+
+    void LinearBuilder::sortMortonCodes()
+    {
+        accel::sortMortonCodes(mPool, mBvh->mSettings.mortonBits, mCodes, mOrder);
+    }
+
+    int LinearBuilder::delta(int i, int j, int first, int last)
+    {
+        if (j < first || j > last)
+            return -1;
+        uint64_t diff = mCodes[i] ^ mCodes[j];
+        if (diff != 0)
+            return countLeadingZeros(diff);
+        // Duplicate codes are told apart by their sorted position
+        return 64 + countLeadingZeros((uint64_t)(uint32_t)(i ^ j));
+    }
+
+    int LinearBuilder::emitHierarchy(int first, int numPrims, int nodeOffset)
+    {
+        // Internal nodes use [nodeOffset, nodeOffset + numPrims - 1), leaves the numPrims nodes after them
+        int maxLeafPrims = glm::max(mBvh->mSettings.maxLeafPrims, 1);
+        Bvh::Node* nodes = &mBvh->mNodes[nodeOffset];
+        int leafOffset = nodeOffset + numPrims - 1;
+        if (numPrims <= maxLeafPrims)
+        {
+            nodes[0].setLeaf(first, numPrims);
+            return nodeOffset;
+        }
+
+        int last = first + numPrims - 1;
+        parallelFor(mPool, 0, numPrims - 1, gChunkSize, [&](int begin, int end)
+        {
+            for (int idx = begin; idx < end; ++idx)
+            {
+                int i = first + idx;
+
+                // Direction of the range and its other end
+                int d = delta(i, i + 1, first, last) - delta(i, i - 1, first, last) > 0 ? 1 : -1;
+                int deltaMin = delta(i, i - d, first, last);
+                int lengthMax = 2;
+                while (delta(i, i + lengthMax * d, first, last) > deltaMin)
+                    lengthMax *= 2;
+                int length = 0;
+                for (int t = lengthMax / 2; t >= 1; t /= 2)
+                {
+                    if (delta(i, i + (length + t) * d, first, last) > deltaMin)
+                        length += t;
+                }
+                int j = i + length * d;
+
+                // Nodes inside a range that becomes a leaf are never referenced
+                int rangeFirst = glm::min(i, j);
+                int rangeLast = glm::max(i, j);
+                if (rangeLast - rangeFirst + 1 <= maxLeafPrims)
+                    continue;
+
+                // Split position
+                int deltaNode = delta(i, j, first, last);
+                int split = 0;
+                int step = length;
+                do
+                {
+                    step = (step + 1) / 2;
+                    if (delta(i, i + (split + step) * d, first, last) > deltaNode)
+                        split += step;
+                } while (step > 1);
+                int gamma = i + split * d + glm::min(d, 0);
+
+                int lc, rc;
+                int leftFirst = rangeFirst;
+                int leftLast = gamma;
+                if (leftLast - leftFirst + 1 <= maxLeafPrims)
+                {
+                    lc = leafOffset + leftFirst - first;
+                    mBvh->mNodes[lc].setLeaf(leftFirst, leftLast - leftFirst + 1);
+                }
+                else
+                {
+                    lc = nodeOffset + gamma - first;
+                }
+
+                int rightFirst = gamma + 1;
+                int rightLast = rangeLast;
+                if (rightLast - rightFirst + 1 <= maxLeafPrims)
+                {
+                    rc = leafOffset + rightFirst - first;
+                    mBvh->mNodes[rc].setLeaf(rightFirst, rightLast - rightFirst + 1);
+                }
+                else
+                {
+                    rc = nodeOffset + gamma + 1 - first;
+                }
+                nodes[idx].setInternal(lc, rc);
+            }
+        });
+        return nodeOffset;
+    }
+
+    int LinearBuilder::emitUpperLevels(Bvh& upper, int nodeIdx, std::vector<int>& treeletRoots, int& nextNode)
+    {
+        const Bvh::Node& node = upper.mNodes[nodeIdx];
+        if (node.isLeaf())
+            return treeletRoots[upper.mPackedIndices[node.startIdx()]];
+
+        int dst = nextNode++;
+        int lc = emitUpperLevels(upper, node.lc, treeletRoots, nextNode);
+        int rc = emitUpperLevels(upper, node.rc, treeletRoots, nextNode);
+        Bvh::Node* nodes = &mBvh->mNodes[0];
+        nodes[dst].setInternal(lc, rc);
+        nodes[dst].bound = BBox::grow(nodes[lc].bound, nodes[rc].bound);
+        return dst;
+    }
+
+    void LinearBuilder::computeNodeBounds(int nodeIdx, BBox* bounds, int level)
+    {
+        Bvh::Node& node = mBvh->mNodes[nodeIdx];
+        if (node.isLeaf())
+        {
+            node.bound = BBox();
+            for (int i = node.startIdx(); i < node.startIdx() + node.numPrims(); ++i)
+            {
+                node.bound.grow(bounds[mOrder[i]]);
+            }
+            return;
+        }
+
+        if (level < gParallelBoundsDepth)
+        {
+            TaskGroup group(mPool);
+            group.run([&]() { computeNodeBounds(node.lc, bounds, level + 1); });
+            computeNodeBounds(node.rc, bounds, level + 1);
+            group.wait();
+        }
+        else
+        {
+            computeNodeBounds(node.lc, bounds, level + 1);
+            computeNodeBounds(node.rc, bounds, level + 1);
+        }
+        node.bound = BBox::grow(mBvh->mNodes[node.lc].bound, mBvh->mNodes[node.rc].bound);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef STAR_LINEARBUILDER_H
+#define STAR_LINEARBUILDER_H
+#include <vector>
+#include "Bvh.h"
+
+namespace accel {
+    // Builds a Bvh from Morton sorted primitive centroids (Karras 2012), optionally
+    // building the upper levels over Morton treelets with SAH as in HLBVH
+    class LinearBuilder
+    {
+    public:
+        LinearBuilder(Bvh* bvh, ThreadPool* pool);
+        ~LinearBuilder();
+        void build(BBox* bounds, int numBound);
+    private:
+        void computeMortonCodes(BBox* bounds, int numBound);
+        void sortMortonCodes();
+        int delta(int i, int j, int first, int last);
+        int emitHierarchy(int first, int numPrims, int nodeOffset);
+        int emitUpperLevels(Bvh& upper, int nodeIdx, std::vector<int>& treeletRoots, int& nextNode);
+        void computeNodeBounds(int nodeIdx, BBox* bounds, int level);
+    private:
+        Bvh* mBvh;
+        ThreadPool* mPool;
+        std::vector<uint64_t> mCodes;
+        std::vector<uint32_t> mOrder;
+    };
+}
+
+#endif
@@ -0,0 +1,122 @@
+#include "Morton.h"
+#include <algorithm>
+
+namespace accel {
+    static const int gChunkSize = 16 * 1024;
+
+    // Inserts two zero bits after each of the lower 10 bits
+    static uint64_t expandBits10(uint32_t x)
+    {
+        x = (x * 0x00010001u) & 0xFF0000FFu;
+        x = (x * 0x00000101u) & 0x0F00F00Fu;
+        x = (x * 0x00000011u) & 0xC30C30C3u;
+        x = (x * 0x00000005u) & 0x49249249u;
+        return x;
+    }
+
+    // Inserts two zero bits after each of the lower 21 bits
+    static uint64_t expandBits21(uint64_t x)
+    {
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8) & 0x100f00f00f00f00full;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2) & 0x1249249249249249ull;
+        return x;
+    }
+
+    void computeMortonCodes(ThreadPool* pool, BBox* bounds, int numBound, int mortonBits, std::vector<uint64_t>& codes, std::vector<uint32_t>& order)
+    {
+        BBox centroidBound;
+        for (int i = 0; i < numBound; ++i)
+        {
+            centroidBound.grow(bounds[i].center());
+        }
+
+        bool wide = mortonBits > 30;
+        float cells = wide ? (float)(1 << 21) : (float)(1 << 10);
+        glm::vec3 extent = centroidBound.diagonal();
+        glm::vec3 scale;
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            scale[dim] = extent[dim] > 0.0f ? cells / extent[dim] : 0.0f;
+        }
+
+        codes.resize(numBound);
+        order.resize(numBound);
+        parallelFor(pool, 0, numBound, gChunkSize, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                glm::vec3 p = (bounds[i].center() - centroidBound.mMin) * scale;
+                uint32_t x = (uint32_t)glm::clamp(p.x, 0.0f, cells - 1.0f);
+                uint32_t y = (uint32_t)glm::clamp(p.y, 0.0f, cells - 1.0f);
+                uint32_t z = (uint32_t)glm::clamp(p.z, 0.0f, cells - 1.0f);
+                if (wide)
+                    codes[i] = (expandBits21(x) << 2) | (expandBits21(y) << 1) | expandBits21(z);
+                else
+                    codes[i] = (expandBits10(x) << 2) | (expandBits10(y) << 1) | expandBits10(z);
+                order[i] = i;
+            }
+        });
+    }
+
+    void sortMortonCodes(ThreadPool* pool, int mortonBits, std::vector<uint64_t>& codes, std::vector<uint32_t>& order)
+    {
+        // Stable LSD radix sort with 8 bit digits, histograms are built per chunk
+        int numPrims = codes.size();
+        int numPasses = mortonBits > 30 ? 8 : 4;
+        int numChunks = (numPrims + gChunkSize - 1) / gChunkSize;
+        std::vector<uint64_t> tempCodes(numPrims);
+        std::vector<uint32_t> tempOrder(numPrims);
+        std::vector<int> histograms(numChunks * 256);
+
+        for (int pass = 0; pass < numPasses; ++pass)
+        {
+            int shift = pass * 8;
+            std::fill(histograms.begin(), histograms.end(), 0);
+            parallelFor(pool, 0, numChunks, 1, [&](int chunkBegin, int chunkEnd)
+            {
+                for (int c = chunkBegin; c < chunkEnd; ++c)
+                {
+                    int* histogram = &histograms[c * 256];
+                    int end = std::min((c + 1) * gChunkSize, numPrims);
+                    for (int i = c * gChunkSize; i < end; ++i)
+                    {
+                        histogram[(codes[i] >> shift) & 0xff]++;
+                    }
+                }
+            });
+
+            // Digit major, chunk minor offsets keep the sort stable
+            int offset = 0;
+            for (int digit = 0; digit < 256; ++digit)
+            {
+                for (int c = 0; c < numChunks; ++c)
+                {
+                    int count = histograms[c * 256 + digit];
+                    histograms[c * 256 + digit] = offset;
+                    offset += count;
+                }
+            }
+
+            parallelFor(pool, 0, numChunks, 1, [&](int chunkBegin, int chunkEnd)
+            {
+                for (int c = chunkBegin; c < chunkEnd; ++c)
+                {
+                    int* offsets = &histograms[c * 256];
+                    int end = std::min((c + 1) * gChunkSize, numPrims);
+                    for (int i = c * gChunkSize; i < end; ++i)
+                    {
+                        int dst = offsets[(codes[i] >> shift) & 0xff]++;
+                        tempCodes[dst] = codes[i];
+                        tempOrder[dst] = order[i];
+                    }
+                }
+            });
+            codes.swap(tempCodes);
+            order.swap(tempOrder);
+        }
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef STAR_MORTON_H
+#define STAR_MORTON_H
+#include <vector>
+#include "BBox.h"
+#include "ThreadPool.h"
+
+namespace accel {
+    // Morton codes of the bound centers quantized in their centroid bound, 30 or 63 bits.
+    // order is reset to the identity
+    void computeMortonCodes(ThreadPool* pool, BBox* bounds, int numBound, int mortonBits, std::vector<uint64_t>& codes, std::vector<uint32_t>& order);
+    // Stable parallel radix sort by code, order is permuted along
+    void sortMortonCodes(ThreadPool* pool, int mortonBits, std::vector<uint64_t>& codes, std::vector<uint32_t>& order);
+}
+
+#endif
@@ -0,0 +1,191 @@
+#include "PreSplitter.h"
+#include "Bvh.h"
+#include <algorithm>
+#include <cmath>
+
+namespace accel {
+    // Triangles clipped to a box have at most 9 vertices
+    static const int gMaxClipVertices = 9;
+    static const int gChunkSize = 4 * 1024;
+    // Keeps a single huge triangle from taking the whole budget
+    static const int gMaxSplitsPerTriangle = 64;
+
+    static bool isValid(const BBox& bound)
+    {
+        return bound.mMin.x <= bound.mMax.x && bound.mMin.y <= bound.mMax.y && bound.mMin.z <= bound.mMax.z;
+    }
+
+    // Bounds of the part of a triangle inside a box, Sutherland-Hodgman against the six slabs
+    static BBox clipTriangle(const glm::vec3* triangle, const BBox& box)
+    {
+        glm::vec3 polygon[gMaxClipVertices + 6];
+        glm::vec3 clipped[gMaxClipVertices + 6];
+        int numVertices = 3;
+        for (int i = 0; i < 3; ++i)
+            polygon[i] = triangle[i];
+
+        for (int plane = 0; plane < 6 && numVertices > 0; ++plane)
+        {
+            int axis = plane >> 1;
+            float sign = (plane & 1) ? -1.0f : 1.0f;
+            float offset = (plane & 1) ? box.mMax[axis] : box.mMin[axis];
+            int numClipped = 0;
+            for (int i = 0; i < numVertices; ++i)
+            {
+                const glm::vec3& a = polygon[i];
+                const glm::vec3& b = polygon[(i + 1) % numVertices];
+                float da = (a[axis] - offset) * sign;
+                float db = (b[axis] - offset) * sign;
+                if (da >= 0.0f)
+                    clipped[numClipped++] = a;
+                if ((da >= 0.0f) != (db >= 0.0f))
+                    clipped[numClipped++] = a + (b - a) * (da / (da - db));
+            }
+            numVertices = numClipped;
+            for (int i = 0; i < numVertices; ++i)
+                polygon[i] = clipped[i];
+        }
+
+        // Intersection points may land slightly outside the box
+        BBox bound;
+        for (int i = 0; i < numVertices; ++i)
+            bound.grow(polygon[i]);
+        bound.mMin = glm::max(bound.mMin, box.mMin);
+        bound.mMax = glm::min(bound.mMax, box.mMax);
+        return bound;
+    }
+
+    PreSplitter::PreSplitter(ThreadPool* pool)
+        : mPool(pool)
+    {
+    }
+
+    PreSplitter::~PreSplitter()
+    {
+    }
+
+    void PreSplitter::split(const glm::vec3* vertices, const uint32_t* indices, int numTris, float budget, std::vector<BBox>& bounds, std::vector<uint32_t>& triIndices)
+    {
+        std::vector<float> priorities(numTris);
+        std::vector<BBox> triBounds(numTris);
+        parallelFor(mPool, 0, numTris, gChunkSize, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                glm::vec3 triangle[3];
+                loadTriangle(vertices, indices, i, triangle);
+                triBounds[i] = BBox(triangle[0]);
+                triBounds[i].grow(triangle[1]);
+                triBounds[i].grow(triangle[2]);
+                priorities[i] = computePriority(triangle);
+            }
+        });
+
+        // Splits are floor(scale * priority), the largest scale that stays within the budget
+        // is found by bisection
+        int maxSplits = (int)(numTris * glm::max(budget, 0.0f));
+        float maxPriority = 0.0f;
+        for (int i = 0; i < numTris; ++i)
+            maxPriority = glm::max(maxPriority, priorities[i]);
+
+        std::vector<int> numSplits(numTris, 0);
+        if (maxSplits > 0 && maxPriority > 0.0f)
+        {
+            auto countSplits = [&](float scale)
+            {
+                int64_t count = 0;
+                for (int i = 0; i < numTris; ++i)
+                    count += glm::min((int)(scale * priorities[i]), gMaxSplitsPerTriangle);
+                return count;
+            };
+
+            float low = 0.0f;
+            float high = gMaxSplitsPerTriangle / maxPriority;
+            for (int i = 0; i < 32; ++i)
+            {
+                float scale = (low + high) * 0.5f;
+                if (countSplits(scale) <= maxSplits)
+                    low = scale;
+                else
+                    high = scale;
+            }
+            for (int i = 0; i < numTris; ++i)
+                numSplits[i] = glm::min((int)(low * priorities[i]), gMaxSplitsPerTriangle);
+        }
+
+        // References of every chunk are collected separately and appended in chunk order,
+        // which keeps the reference order independent of the thread count
+        int numChunks = (numTris + gChunkSize - 1) / gChunkSize;
+        std::vector<std::vector<BBox>> chunkBounds(numChunks);
+        std::vector<std::vector<uint32_t>> chunkIndices(numChunks);
+        parallelFor(mPool, 0, numChunks, 1, [&](int chunkBegin, int chunkEnd)
+        {
+            for (int c = chunkBegin; c < chunkEnd; ++c)
+            {
+                int end = glm::min((c + 1) * gChunkSize, numTris);
+                for (int i = c * gChunkSize; i < end; ++i)
+                {
+                    glm::vec3 triangle[3];
+                    loadTriangle(vertices, indices, i, triangle);
+                    splitTriangle(triangle, triBounds[i], numSplits[i], chunkBounds[c]);
+                    chunkIndices[c].resize(chunkBounds[c].size(), i);
+                }
+            }
+        });
+
+        bounds.clear();
+        triIndices.clear();
+        for (int c = 0; c < numChunks; ++c)
+        {
+            bounds.insert(bounds.end(), chunkBounds[c].begin(), chunkBounds[c].end());
+            triIndices.insert(triIndices.end(), chunkIndices[c].begin(), chunkIndices[c].end());
+        }
+    }
+
+    float PreSplitter::computePriority(const glm::vec3* triangle)
+    {
+        // Infinitely many splits would shrink the boxes to the triangle projected on the three
+        // axis planes, twice. What splitting can remove is the box area above that
+        BBox bound(triangle[0]);
+        bound.grow(triangle[1]);
+        bound.grow(triangle[2]);
+        glm::vec3 normal = glm::cross(triangle[1] - triangle[0], triangle[2] - triangle[0]);
+        float idealArea = glm::abs(normal.x) + glm::abs(normal.y) + glm::abs(normal.z);
+        float excess = bound.surfaceArea() - idealArea;
+        return excess > 0.0f ? std::cbrt(excess) : 0.0f;
+    }
+
+    void PreSplitter::splitTriangle(const glm::vec3* triangle, const BBox& bound, int numSplits, std::vector<BBox>& bounds)
+    {
+        if (numSplits == 0)
+        {
+            bounds.push_back(bound);
+            return;
+        }
+
+        // Halve the longest axis, the remaining splits go to the halves by their longest extent
+        BBox box = bound;
+        int dim = box.maximumExtent();
+        float position = (box.mMin[dim] + box.mMax[dim]) * 0.5f;
+        BBox leftBox = box;
+        BBox rightBox = box;
+        leftBox.mMax[dim] = position;
+        rightBox.mMin[dim] = position;
+        BBox left = clipTriangle(triangle, leftBox);
+        BBox right = clipTriangle(triangle, rightBox);
+        if (!isValid(left) || !isValid(right))
+        {
+            bounds.push_back(bound);
+            return;
+        }
+
+        glm::vec3 leftExtent = left.diagonal();
+        glm::vec3 rightExtent = right.diagonal();
+        float leftSize = glm::max(leftExtent.x, glm::max(leftExtent.y, leftExtent.z));
+        float rightSize = glm::max(rightExtent.x, glm::max(rightExtent.y, rightExtent.z));
+        int remaining = numSplits - 1;
+        int leftSplits = leftSize + rightSize > 0.0f ? (int)(remaining * leftSize / (leftSize + rightSize) + 0.5f) : remaining / 2;
+        splitTriangle(triangle, left, leftSplits, bounds);
+        splitTriangle(triangle, right, remaining - leftSplits, bounds);
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef STAR_PRESPLITTER_H
+#define STAR_PRESPLITTER_H
+#include <vector>
+#include "BBox.h"
+#include "ThreadPool.h"
+
+namespace accel {
+    // Early split clipping of large, badly aligned triangles (Ernst and Greiner 2007, with the
+    // split distribution of Karras and Aila 2013). The box of such a triangle is cut in half
+    // along its longest axis a number of times and every piece is bounded by the clipped
+    // triangle. The split budget goes to the triangles whose box area exceeds the area of the
+    // triangle itself the most
+    class PreSplitter
+    {
+    public:
+        PreSplitter(ThreadPool* pool);
+        ~PreSplitter();
+        // Fills one bound and triangle index per reference, budget is the number of extra
+        // references as a fraction of numTris. Triangles are read as in Bvh::buildTriangles
+        void split(const glm::vec3* vertices, const uint32_t* indices, int numTris, float budget, std::vector<BBox>& bounds, std::vector<uint32_t>& triIndices);
+    private:
+        float computePriority(const glm::vec3* triangle);
+        void splitTriangle(const glm::vec3* triangle, const BBox& bound, int numSplits, std::vector<BBox>& bounds);
+    private:
+        ThreadPool* mPool;
+    };
+}
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef STAR_SIMD_H
+#define STAR_SIMD_H
+#include <cstdint>
+#include <cstring>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define STAR_SIMD_SSE 1
+#include <immintrin.h>
+#endif
+#if defined(__AVX__)
+#define STAR_SIMD_AVX 1
+#endif
+#if defined(__AVX512F__)
+#define STAR_SIMD_AVX512 1
+#endif
+
+namespace accel {
+    // Widest float vector of the compiler target
+#if defined(STAR_SIMD_AVX512)
+    static const int gSimdWidth = 16;
+#elif defined(STAR_SIMD_AVX)
+    static const int gSimdWidth = 8;
+#else
+    static const int gSimdWidth = 4;
+#endif
+
+    // N float lanes. Widths without a matching instruction set fall back to plain loops, so
+    // 8 lanes need AVX and 16 lanes AVX-512 to be fast. Comparisons return a bitmask with bit
+    // i set for lane i. min(a, b) and max(a, b) return b if either lane is NaN, like the SSE
+    // instructions
+    template<int N>
+    struct SimdFloat
+    {
+        float v[N];
+    };
+
+    template<int N>
+    inline SimdFloat<N> simdLoad(const float* p)
+    {
+        SimdFloat<N> r;
+        for (int i = 0; i < N; ++i)
+            r.v[i] = p[i];
+        return r;
+    }
+
+    template<int N>
+    inline SimdFloat<N> simdBroadcast(float f)
+    {
+        SimdFloat<N> r;
+        for (int i = 0; i < N; ++i)
+            r.v[i] = f;
+        return r;
+    }
+
+    // N bytes converted to floats
+    template<int N>
+    inline SimdFloat<N> simdLoadBytes(const uint8_t* p)
+    {
+        SimdFloat<N> r;
+        for (int i = 0; i < N; ++i)
+            r.v[i] = (float)p[i];
+        return r;
+    }
+
+    template<int N>
+    inline void simdStore(float* p, const SimdFloat<N>& a)
+    {
+        for (int i = 0; i < N; ++i)
+            p[i] = a.v[i];
+    }
+
+#define STAR_SIMD_GENERIC_OP(name, expr)                                    \
+    template<int N>                                                         \
+    inline SimdFloat<N> name(const SimdFloat<N>& a, const SimdFloat<N>& b)  \
+    {                                                                       \
+        SimdFloat<N> r;                                                     \
+        for (int i = 0; i < N; ++i)                                         \
+            r.v[i] = expr;                                                  \
+        return r;                                                           \
+    }
+
+#define STAR_SIMD_GENERIC_CMP(name, expr)                                   \
+    template<int N>                                                         \
+    inline int name(const SimdFloat<N>& a, const SimdFloat<N>& b)           \
+    {                                                                       \
+        int mask = 0;                                                       \
+        for (int i = 0; i < N; ++i)                                         \
+            mask |= (expr) ? 1 << i : 0;                                    \
+        return mask;                                                        \
+    }
+
+    STAR_SIMD_GENERIC_OP(simdAdd, a.v[i] + b.v[i])
+    STAR_SIMD_GENERIC_OP(simdSub, a.v[i] - b.v[i])
+    STAR_SIMD_GENERIC_OP(simdMul, a.v[i] * b.v[i])
+    STAR_SIMD_GENERIC_OP(simdMin, a.v[i] < b.v[i] ? a.v[i] : b.v[i])
+    STAR_SIMD_GENERIC_OP(simdMax, a.v[i] > b.v[i] ? a.v[i] : b.v[i])
+    STAR_SIMD_GENERIC_CMP(simdLess, a.v[i] < b.v[i])
+    STAR_SIMD_GENERIC_CMP(simdGreaterEqual, a.v[i] >= b.v[i])
+
+#undef STAR_SIMD_GENERIC_OP
+#undef STAR_SIMD_GENERIC_CMP
+
+#if defined(STAR_SIMD_SSE)
+    template<>
+    struct SimdFloat<4>
+    {
+        __m128 v;
+    };
+
+    template<> inline SimdFloat<4> simdLoad<4>(const float* p) { return { _mm_loadu_ps(p) }; }
+    template<> inline SimdFloat<4> simdBroadcast<4>(float f) { return { _mm_set1_ps(f) }; }
+    template<> inline void simdStore<4>(float* p, const SimdFloat<4>& a) { _mm_storeu_ps(p, a.v); }
+    inline __m128 loadBytes4(const uint8_t* p)
+    {
+        int bytes;
+        std::memcpy(&bytes, p, sizeof(int));
+        __m128i zero = _mm_setzero_si128();
+        __m128i words = _mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero);
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+    }
+    template<> inline SimdFloat<4> simdLoadBytes<4>(const uint8_t* p) { return { loadBytes4(p) }; }
+    inline SimdFloat<4> simdAdd(const SimdFloat<4>& a, const SimdFloat<4>& b) { return { _mm_add_ps(a.v, b.v) }; }
+    inline SimdFloat<4> simdSub(const SimdFloat<4>& a, const SimdFloat<4>& b) { return { _mm_sub_ps(a.v, b.v) }; }
+    inline SimdFloat<4> simdMul(const SimdFloat<4>& a, const SimdFloat<4>& b) { return { _mm_mul_ps(a.v, b.v) }; }
+    inline SimdFloat<4> simdMin(const SimdFloat<4>& a, const SimdFloat<4>& b) { return { _mm_min_ps(a.v, b.v) }; }
+    inline SimdFloat<4> simdMax(const SimdFloat<4>& a, const SimdFloat<4>& b) { return { _mm_max_ps(a.v, b.v) }; }
+    inline int simdLess(const SimdFloat<4>& a, const SimdFloat<4>& b) { return _mm_movemask_ps(_mm_cmplt_ps(a.v, b.v)); }
+    inline int simdGreaterEqual(const SimdFloat<4>& a, const SimdFloat<4>& b) { return _mm_movemask_ps(_mm_cmpge_ps(a.v, b.v)); }
+#endif
+
+#if defined(STAR_SIMD_AVX)
+    template<>
+    struct SimdFloat<8>
+    {
+        __m256 v;
+    };
+
+    template<> inline SimdFloat<8> simdLoad<8>(const float* p) { return { _mm256_loadu_ps(p) }; }
+    template<> inline SimdFloat<8> simdBroadcast<8>(float f) { return { _mm256_set1_ps(f) }; }
+    template<> inline void simdStore<8>(float* p, const SimdFloat<8>& a) { _mm256_storeu_ps(p, a.v); }
+    template<> inline SimdFloat<8> simdLoadBytes<8>(const uint8_t* p) { return { _mm256_insertf128_ps(_mm256_castps128_ps256(loadBytes4(p)), loadBytes4(p + 4), 1) }; }
+    inline SimdFloat<8> simdAdd(const SimdFloat<8>& a, const SimdFloat<8>& b) { return { _mm256_add_ps(a.v, b.v) }; }
+    inline SimdFloat<8> simdSub(const SimdFloat<8>& a, const SimdFloat<8>& b) { return { _mm256_sub_ps(a.v, b.v) }; }
+    inline SimdFloat<8> simdMul(const SimdFloat<8>& a, const SimdFloat<8>& b) { return { _mm256_mul_ps(a.v, b.v) }; }
+    inline SimdFloat<8> simdMin(const SimdFloat<8>& a, const SimdFloat<8>& b) { return { _mm256_min_ps(a.v, b.v) }; }
+    inline SimdFloat<8> simdMax(const SimdFloat<8>& a, const SimdFloat<8>& b) { return { _mm256_max_ps(a.v, b.v) }; }
+    inline int simdLess(const SimdFloat<8>& a, const SimdFloat<8>& b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+    inline int simdGreaterEqual(const SimdFloat<8>& a, const SimdFloat<8>& b) { return _mm256_movemask_ps(_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)); }
+#endif
+
+#if defined(STAR_SIMD_AVX512)
+    template<>
+    struct SimdFloat<16>
+    {
+        __m512 v;
+    };
+
+    template<> inline SimdFloat<16> simdLoad<16>(const float* p) { return { _mm512_loadu_ps(p) }; }
+    template<> inline SimdFloat<16> simdBroadcast<16>(float f) { return { _mm512_set1_ps(f) }; }
+    template<> inline void simdStore<16>(float* p, const SimdFloat<16>& a) { _mm512_storeu_ps(p, a.v); }
+    template<> inline SimdFloat<16> simdLoadBytes<16>(const uint8_t* p) { return { _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)p))) }; }
+    inline SimdFloat<16> simdAdd(const SimdFloat<16>& a, const SimdFloat<16>& b) { return { _mm512_add_ps(a.v, b.v) }; }
+    inline SimdFloat<16> simdSub(const SimdFloat<16>& a, const SimdFloat<16>& b) { return { _mm512_sub_ps(a.v, b.v) }; }
+    inline SimdFloat<16> simdMul(const SimdFloat<16>& a, const SimdFloat<16>& b) { return { _mm512_mul_ps(a.v, b.v) }; }
+    inline SimdFloat<16> simdMin(const SimdFloat<16>& a, const SimdFloat<16>& b) { return { _mm512_min_ps(a.v, b.v) }; }
+    inline SimdFloat<16> simdMax(const SimdFloat<16>& a, const SimdFloat<16>& b) { return { _mm512_max_ps(a.v, b.v) }; }
+    inline int simdLess(const SimdFloat<16>& a, const SimdFloat<16>& b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+    inline int simdGreaterEqual(const SimdFloat<16>& a, const SimdFloat<16>& b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_GE_OQ); }
+#endif
+
+    // Lowest set bit of a nonzero lane mask
+    inline int firstLane(int mask)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, (unsigned long)mask);
+        return (int)index;
+#else
+        return __builtin_ctz((unsigned int)mask);
+#endif
+    }
+
+    inline int laneCount(int mask)
+    {
+        int count = 0;
+        for (uint32_t bits = (uint32_t)mask; bits; bits &= bits - 1)
+            count++;
+        return count;
+    }
+}
+
+#endif
@@ -0,0 +1,367 @@
+#include "SplitBuilder.h"
+#include <algorithm>
+#include <limits>
+
+namespace accel {
+    // Refs deeper than this always become leaves, splitting can stop making progress
+    static const int gMaxSplitDepth = 64;
+
+    static bool isValid(const BBox& bound)
+    {
+        return bound.mMin.x <= bound.mMax.x && bound.mMin.y <= bound.mMax.y && bound.mMin.z <= bound.mMax.z;
+    }
+
+    static BBox intersectBounds(const BBox& bound1, const BBox& bound2)
+    {
+        BBox ret;
+        ret.mMin = glm::max(bound1.mMin, bound2.mMin);
+        ret.mMax = glm::min(bound1.mMax, bound2.mMax);
+        return ret;
+    }
+
+    SplitBuilder::SplitBuilder(Bvh* bvh, const glm::vec3* vertices, const uint32_t* indices)
+        : mBvh(bvh), mVertices(vertices), mIndices(indices)
+    {
+    }
+
+    SplitBuilder::~SplitBuilder()
+    {
+    }
+
+    void SplitBuilder::build(BBox* bounds, int numBound)
+    {
+        const Bvh::BuildSettings& settings = mBvh->mSettings;
+        mRootArea = mBvh->mBound.surfaceArea();
+        mNumReferences = numBound;
+        mMaxReferences = numBound + (int)(numBound * glm::max(settings.splitBudget, 0.0f));
+
+        // Every reference ends up in one leaf, so the budget also bounds the node count
+        mBvh->initNodeAllocator(2 * mMaxReferences - 1);
+        mBvh->mPackedIndices.reserve(mMaxReferences);
+
+        std::vector<Reference> refs(numBound);
+        for (int i = 0; i < numBound; ++i)
+        {
+            refs[i].bound = bounds[i];
+            refs[i].idx = i;
+        }
+        mBvh->mRoot = buildNode(refs, mBvh->mBound, 0);
+    }
+
+    int SplitBuilder::buildNode(std::vector<Reference>& refs, const BBox& bound, int level)
+    {
+        const Bvh::BuildSettings& settings = mBvh->mSettings;
+        int nodeIdx = mBvh->allocateNode();
+        mBvh->mNodes[nodeIdx].bound = bound;
+
+        int numRefs = refs.size();
+        if (numRefs < 2 || level >= gMaxSplitDepth)
+        {
+            return makeLeaf(nodeIdx, refs);
+        }
+
+        BBox centroidBound;
+        for (int i = 0; i < numRefs; ++i)
+        {
+            centroidBound.grow(refs[i].bound.center());
+        }
+
+        BBox nodeBound = bound;
+        float area = nodeBound.surfaceArea();
+        float invArea = area > 0.0f ? 1.0f / area : 0.0f;
+
+        Split split;
+        split.cost = std::numeric_limits<float>::max();
+        findObjectSplit(refs, centroidBound, invArea, split);
+
+        // Only look for spatial splits when the object split children overlap noticeably
+        if (split.dim >= 0 && mNumReferences < mMaxReferences)
+        {
+            BBox overlap = intersectBounds(split.leftBound, split.rightBound);
+            if (isValid(overlap) && overlap.surfaceArea() > settings.splitAlpha * mRootArea)
+            {
+                findSpatialSplit(refs, bound, invArea, split);
+            }
+        }
+
+        float leafCost = settings.intersectionCost * numRefs;
+        if (numRefs <= settings.maxLeafPrims && (split.dim < 0 || leafCost <= split.cost))
+        {
+            return makeLeaf(nodeIdx, refs);
+        }
+
+        std::vector<Reference> leftRefs;
+        std::vector<Reference> rightRefs;
+        if (split.dim < 0)
+        {
+            // All centroids coincide, split the references in half
+            leftRefs.assign(refs.begin(), refs.begin() + numRefs / 2);
+            rightRefs.assign(refs.begin() + numRefs / 2, refs.end());
+        }
+        else if (split.spatial)
+        {
+            int dim = split.dim;
+            float position = split.position;
+            int numStraddling = 0;
+            for (int i = 0; i < numRefs; ++i)
+            {
+                if (refs[i].bound.mMin[dim] < position && refs[i].bound.mMax[dim] > position)
+                    numStraddling++;
+            }
+
+            if (mNumReferences + numStraddling <= mMaxReferences)
+            {
+                for (int i = 0; i < numRefs; ++i)
+                {
+                    const Reference& ref = refs[i];
+                    if (ref.bound.mMax[dim] <= position)
+                    {
+                        leftRefs.push_back(ref);
+                    }
+                    else if (ref.bound.mMin[dim] >= position)
+                    {
+                        rightRefs.push_back(ref);
+                    }
+                    else
+                    {
+                        Reference leftRef = { clipReference(ref, dim, -std::numeric_limits<float>::max(), position), ref.idx };
+                        Reference rightRef = { clipReference(ref, dim, position, std::numeric_limits<float>::max()), ref.idx };
+                        bool leftValid = isValid(leftRef.bound);
+                        bool rightValid = isValid(rightRef.bound);
+                        if (leftValid)
+                            leftRefs.push_back(leftRef);
+                        if (rightValid)
+                            rightRefs.push_back(rightRef);
+                        if (leftValid && rightValid)
+                            mNumReferences++;
+                        else if (!leftValid && !rightValid)
+                            leftRefs.push_back(ref);
+                    }
+                }
+            }
+            else
+            {
+                // Over budget, redo the object split search alone
+                split = Split();
+                split.cost = std::numeric_limits<float>::max();
+                findObjectSplit(refs, centroidBound, invArea, split);
+            }
+        }
+
+        if (split.dim >= 0 && !split.spatial)
+        {
+            int dim = split.dim;
+            int numBins = glm::max(settings.numBins, 2);
+            float minValue = centroidBound.mMin[dim];
+            float scale = numBins / centroidBound.diagonal()[dim];
+            for (int i = 0; i < numRefs; ++i)
+            {
+                int bin = glm::min((int)((refs[i].bound.center()[dim] - minValue) * scale), numBins - 1);
+                if (bin < split.bin)
+                    leftRefs.push_back(refs[i]);
+                else
+                    rightRefs.push_back(refs[i]);
+            }
+        }
+
+        if (leftRefs.empty() || rightRefs.empty())
+        {
+            return makeLeaf(nodeIdx, refs);
+        }
+
+        std::vector<Reference>().swap(refs);
+
+        BBox leftBound, rightBound;
+        for (int i = 0; i < leftRefs.size(); ++i)
+        {
+            leftBound.grow(leftRefs[i].bound);
+        }
+        for (int i = 0; i < rightRefs.size(); ++i)
+        {
+            rightBound.grow(rightRefs[i].bound);
+        }
+
+        int lc = buildNode(leftRefs, leftBound, level + 1);
+        int rc = buildNode(rightRefs, rightBound, level + 1);
+        mBvh->mNodes[nodeIdx].setInternal(lc, rc);
+        return nodeIdx;
+    }
+
+    int SplitBuilder::makeLeaf(int nodeIdx, std::vector<Reference>& refs)
+    {
+        mBvh->mNodes[nodeIdx].setLeaf(mBvh->mPackedIndices.size(), refs.size());
+        for (int i = 0; i < refs.size(); ++i)
+        {
+            mBvh->mPackedIndices.push_back(refs[i].idx);
+        }
+        return nodeIdx;
+    }
+
+    void SplitBuilder::findObjectSplit(std::vector<Reference>& refs, const BBox& centroidBound, float invArea, Split& split)
+    {
+        const Bvh::BuildSettings& settings = mBvh->mSettings;
+        int numBins = glm::max(settings.numBins, 2);
+        BBox centroids = centroidBound;
+        glm::vec3 extent = centroids.diagonal();
+
+        std::vector<BBox> binBounds(numBins);
+        std::vector<int> binCounts(numBins);
+        std::vector<BBox> rightBounds(numBins);
+        std::vector<int> rightCounts(numBins);
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            if (extent[dim] <= 0.0f)
+                continue;
+
+            std::fill(binBounds.begin(), binBounds.end(), BBox());
+            std::fill(binCounts.begin(), binCounts.end(), 0);
+            float scale = numBins / extent[dim];
+            for (int i = 0; i < refs.size(); ++i)
+            {
+                int bin = glm::min((int)((refs[i].bound.center()[dim] - centroids.mMin[dim]) * scale), numBins - 1);
+                binCounts[bin]++;
+                binBounds[bin].grow(refs[i].bound);
+            }
+
+            BBox rightBound;
+            int rightCount = 0;
+            for (int i = numBins - 1; i > 0; --i)
+            {
+                rightBound.grow(binBounds[i]);
+                rightCount += binCounts[i];
+                rightBounds[i] = rightBound;
+                rightCounts[i] = rightCount;
+            }
+
+            BBox leftBound;
+            int leftCount = 0;
+            for (int i = 1; i < numBins; ++i)
+            {
+                leftBound.grow(binBounds[i - 1]);
+                leftCount += binCounts[i - 1];
+                if (leftCount == 0 || rightCounts[i] == 0)
+                    continue;
+
+                float cost = settings.traversalCost + settings.intersectionCost * invArea *
+                        (leftBound.surfaceArea() * leftCount + rightBounds[i].surfaceArea() * rightCounts[i]);
+                if (cost < split.cost)
+                {
+                    split.cost = cost;
+                    split.dim = dim;
+                    split.bin = i;
+                    split.spatial = false;
+                    split.leftBound = leftBound;
+                    split.rightBound = rightBounds[i];
+                }
+            }
+        }
+    }
+
+    void SplitBuilder::findSpatialSplit(std::vector<Reference>& refs, const BBox& bound, float invArea, Split& split)
+    {
+        const Bvh::BuildSettings& settings = mBvh->mSettings;
+        int numBins = glm::max(settings.numSpatialBins, 2);
+        BBox nodeBound = bound;
+        glm::vec3 extent = nodeBound.diagonal();
+
+        std::vector<BBox> binBounds(numBins);
+        std::vector<int> enters(numBins);
+        std::vector<int> exits(numBins);
+        std::vector<BBox> rightBounds(numBins);
+        std::vector<int> rightCounts(numBins);
+        for (int dim = 0; dim < 3; ++dim)
+        {
+            if (extent[dim] <= 0.0f)
+                continue;
+
+            std::fill(binBounds.begin(), binBounds.end(), BBox());
+            std::fill(enters.begin(), enters.end(), 0);
+            std::fill(exits.begin(), exits.end(), 0);
+            float binSize = extent[dim] / numBins;
+            float scale = numBins / extent[dim];
+            float origin = nodeBound.mMin[dim];
+
+            // Chop every reference into the bins it overlaps
+            for (int i = 0; i < refs.size(); ++i)
+            {
+                const Reference& ref = refs[i];
+                int firstBin = glm::clamp((int)((ref.bound.mMin[dim] - origin) * scale), 0, numBins - 1);
+                int lastBin = glm::clamp((int)((ref.bound.mMax[dim] - origin) * scale), firstBin, numBins - 1);
+                for (int bin = firstBin; bin <= lastBin; ++bin)
+                {
+                    float binMin = bin == firstBin ? -std::numeric_limits<float>::max() : origin + bin * binSize;
+                    float binMax = bin == lastBin ? std::numeric_limits<float>::max() : origin + (bin + 1) * binSize;
+                    BBox clipped = clipReference(ref, dim, binMin, binMax);
+                    if (isValid(clipped))
+                        binBounds[bin].grow(clipped);
+                }
+                enters[firstBin]++;
+                exits[lastBin]++;
+            }
+
+            BBox rightBound;
+            int rightCount = 0;
+            for (int i = numBins - 1; i > 0; --i)
+            {
+                rightBound.grow(binBounds[i]);
+                rightCount += exits[i];
+                rightBounds[i] = rightBound;
+                rightCounts[i] = rightCount;
+            }
+
+            BBox leftBound;
+            int leftCount = 0;
+            for (int i = 1; i < numBins; ++i)
+            {
+                leftBound.grow(binBounds[i - 1]);
+                leftCount += enters[i - 1];
+                if (leftCount == 0 || rightCounts[i] == 0)
+                    continue;
+
+                float cost = settings.traversalCost + settings.intersectionCost * invArea *
+                        (leftBound.surfaceArea() * leftCount + rightBounds[i].surfaceArea() * rightCounts[i]);
+                if (cost < split.cost)
+                {
+                    split.cost = cost;
+                    split.dim = dim;
+                    split.bin = i;
+                    split.spatial = true;
+                    split.position = origin + i * binSize;
+                    split.leftBound = leftBound;
+                    split.rightBound = rightBounds[i];
+                }
+            }
+        }
+    }
+
+    BBox SplitBuilder::clipReference(const Reference& ref, int dim, float minValue, float maxValue)
+    {
+        glm::vec3 v[3];
+        loadTriangle(mVertices, mIndices, ref.idx, v);
+        BBox clipped;
+        for (int i = 0; i < 3; ++i)
+        {
+            const glm::vec3& v0 = v[i];
+            const glm::vec3& v1 = v[(i + 1) % 3];
+            float p0 = v0[dim];
+            float p1 = v1[dim];
+            if (p0 >= minValue && p0 <= maxValue)
+                clipped.grow(v0);
+
+            // Edge crossings with both slab planes
+            float planes[2] = { minValue, maxValue };
+            for (int j = 0; j < 2; ++j)
+            {
+                float plane = planes[j];
+                if ((p0 < plane && p1 > plane) || (p0 > plane && p1 < plane))
+                {
+                    float t = (plane - p0) / (p1 - p0);
+                    glm::vec3 point = v0 + (v1 - v0) * t;
+                    point[dim] = plane;
+                    clipped.grow(point);
+                }
+            }
+        }
+        return intersectBounds(clipped, ref.bound);
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef STAR_SPLITBUILDER_H
+#define STAR_SPLITBUILDER_H
+#include <vector>
+#include "Bvh.h"
+
+namespace accel {
+    // Spatial split BVH (Stich et al. 2009). Triangles straddling a split plane may be
+    // referenced from both children with their bounds clipped to each side.
+    class SplitBuilder
+    {
+    public:
+        struct Reference
+        {
+            BBox bound;
+            int idx;
+        };
+
+        struct Split
+        {
+            float cost;
+            int dim = -1;
+            int bin;
+            bool spatial = false;
+            float position;
+            BBox leftBound;
+            BBox rightBound;
+        };
+    public:
+        SplitBuilder(Bvh* bvh, const glm::vec3* vertices, const uint32_t* indices);
+        ~SplitBuilder();
+        void build(BBox* bounds, int numBound);
+    private:
+        int buildNode(std::vector<Reference>& refs, const BBox& bound, int level);
+        int makeLeaf(int nodeIdx, std::vector<Reference>& refs);
+        void findObjectSplit(std::vector<Reference>& refs, const BBox& centroidBound, float invArea, Split& split);
+        void findSpatialSplit(std::vector<Reference>& refs, const BBox& bound, float invArea, Split& split);
+        BBox clipReference(const Reference& ref, int dim, float minValue, float maxValue);
+    private:
+        Bvh* mBvh;
+        const glm::vec3* mVertices;
+        const uint32_t* mIndices;
+        float mRootArea;
+        int mNumReferences;
+        int mMaxReferences;
+    };
+}
+
+#endif
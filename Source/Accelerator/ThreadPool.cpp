@@ -0,0 +1,128 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+namespace accel {
+    ThreadPool::ThreadPool(int numThreads)
+    {
+        if (numThreads <= 0)
+            numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+        for (int i = 0; i < numThreads - 1; ++i)
+        {
+            mWorkers.push_back(std::thread(&ThreadPool::workerLoop, this));
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mStop = true;
+        }
+        mCondition.notify_all();
+        for (int i = 0; i < mWorkers.size(); ++i)
+        {
+            mWorkers[i].join();
+        }
+    }
+
+    void ThreadPool::submit(const std::function<void()>& task)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mTasks.push_back(task);
+        }
+        mCondition.notify_one();
+    }
+
+    void ThreadPool::runUntil(const std::function<bool()>& done)
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (!done())
+        {
+            if (mTasks.empty())
+            {
+                mCondition.wait(lock);
+                continue;
+            }
+            std::function<void()> task = std::move(mTasks.front());
+            mTasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    void ThreadPool::wake()
+    {
+        // Taking the lock orders the wake after a runUntil that just checked done and is about to sleep
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+        }
+        mCondition.notify_all();
+    }
+
+    void ThreadPool::workerLoop()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this] { return mStop || !mTasks.empty(); });
+                if (mStop && mTasks.empty())
+                    return;
+                task = std::move(mTasks.front());
+                mTasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    TaskGroup::TaskGroup(ThreadPool* pool)
+        : mPool(pool), mPending(0)
+    {
+    }
+
+    TaskGroup::~TaskGroup()
+    {
+        wait();
+    }
+
+    void TaskGroup::run(const std::function<void()>& task)
+    {
+        if (!mPool || mPool->getNumThreads() < 2)
+        {
+            task();
+            return;
+        }
+
+        // The group may be gone once the last task is done, so the pool is captured by value
+        ThreadPool* pool = mPool;
+        mPending++;
+        pool->submit([this, pool, task]()
+        {
+            task();
+            if (--mPending == 0)
+                pool->wake();
+        });
+    }
+
+    void TaskGroup::wait()
+    {
+        if (mPending > 0)
+            mPool->runUntil([this]() { return mPending == 0; });
+    }
+
+    void parallelFor(ThreadPool* pool, int begin, int end, int grainSize, const std::function<void(int, int)>& func)
+    {
+        grainSize = std::max(grainSize, 1);
+        TaskGroup group(pool);
+        for (int i = begin; i < end; i += grainSize)
+        {
+            int chunkEnd = std::min(i + grainSize, end);
+            group.run([&func, i, chunkEnd]() { func(i, chunkEnd); });
+        }
+        group.wait();
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef STAR_THREADPOOL_H
+#define STAR_THREADPOOL_H
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace accel {
+    class ThreadPool
+    {
+    public:
+        // numThreads counts the calling thread, zero or less uses all hardware threads
+        ThreadPool(int numThreads = 0);
+        ~ThreadPool();
+        int getNumThreads() { return mWorkers.size() + 1; }
+        void submit(const std::function<void()>& task);
+        // Runs queued tasks on the calling thread until done returns true, sleeps while the
+        // queue is empty. Whatever makes done true has to call wake afterwards
+        void runUntil(const std::function<bool()>& done);
+        void wake();
+    private:
+        void workerLoop();
+    private:
+        std::vector<std::thread> mWorkers;
+        std::deque<std::function<void()>> mTasks;
+        std::mutex mMutex;
+        std::condition_variable mCondition;
+        bool mStop = false;
+    };
+
+    class TaskGroup
+    {
+    public:
+        TaskGroup(ThreadPool* pool);
+        ~TaskGroup();
+        // Runs the task on the pool, or inline if there is no pool
+        void run(const std::function<void()>& task);
+        // Waits for all tasks of the group, executing queued tasks meanwhile and sleeping when
+        // there are none
+        void wait();
+    private:
+        ThreadPool* mPool;
+        std::atomic<int> mPending;
+    };
+
+    // Calls func(chunkBegin, chunkEnd) for every grainSize chunk of [begin, end)
+    void parallelFor(ThreadPool* pool, int begin, int end, int grainSize, const std::function<void(int, int)>& func);
+}
+
+#endif
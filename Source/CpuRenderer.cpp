@@ -0,0 +1,363 @@
+#include "CpuRenderer.h"
+#include "Scene.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+
+namespace star {
+
+    static const float PI = 3.14159265358979323f;
+    // Distance of a miss and ray offset, as in trace.comp
+    static const float INFINITY_DIST = 1000000.0f;
+    static const float EPS = 0.001f;
+    // Tiles are squares of this many pixels, the local size of trace.comp
+    static const int gTileSize = 16;
+    static const int gMaxDepth = 3;
+
+    // Hash of trace.comp, seeded by the pixel and the sample counter
+    struct CpuRenderer::Random
+    {
+        uint32_t seedX;
+        uint32_t seedY;
+
+        Random(uint32_t x, uint32_t y, uint32_t sampleCounter)
+        {
+            seedX = sampleCounter * x;
+            seedY = (sampleCounter + 1) * y;
+        }
+
+        float next()
+        {
+            seedX += 1;
+            seedY += 1;
+            uint32_t qx = 1103515245U * ((seedX >> 1U) ^ seedY);
+            uint32_t qy = 1103515245U * ((seedY >> 1U) ^ seedX);
+            uint32_t n = 1103515245U * (qx ^ (qy >> 3U));
+            return (float)n * (1.0f / (float)0xffffffffU);
+        }
+    };
+
+    struct CpuRenderer::SurfaceHit
+    {
+        bool hit = false;
+        bool isEmitter = false;
+        glm::vec3 position;
+        glm::vec3 normal;
+        glm::vec3 albedo;
+        // Radiance and pdf of the closest light, if that is what the ray hits
+        glm::vec3 lightEmission;
+        float lightPdf = 0.0f;
+    };
+
+    static float powerHeuristic(float a, float b)
+    {
+        float t = a * a;
+        return t / (b * b + t);
+    }
+
+    static glm::vec3 cosineSampleHemisphere(float u1, float u2)
+    {
+        float r = std::sqrt(u1);
+        float phi = 2.0f * PI * u2;
+        float x = r * std::cos(phi);
+        float y = r * std::sin(phi);
+        float z = std::sqrt(std::max(0.0f, 1.0f - x * x - y * y));
+        return glm::vec3(x, y, z);
+    }
+
+    static glm::vec3 uniformSampleSphere(float u1, float u2)
+    {
+        float z = 1.0f - 2.0f * u1;
+        float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+        float phi = 2.0f * PI * u2;
+        return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+    }
+
+    static float intersectSphere(const accel::Ray& ray, float radius, const glm::vec3& position)
+    {
+        glm::vec3 op = position - ray.origin;
+        float b = glm::dot(op, ray.direction);
+        float det = b * b - glm::dot(op, op) + radius * radius;
+        if (det < 0.0f)
+            return INFINITY_DIST;
+        det = std::sqrt(det);
+        float t1 = b - det;
+        if (t1 > EPS)
+            return t1;
+        float t2 = b + det;
+        if (t2 > EPS)
+            return t2;
+        return INFINITY_DIST;
+    }
+
+    static float intersectRect(const accel::Ray& ray, const glm::vec3& position, const glm::vec3& u, const glm::vec3& v, const glm::vec4& plane)
+    {
+        glm::vec3 n = glm::vec3(plane);
+        float dt = glm::dot(ray.direction, n);
+        float t = (plane.w - glm::dot(n, ray.origin)) / dt;
+        if (t > EPS)
+        {
+            glm::vec3 vi = ray.origin + ray.direction * t - position;
+            float a1 = glm::dot(u, vi);
+            float a2 = glm::dot(v, vi);
+            if (a1 >= 0.0f && a1 <= 1.0f && a2 >= 0.0f && a2 <= 1.0f)
+                return t;
+        }
+        return INFINITY_DIST;
+    }
+
+    CpuRenderer::CpuRenderer(Scene* scene, uint32_t width, uint32_t height)
+    {
+        mScene = scene;
+        mWidth = width;
+        mHeight = height;
+        mAccum.resize(width * height, glm::vec3(0.0f));
+    }
+
+    CpuRenderer::~CpuRenderer()
+    {
+    }
+
+    void CpuRenderer::setCamera(const CpuCamera& camera)
+    {
+        mCamera = camera;
+        std::fill(mAccum.begin(), mAccum.end(), glm::vec3(0.0f));
+        mSampleCount = 0;
+        mNumRays = 0;
+    }
+
+    accel::Ray CpuRenderer::generateCameraRay(int x, int y, Random& random)
+    {
+        float invWidth = 1.0f / (float)mWidth;
+        float invHeight = 1.0f / (float)mHeight;
+        float aspectRatio = (float)mWidth / (float)mHeight;
+        float angle = std::tan(0.5f * 45.0f * 3.1415926f / 180.0f);
+
+        float px = (float)x + random.next() - 0.5f;
+        float py = (float)y + random.next() - 0.5f;
+        px = (2.0f * ((px + 0.5f) * invWidth) - 1.0f) * angle * aspectRatio;
+        py = (1.0f - 2.0f * ((py + 0.5f) * invHeight)) * angle;
+
+        accel::Ray ray;
+        ray.origin = mCamera.position;
+        ray.direction = glm::normalize(px * mCamera.right + py * mCamera.up + mCamera.front);
+        return ray;
+    }
+
+    void CpuRenderer::intersect(const accel::Ray& ray, SurfaceHit& isect)
+    {
+        // Lights are not in the BVH, the closest one bounds the triangle search
+        float closestDist = INFINITY_DIST;
+        for (size_t i = 0; i < mScene->mLights.size(); ++i)
+        {
+            const Light& light = mScene->mLights[i];
+            float d = INFINITY_DIST;
+            float pdf = 0.0f;
+            if (light.type == 0)
+            {
+                glm::vec3 normal = glm::normalize(glm::cross(light.u, light.v));
+                glm::vec4 plane = glm::vec4(normal, glm::dot(normal, light.position));
+                glm::vec3 u = light.u * (1.0f / glm::dot(light.u, light.u));
+                glm::vec3 v = light.v * (1.0f / glm::dot(light.v, light.v));
+                d = intersectRect(ray, light.position, u, v, plane);
+                pdf = (d * d) / (light.area * glm::dot(-ray.direction, normal));
+            }
+            else if (light.type == 1)
+            {
+                d = intersectSphere(ray, light.radius, light.position);
+                pdf = (d * d) / light.area;
+            }
+            if (d < closestDist)
+            {
+                closestDist = d;
+                isect.hit = true;
+                isect.isEmitter = true;
+                isect.lightEmission = light.emission;
+                isect.lightPdf = pdf;
+            }
+        }
+
+        accel::Hit hit;
+        hit.t = closestDist;
+        if (!mScene->intersect(ray, hit))
+            return;
+
+        // Triangles of the world mesh are already in world space
+        const Index& index = mScene->mIndices[hit.primIdx];
+        const SceneObject& object = mScene->mSceneObjects[hit.instanceIdx];
+        glm::mat3 normalMatrix = index.objectIdx >= 0 ? glm::mat3(1.0f) : glm::transpose(glm::inverse(glm::mat3(object.transform)));
+        glm::vec3 n0 = mScene->mVertices[index.idx0].normal;
+        glm::vec3 n1 = mScene->mVertices[index.idx1].normal;
+        glm::vec3 n2 = mScene->mVertices[index.idx2].normal;
+        glm::vec3 normal = glm::normalize(n0 * hit.u + n1 * hit.v + n2 * (1.0f - hit.u - hit.v));
+
+        isect.hit = true;
+        isect.isEmitter = false;
+        isect.position = ray.origin + ray.direction * hit.t;
+        isect.normal = glm::normalize(normalMatrix * normal);
+        isect.albedo = object.albedo;
+    }
+
+    glm::vec3 CpuRenderer::directLight(const SurfaceHit& isect, Random& random, uint64_t& numRays)
+    {
+        glm::vec3 L = glm::vec3(0.0f);
+        int numLights = mScene->mLights.size();
+        if (numLights == 0)
+            return L;
+
+        glm::vec3 surfacePos = isect.position + isect.normal * EPS;
+        int index = std::min((int)(random.next() * (float)numLights), numLights - 1);
+        const Light& light = mScene->mLights[index];
+        float r1 = random.next();
+        float r2 = random.next();
+        glm::vec3 lightPos;
+        glm::vec3 lightNormal;
+        if (light.type == 0)
+        {
+            lightPos = light.position + light.u * r1 + light.v * r2;
+            lightNormal = glm::normalize(glm::cross(light.u, light.v));
+        }
+        else
+        {
+            lightPos = light.position + uniformSampleSphere(r1, r2) * light.radius;
+            lightNormal = glm::normalize(lightPos - light.position);
+        }
+        glm::vec3 lightEmission = light.emission * (float)numLights;
+
+        glm::vec3 lightDir = lightPos - surfacePos;
+        float lightDist = glm::length(lightDir);
+        float lightDistSq = lightDist * lightDist;
+        lightDir /= lightDist;
+        if (glm::dot(lightDir, isect.normal) <= 0.0f || glm::dot(lightDir, lightNormal) >= 0.0f)
+            return L;
+
+        accel::Ray shadowRay;
+        shadowRay.origin = surfacePos;
+        shadowRay.direction = lightDir;
+        shadowRay.tMax = lightDist - EPS;
+        numRays++;
+        if (mScene->occluded(shadowRay))
+            return L;
+
+        // Lambertian bsdf, the only material trace.comp evaluates
+        float bsdfPdf = std::abs(glm::dot(lightDir, isect.normal)) / PI;
+        glm::vec3 f = isect.albedo / PI;
+        float lightPdf = lightDistSq / (light.area * std::abs(glm::dot(lightNormal, lightDir)));
+        if (lightPdf > 0.0f)
+            L += powerHeuristic(lightPdf, bsdfPdf) * f * std::abs(glm::dot(isect.normal, lightDir)) * lightEmission / lightPdf;
+        return L;
+    }
+
+    glm::vec3 CpuRenderer::pathTrace(accel::Ray ray, Random& random, uint64_t& numRays)
+    {
+        glm::vec3 radiance = glm::vec3(0.0f);
+        glm::vec3 throughput = glm::vec3(1.0f);
+        for (int depth = 0; depth < gMaxDepth; ++depth)
+        {
+            SurfaceHit isect;
+            numRays++;
+            intersect(ray, isect);
+            if (!isect.hit)
+                break;
+            if (isect.isEmitter)
+            {
+                radiance += isect.lightEmission * throughput;
+                break;
+            }
+            radiance += directLight(isect, random, numRays) * throughput;
+
+            glm::vec3 N = isect.normal;
+            float r1 = random.next();
+            float r2 = random.next();
+            glm::vec3 upVector = std::abs(N.z) < 0.999f ? glm::vec3(0, 0, 1) : glm::vec3(1, 0, 0);
+            glm::vec3 tangentX = glm::normalize(glm::cross(upVector, N));
+            glm::vec3 tangentY = glm::cross(N, tangentX);
+            glm::vec3 dir = cosineSampleHemisphere(r1, r2);
+            glm::vec3 bsdfDir = tangentX * dir.x + tangentY * dir.y + N * dir.z;
+            float bsdfPdf = std::abs(glm::dot(bsdfDir, N)) / PI;
+            if (bsdfPdf <= 0.0f)
+                break;
+            throughput *= isect.albedo / PI * std::abs(glm::dot(N, bsdfDir)) / bsdfPdf;
+            ray.origin = isect.position + ray.direction * EPS;
+            ray.direction = bsdfDir;
+            ray.tMax = std::numeric_limits<float>::max();
+        }
+        return radiance;
+    }
+
+    void CpuRenderer::render(int samplesPerPixel)
+    {
+        int tilesX = (mWidth + gTileSize - 1) / gTileSize;
+        int tilesY = (mHeight + gTileSize - 1) / gTileSize;
+        int firstSample = mSampleCount;
+        accel::parallelFor(mScene->getThreadPool(), 0, tilesX * tilesY, 1, [&](int begin, int end)
+        {
+            uint64_t numRays = 0;
+            for (int tile = begin; tile < end; ++tile)
+            {
+                uint32_t x0 = (tile % tilesX) * gTileSize;
+                uint32_t y0 = (tile / tilesX) * gTileSize;
+                uint32_t x1 = std::min(x0 + gTileSize, mWidth);
+                uint32_t y1 = std::min(y0 + gTileSize, mHeight);
+                for (uint32_t y = y0; y < y1; ++y)
+                {
+                    for (uint32_t x = x0; x < x1; ++x)
+                    {
+                        glm::vec3 color = glm::vec3(0.0f);
+                        for (int s = 0; s < samplesPerPixel; ++s)
+                        {
+                            // The GPU sample counter starts at one
+                            Random random(x, y, firstSample + s + 1);
+                            accel::Ray ray = generateCameraRay(x, y, random);
+                            color += pathTrace(ray, random, numRays);
+                        }
+                        mAccum[y * mWidth + x] += color;
+                    }
+                }
+            }
+            mNumRays += numRays;
+        });
+        mSampleCount += samplesPerPixel;
+    }
+
+    void CpuRenderer::getImage(std::vector<glm::vec3>& image)
+    {
+        image.resize(mAccum.size());
+        float scale = mSampleCount > 0 ? 1.0f / (float)mSampleCount : 0.0f;
+        for (size_t i = 0; i < mAccum.size(); ++i)
+            image[i] = mAccum[i] * scale;
+    }
+
+    bool CpuRenderer::writeHDR(const std::string& path)
+    {
+        FILE* file = fopen(path.c_str(), "wb");
+        if (!file)
+            return false;
+
+        std::vector<glm::vec3> image;
+        getImage(image);
+        fprintf(file, "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y %u +X %u\n", mHeight, mWidth);
+        // Flat RGBE scanlines, readers accept them without run length encoding
+        std::vector<uint8_t> rgbe(image.size() * 4);
+        for (size_t i = 0; i < image.size(); ++i)
+        {
+            glm::vec3 c = glm::max(image[i], glm::vec3(0.0f));
+            float v = std::max(c.x, std::max(c.y, c.z));
+            if (v < 1e-32f)
+            {
+                rgbe[i * 4 + 0] = rgbe[i * 4 + 1] = rgbe[i * 4 + 2] = rgbe[i * 4 + 3] = 0;
+                continue;
+            }
+            int exponent;
+            float scale = std::frexp(v, &exponent) * 256.0f / v;
+            rgbe[i * 4 + 0] = (uint8_t)(c.x * scale);
+            rgbe[i * 4 + 1] = (uint8_t)(c.y * scale);
+            rgbe[i * 4 + 2] = (uint8_t)(c.z * scale);
+            rgbe[i * 4 + 3] = (uint8_t)(exponent + 128);
+        }
+        bool written = fwrite(rgbe.data(), 1, rgbe.size(), file) == rgbe.size();
+        fclose(file);
+        return written;
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef STAR_CPURENDERER_H
+#define STAR_CPURENDERER_H
+#include "Accelerator/BvhTraversal.h"
+#include <glm/glm.hpp>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+namespace star {
+    class Scene;
+
+    // Pinhole camera of trace.comp, the image spans a 45 degree vertical field of view
+    struct CpuCamera
+    {
+        glm::vec3 position = glm::vec3(0.0f, 0.0f, 0.0f);
+        glm::vec3 right = glm::vec3(1.0f, 0.0f, 0.0f);
+        glm::vec3 up = glm::vec3(0.0f, 1.0f, 0.0f);
+        glm::vec3 front = glm::vec3(0.0f, 0.0f, -1.0f);
+    };
+
+    // Headless path tracer with the integrator of trace.comp over the buffers of a built Scene,
+    // rays go through the Scene CPU traversal. Tiles are rendered on the scene thread pool and
+    // every sample is seeded by its pixel and sample index like on the GPU, so the image does
+    // not depend on the number of threads
+    class CpuRenderer
+    {
+    public:
+        CpuRenderer(Scene* scene, uint32_t width, uint32_t height);
+        ~CpuRenderer();
+        // Restarts the accumulation
+        void setCamera(const CpuCamera& camera);
+        // Adds samplesPerPixel samples to every pixel
+        void render(int samplesPerPixel);
+        // Mean radiance of every pixel, rows from the top
+        void getImage(std::vector<glm::vec3>& image);
+        // Writes the mean radiance as a Radiance RGBE file
+        bool writeHDR(const std::string& path);
+        int getSampleCount() { return mSampleCount; }
+        // Camera, bounce and shadow rays traced so far
+        uint64_t getNumRays() { return mNumRays; }
+    private:
+        struct Random;
+        struct SurfaceHit;
+        accel::Ray generateCameraRay(int x, int y, Random& random);
+        void intersect(const accel::Ray& ray, SurfaceHit& isect);
+        glm::vec3 directLight(const SurfaceHit& isect, Random& random, uint64_t& numRays);
+        glm::vec3 pathTrace(accel::Ray ray, Random& random, uint64_t& numRays);
+    private:
+        Scene* mScene;
+        uint32_t mWidth;
+        uint32_t mHeight;
+        CpuCamera mCamera;
+        std::vector<glm::vec3> mAccum;
+        int mSampleCount = 0;
+        std::atomic<uint64_t> mNumRays{ 0 };
+    };
+}
+
+#endif
@@ -57,7 +57,9 @@ namespace star {
                 float *localNormalBuffer = nullptr;
 
                 cgltf_attribute *positionAttributes = nullptr;
-                assert(findAttributesType(cPrimitive, &positionAttributes, cgltf_attribute_type_position));
+                // Looked up outside of assert, release builds drop the expression
+                bool hasPositions = findAttributesType(cPrimitive, &positionAttributes, cgltf_attribute_type_position);
+                assert(hasPositions);
                 cgltf_accessor *posAccessor = positionAttributes->data;
                 cgltf_buffer_view *posView = posAccessor->buffer_view;
                 uint8_t *posDatas = (uint8_t *) (posView->buffer->data) + posAccessor->offset + posView->offset;
@@ -82,6 +84,8 @@ namespace star {
                     localTexcoordBuffer = (float *) texcoordDatas;
                 }
 
+                // Indices of every primitive refer to its own vertices
+                uint32_t vertexStart = positionBuffer.size();
                 for (size_t v = 0; v < posAccessor->count; v++)
                 {
                     positionBuffer.push_back(glm::vec3(localPositionBuffer[v * 3], localPositionBuffer[v * 3 + 1], localPositionBuffer[v * 3 + 2]));
@@ -119,7 +123,7 @@ namespace star {
                         memcpy(buf, src, indexCount * sizeof(uint32_t));
                         for (size_t index = 0; index < indexCount; index++)
                         {
-                            indexBuffer.push_back(buf[index]);
+                            indexBuffer.push_back(vertexStart + buf[index]);
                         }
                         break;
                     }
@@ -131,7 +135,7 @@ namespace star {
                         memcpy(buf, src, indexCount * sizeof(uint16_t));
                         for (size_t index = 0; index < indexCount; index++)
                         {
-                            indexBuffer.push_back(buf[index]);
+                            indexBuffer.push_back(vertexStart + buf[index]);
                         }
                         break;
                     }
@@ -142,7 +146,7 @@ namespace star {
                         memcpy(buf, src, indexCount * sizeof(uint8_t));
                         for (size_t index = 0; index < indexCount; index++)
                         {
-                            indexBuffer.push_back(buf[index]);
+                            indexBuffer.push_back(vertexStart + buf[index]);
                         }
                         break;
                     }
@@ -152,13 +156,12 @@ namespace star {
             }
 
             Mesh* mesh = new Mesh();
-            for (int j = 0; j < indexBuffer.size(); ++j)
-            {
-                int index = indexBuffer[j];
-                mesh->mVertices.push_back(positionBuffer[index]);
-                mesh->mNormals.push_back(normalBuffer[index]);
-                mesh->mUVs.push_back(texcoordBuffer[index]);
-            }
+            mesh->mVertices = positionBuffer;
+            mesh->mNormals = normalBuffer;
+            mesh->mUVs = texcoordBuffer;
+            mesh->mIndices = indexBuffer;
+            if (mWeldVertices)
+                mesh->weldVertices();
 
             mesh->mAlbedo = glm::vec3(cMaterial->pbr_metallic_roughness.base_color_factor[0],
                                       cMaterial->pbr_metallic_roughness.base_color_factor[1],
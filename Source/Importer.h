@@ -18,7 +18,11 @@ namespace star {
     public:
         Importer();
         ~Importer();
+        // Merges duplicated vertices of the imported meshes, see Mesh::weldVertices
+        void setWeldVertices(bool weld) { mWeldVertices = weld; }
         ImportedResult load(std::string path);
+    private:
+        bool mWeldVertices = false;
     };
 }
 
@@ -14,6 +14,7 @@
 #include <RHI/RHIDescriptorSet.h>
 #include <Utility/FileSystem.h>
 #include <RHI/Managers/SpirvManager.h>
+#include <algorithm>
 
 struct QuadVertex {
     glm::vec3 pos;
@@ -133,19 +134,30 @@ namespace star {
         bufferInfo.memoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
         mSettingBuffer = new RHIBuffer(mDevice, bufferInfo);
 
-        int sceneBvhNodeBufferSize = sizeof(accel::BvhTranslator::Node) * mScene->mBvhTranslator.mNodes.size();
-        bufferInfo.size = sceneBvhNodeBufferSize;
+        updateStackSize();
+        mSceneBvhNodeBufferSize = sizeof(accel::BvhTranslator::Node) * mScene->mBvhTranslator.mNodes.size();
+        bufferInfo.size = mSceneBvhNodeBufferSize;
         bufferInfo.descriptors = DESCRIPTOR_TYPE_RW_BUFFER;
         bufferInfo.memoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
         mSceneBvhNodeBuffer = new RHIBuffer(mDevice, bufferInfo);
-        mSceneBvhNodeBuffer->writeData(0, sceneBvhNodeBufferSize, mScene->mBvhTranslator.mNodes.data());
+        mSceneBvhNodeBuffer->writeData(0, mSceneBvhNodeBufferSize, mScene->mBvhTranslator.mNodes.data());
 
-        int sceneObjectBufferSize = sizeof(SceneObject) * mScene->mSceneObjects.size();
-        bufferInfo.size = sceneObjectBufferSize;
+        mSceneObjectBufferSize = sizeof(SceneObject) * mScene->mSceneObjects.size();
+        bufferInfo.size = mSceneObjectBufferSize;
         bufferInfo.descriptors = DESCRIPTOR_TYPE_RW_BUFFER;
         bufferInfo.memoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
         mSceneObjectBuffer = new RHIBuffer(mDevice, bufferInfo);
-        mSceneObjectBuffer->writeData(0, sceneObjectBufferSize, mScene->mSceneObjects.data());
+        mSceneObjectBuffer->writeData(0, mSceneObjectBufferSize, mScene->mSceneObjects.data());
+
+        // Bound without pair nodes as well, then it holds a single unused node
+        std::vector<accel::BvhTranslator::WideNode<2>>& pairNodes = mScene->mBvhTranslator.mWideNodes2;
+        mScenePairNodeBufferSize = sizeof(accel::BvhTranslator::WideNode<2>) * std::max<size_t>(pairNodes.size(), 1);
+        bufferInfo.size = mScenePairNodeBufferSize;
+        bufferInfo.descriptors = DESCRIPTOR_TYPE_RW_BUFFER;
+        bufferInfo.memoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+        mScenePairNodeBuffer = new RHIBuffer(mDevice, bufferInfo);
+        if (!pairNodes.empty())
+            mScenePairNodeBuffer->writeData(0, mScenePairNodeBufferSize, pairNodes.data());
 
         int sceneIndexBufferSize = sizeof(Index) * mScene->mIndices.size();
         bufferInfo.size = sceneIndexBufferSize;
@@ -161,6 +173,15 @@ namespace star {
         mSceneVertexBuffer = new RHIBuffer(mDevice, bufferInfo);
         mSceneVertexBuffer->writeData(0, sceneVertexBufferSize, mScene->mVertices.data());
 
+        // Bound even without the triangle stream, then it holds a single unused triangle
+        int sceneTriangleBufferSize = sizeof(Triangle) * std::max<size_t>(mScene->mTriangles.size(), 1);
+        bufferInfo.size = sceneTriangleBufferSize;
+        bufferInfo.descriptors = DESCRIPTOR_TYPE_RW_BUFFER;
+        bufferInfo.memoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+        mSceneTriangleBuffer = new RHIBuffer(mDevice, bufferInfo);
+        if (!mScene->mTriangles.empty())
+            mSceneTriangleBuffer->writeData(0, sceneTriangleBufferSize, mScene->mTriangles.data());
+
         int sceneLightBufferSize = sizeof(Light) * mScene->mLights.size();
         bufferInfo.size = sceneLightBufferSize;
         bufferInfo.descriptors = DESCRIPTOR_TYPE_RW_BUFFER;
@@ -245,7 +266,7 @@ namespace star {
         mAccumDescSet->updateBuffer(3, DESCRIPTOR_TYPE_UNIFORM_BUFFER, mAccumSettingBuffer, sizeof(AccumSetting), 0);
 
         descriptorSetInfo.set = 0;
-        descriptorSetInfo.bindingCount = 7;
+        descriptorSetInfo.bindingCount = 9;
         descriptorSetInfo.bindings[0].binding = 0;
         descriptorSetInfo.bindings[0].descriptorCount = 1;
         descriptorSetInfo.bindings[0].type = DESCRIPTOR_TYPE_RW_TEXTURE;
@@ -274,14 +295,24 @@ namespace star {
         descriptorSetInfo.bindings[6].descriptorCount = 1;
         descriptorSetInfo.bindings[6].type = DESCRIPTOR_TYPE_RW_BUFFER;
         descriptorSetInfo.bindings[6].stage = PROGRAM_COMPUTE;
+        descriptorSetInfo.bindings[7].binding = 7;
+        descriptorSetInfo.bindings[7].descriptorCount = 1;
+        descriptorSetInfo.bindings[7].type = DESCRIPTOR_TYPE_RW_BUFFER;
+        descriptorSetInfo.bindings[7].stage = PROGRAM_COMPUTE;
+        descriptorSetInfo.bindings[8].binding = 8;
+        descriptorSetInfo.bindings[8].descriptorCount = 1;
+        descriptorSetInfo.bindings[8].type = DESCRIPTOR_TYPE_RW_BUFFER;
+        descriptorSetInfo.bindings[8].stage = PROGRAM_COMPUTE;
         mTraceDescSet = new RHIDescriptorSet(mDevice, descriptorSetInfo);
         mTraceDescSet->updateTexture(0, DESCRIPTOR_TYPE_RW_TEXTURE, mTraceTexture);
         mTraceDescSet->updateBuffer(1, DESCRIPTOR_TYPE_UNIFORM_BUFFER, mSettingBuffer, sizeof(GlobalSetting), 0);
-        mTraceDescSet->updateBuffer(2, DESCRIPTOR_TYPE_RW_BUFFER, mSceneBvhNodeBuffer, sceneBvhNodeBufferSize, 0);
-        mTraceDescSet->updateBuffer(3, DESCRIPTOR_TYPE_RW_BUFFER, mSceneObjectBuffer, sceneObjectBufferSize, 0);
+        mTraceDescSet->updateBuffer(2, DESCRIPTOR_TYPE_RW_BUFFER, mSceneBvhNodeBuffer, mSceneBvhNodeBufferSize, 0);
+        mTraceDescSet->updateBuffer(3, DESCRIPTOR_TYPE_RW_BUFFER, mSceneObjectBuffer, mSceneObjectBufferSize, 0);
         mTraceDescSet->updateBuffer(4, DESCRIPTOR_TYPE_RW_BUFFER, mSceneIndexBuffer, sceneIndexBufferSize, 0);
         mTraceDescSet->updateBuffer(5, DESCRIPTOR_TYPE_RW_BUFFER, mSceneVertexBuffer, sceneVertexBufferSize, 0);
         mTraceDescSet->updateBuffer(6, DESCRIPTOR_TYPE_RW_BUFFER, mSceneLightBuffer, sceneLightBufferSize, 0);
+        mTraceDescSet->updateBuffer(7, DESCRIPTOR_TYPE_RW_BUFFER, mSceneTriangleBuffer, sceneTriangleBufferSize, 0);
+        mTraceDescSet->updateBuffer(8, DESCRIPTOR_TYPE_RW_BUFFER, mScenePairNodeBuffer, mScenePairNodeBufferSize, 0);
 
         VertexLayout vertexLayout;
         vertexLayout.attribCount = 2;
@@ -326,7 +357,7 @@ namespace star {
         uint32_t imageIndex;
         mSwapChain->acquireNextImage(mImageAvailableSemaphore, nullptr, imageIndex);
         // update date
-        mDirtyFlag = updateCamera();
+        mDirtyFlag = updateCamera() | updateScene();
         if(mDirtyFlag > 0)
         {
             mSampleCounter = 1;
@@ -384,6 +415,71 @@ namespace star {
         mSampleCounter++;
     }
 
+    int Renderer::updateScene()
+    {
+        // Uploads what the refit changed, moved instances restart the accumulation
+        if (!mScene->isDirty())
+            return 0;
+        Scene::RefitRange range = mScene->refit();
+        if (range.nodes.count == 0 && range.sceneObjects.count == 0)
+            return 0;
+
+        // Insertions can deepen the TLAS, threading writes the miss links of every node
+        std::vector<accel::BvhTranslator::Node>& nodes = mScene->mBvhTranslator.mNodes;
+        if (updateStackSize())
+        {
+            range.nodes.first = 0;
+            range.nodes.count = nodes.size();
+        }
+
+        // The buffers are host visible and written in place, the previous frame may still read them
+        mDevice->getGraphicsQueue()->waitIdle();
+        updateBuffer(mSceneBvhNodeBuffer, mSceneBvhNodeBufferSize, 2, nodes.data(), sizeof(accel::BvhTranslator::Node), nodes.size(), range.nodes.first, range.nodes.count);
+        updateBuffer(mSceneObjectBuffer, mSceneObjectBufferSize, 3, mScene->mSceneObjects.data(), sizeof(SceneObject), mScene->mSceneObjects.size(), range.sceneObjects.first, range.sceneObjects.count);
+        // Refits and TLAS updates only touch the pair nodes of the TLAS, which follow the BLASes
+        if (mScene->getWideWidth() == 2)
+        {
+            std::vector<accel::BvhTranslator::WideNode<2>>& pairNodes = mScene->mBvhTranslator.mWideNodes2;
+            int pairTopIndex = mScene->mBvhTranslator.mWideTopIndex;
+            updateBuffer(mScenePairNodeBuffer, mScenePairNodeBufferSize, 8, pairNodes.data(), sizeof(accel::BvhTranslator::WideNode<2>), pairNodes.size(), pairTopIndex, pairNodes.size() - pairTopIndex);
+        }
+        return 1;
+    }
+
+    bool Renderer::updateStackSize()
+    {
+        accel::BvhTranslator& translator = mScene->mBvhTranslator;
+        mSceneStackSize = translator.computeStackSize();
+        if (mSceneStackSize <= gShaderStackSize || translator.mThreaded)
+            return false;
+        translator.setThreaded(true);
+        translator.takeDirtyRange();
+        return true;
+    }
+
+    void Renderer::updateBuffer(RHIBuffer*& buffer, int& bufferSize, int binding, void* data, int stride, int count, int first, int numUpdated)
+    {
+        if (numUpdated == 0)
+            return;
+
+        // Inserted instances can outgrow the buffer, it is then recreated with all elements
+        int size = stride * count;
+        if (size > bufferSize)
+        {
+            SAFE_DELETE(buffer);
+            RHIBufferInfo bufferInfo;
+            bufferInfo.size = size;
+            bufferInfo.descriptors = DESCRIPTOR_TYPE_RW_BUFFER;
+            bufferInfo.memoryUsage = RESOURCE_MEMORY_USAGE_CPU_TO_GPU;
+            buffer = new RHIBuffer(mDevice, bufferInfo);
+            buffer->writeData(0, size, data);
+            mTraceDescSet->updateBuffer(binding, DESCRIPTOR_TYPE_RW_BUFFER, buffer, size, 0);
+            bufferSize = size;
+            return;
+        }
+        buffer->writeData(first * stride, numUpdated * stride, (uint8_t*)data + first * stride);
+    }
+
     void Renderer::finish()
     {
         SAFE_DELETE(mTraceTexture);
@@ -393,8 +489,10 @@ namespace star {
         SAFE_DELETE(mAccumSettingBuffer);
         SAFE_DELETE(mSceneIndexBuffer);
         SAFE_DELETE(mSceneVertexBuffer);
+        SAFE_DELETE(mSceneTriangleBuffer);
         SAFE_DELETE(mSceneObjectBuffer);
         SAFE_DELETE(mSceneBvhNodeBuffer);
+        SAFE_DELETE(mScenePairNodeBuffer);
         SAFE_DELETE(mSettingBuffer);
         SAFE_DELETE(mQuadVertexBuffer);
         SAFE_DELETE(mQuadIndexBuffer);
@@ -427,6 +525,10 @@ namespace star {
         globalSetting.sceneBvhRootIndex = mScene->mBvhTranslator.mTopIndex;
         globalSetting.sampleCounter = mSampleCounter;
         globalSetting.numLight = mScene->mLights.size();
+        globalSetting.triangleStream = mScene->mTriangles.empty() ? 0 : 1;
+        bool stackFits = mSceneStackSize <= gShaderStackSize;
+        globalSetting.scenePairRootIndex = mScene->getWideWidth() == 2 && stackFits ? mScene->mBvhTranslator.mWideTopIndex : -1;
+        globalSetting.sceneBvhThreaded = mScene->mBvhTranslator.mThreaded ? 1 : 0;
         mSettingBuffer->writeData(0, sizeof(globalSetting), &globalSetting);
 
         AccumSetting accumSetting;
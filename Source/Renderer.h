@@ -17,6 +17,9 @@ class RHISampler;
 namespace star {
     class Scene;
 
+    // Entries of the traversal stacks of trace.comp, STACK_SIZE there
+    static const int gShaderStackSize = 64;
+
     struct GlobalSetting
     {
         alignas(16) glm::vec3 cameraPosition;
@@ -28,6 +31,9 @@ namespace star {
         alignas(4) int sceneBvhRootIndex;
         alignas(4) int sampleCounter;
         alignas(4) int numLight;
+        alignas(4) int triangleStream;
+        alignas(4) int scenePairRootIndex;
+        alignas(4) int sceneBvhThreaded;
     };
 
     struct AccumSetting
@@ -61,10 +67,19 @@ namespace star {
     protected:
         void updateGlobalSetting();
         int updateCamera();
+        int updateScene();
+        // The stack traversals of trace.comp only take scenes that fit gShaderStackSize, deeper
+        // ones are threaded and traced over the miss links. Returns true if it threaded the scene
+        bool updateStackSize();
+        // Writes elements [first, first + numUpdated) of the count elements at data to the
+        // buffer bound at binding, the queue has to be idle
+        void updateBuffer(RHIBuffer*& buffer, int& bufferSize, int binding, void* data, int stride, int count, int first, int numUpdated);
     protected:
         uint32_t mWidth;
         uint32_t mHeight;
         int mDirtyFlag;
+        // BvhTranslator::computeStackSize of the uploaded scene
+        int mSceneStackSize = 0;
         int mSampleCounter;
         Camera mCamera;
         Scene* mScene;
@@ -88,8 +103,13 @@ namespace star {
         RHIBuffer* mSettingBuffer = nullptr;
         RHIBuffer* mSceneBvhNodeBuffer = nullptr;
         RHIBuffer* mSceneObjectBuffer = nullptr;
+        int mSceneBvhNodeBufferSize = 0;
+        int mSceneObjectBufferSize = 0;
+        RHIBuffer* mScenePairNodeBuffer = nullptr;
+        int mScenePairNodeBufferSize = 0;
         RHIBuffer* mSceneIndexBuffer = nullptr;
         RHIBuffer* mSceneVertexBuffer = nullptr;
+        RHIBuffer* mSceneTriangleBuffer = nullptr;
         RHIBuffer* mSceneLightBuffer = nullptr;
         RHITexture* mTraceTexture = nullptr;
         RHITexture* mAccumTexture = nullptr;
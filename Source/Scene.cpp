@@ -1,4 +1,7 @@
 #include "Scene.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
 
 namespace star {
 
@@ -14,23 +17,83 @@ namespace star {
         delete mBvh;
     }
 
-    void Mesh::buildBvh()
+    void Mesh::setBvhBuildSettings(const accel::Bvh::BuildSettings& settings)
     {
-        int numTris = mVertices.size() / 3;
-        std::vector<accel::BBox> bounds(numTris);
+        mBvh->setBuildSettings(settings);
+    }
+
+    void Mesh::buildBvh(accel::ThreadPool* pool, accel::BvhCache* cache)
+    {
+        int numTris = mIndices.size() / 3;
+
+        uint64_t key = 0;
+        if (cache)
+        {
+            key = accel::BvhCache::computeKey(&mVertices[0], mVertices.size(), &mIndices[0], mIndices.size(), mBvh->getBuildSettings(), pool);
+            if (cache->load(key, mBvh, numTris))
+                return;
+        }
 
-        for (int i = 0; i < numTris; ++i)
+        mBvh->setThreadPool(pool);
+        mBvh->buildTriangles(&mVertices[0], numTris, &mIndices[0]);
+        mBvh->setThreadPool(nullptr);
+
+        if (cache)
+            cache->store(key, mBvh);
+    }
+
+    void Mesh::weldVertices()
+    {
+        // Vertices are sorted by their attribute bits, the first vertex of every run of equal
+        // ones stays and the others are mapped to it
+        struct Key
+        {
+            float data[8];
+        };
+        int numVertices = mVertices.size();
+        std::vector<Key> keys(numVertices);
+        for (int i = 0; i < numVertices; ++i)
         {
-            glm::vec3 v1 = mVertices[i * 3 + 0];
-            glm::vec3 v2 = mVertices[i * 3 + 1];
-            glm::vec3 v3 = mVertices[i * 3 + 2];
+            memcpy(&keys[i].data[0], &mVertices[i], sizeof(glm::vec3));
+            memcpy(&keys[i].data[3], &mNormals[i], sizeof(glm::vec3));
+            memcpy(&keys[i].data[6], &mUVs[i], sizeof(glm::vec2));
+        }
+        std::vector<int> order(numVertices);
+        for (int i = 0; i < numVertices; ++i)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&keys](int a, int b)
+        {
+            int cmp = memcmp(&keys[a], &keys[b], sizeof(Key));
+            return cmp < 0 || (cmp == 0 && a < b);
+        });
 
-            bounds[i].grow(v1);
-            bounds[i].grow(v2);
-            bounds[i].grow(v3);
+        std::vector<int> representative(numVertices);
+        for (int i = 0; i < numVertices; ++i)
+        {
+            bool first = i == 0 || memcmp(&keys[order[i]], &keys[order[i - 1]], sizeof(Key)) != 0;
+            representative[order[i]] = first ? order[i] : representative[order[i - 1]];
         }
 
-        mBvh->build(&bounds[0], numTris);
+        std::vector<uint32_t> remap(numVertices);
+        int numWelded = 0;
+        for (int i = 0; i < numVertices; ++i)
+        {
+            if (representative[i] != i)
+            {
+                remap[i] = remap[representative[i]];
+                continue;
+            }
+            remap[i] = numWelded;
+            mVertices[numWelded] = mVertices[i];
+            mNormals[numWelded] = mNormals[i];
+            mUVs[numWelded] = mUVs[i];
+            numWelded++;
+        }
+        mVertices.resize(numWelded);
+        mNormals.resize(numWelded);
+        mUVs.resize(numWelded);
+        for (int i = 0; i < mIndices.size(); ++i)
+            mIndices[i] = remap[mIndices[i]];
     }
 
     Scene::Scene()
@@ -41,6 +104,9 @@ namespace star {
     Scene::~Scene()
     {
         delete mBvh;
+        delete mBvhTraversal;
+        delete mThreadPool;
+        delete mBvhCache;
         for (int i = 0; i < mMeshs.size(); ++i)
         {
             if(mMeshs[i])
@@ -58,20 +124,77 @@ namespace star {
         return -1;
     }
 
+    accel::ThreadPool* Scene::getThreadPool()
+    {
+        if (!mThreadPool)
+            mThreadPool = new accel::ThreadPool(mNumThreads);
+        return mThreadPool;
+    }
+
+    int Scene::getWideWidth()
+    {
+        if (mBvhWidth == 4 || mBvhWidth == 8)
+            return mBvhWidth;
+        return mBvhPairNodes ? 2 : 0;
+    }
+
     void Scene::addMesh(Mesh *mesh)
     {
         mMeshs.push_back(mesh);
     }
 
-    void Scene::addMeshInstance(const MeshInstance &instance)
+    int Scene::addMeshInstance(const MeshInstance &instance)
     {
         int idx = findMesh(instance.mesh);
-        if(idx >= 0)
+        if(idx < 0)
+            return -1;
+
+        // Meshes that were only flattened have no BLAS in the built scene until the next
+        // createAccelerationStructures
+        if (mBvhTraversal && mFlattenedMeshes[idx])
+            return -1;
+
+        MeshInstance inst = instance;
+        inst.meshIdx = idx;
+        if (!mBvhTraversal)
+        {
+            mMeshInstances.push_back(inst);
+            return mMeshInstances.size() - 1;
+        }
+
+        int id = mMeshInstances.size();
+        if (!mFreeInstanceIds.empty())
+        {
+            id = mFreeInstanceIds.back();
+            mFreeInstanceIds.pop_back();
+            mMeshInstances[id] = inst;
+            mSceneObjects[id] = createSceneObject(id);
+        }
+        else
         {
-            MeshInstance inst = instance;
-            inst.meshIdx = idx;
             mMeshInstances.push_back(inst);
+            mSceneObjects.push_back(createSceneObject(id));
+            mFlattenedInstances.push_back(false);
+            mBraidedInstances.push_back(false);
         }
+
+        accel::BvhInstance bvhInstance;
+        bvhInstance.bvhIdx = idx;
+        bvhInstance.transform = inst.transform;
+        mBvhTranslator.insertInstance(id, bvhInstance, getInstanceBound(id));
+        mDirtyInstances.push_back(id);
+        mTLASChanged = true;
+        return id;
+    }
+
+    void Scene::removeMeshInstance(int id)
+    {
+        assert(mBvhTraversal && mMeshInstances[id].mesh && !mFlattenedInstances[id] && !mBraidedInstances[id]);
+        mBvhTranslator.removeInstance(id);
+        mMeshInstances[id].mesh = nullptr;
+        mMeshInstances[id].meshIdx = -1;
+        mFreeInstanceIds.push_back(id);
+        mTLASChanged = true;
     }
 
     void Scene::addLight(const Light &light)
@@ -79,15 +202,41 @@ namespace star {
         mLights.push_back(light);
     }
 
+    void Scene::setTLASBuildSettings(const accel::Bvh::BuildSettings& settings)
+    {
+        mBvh->setBuildSettings(settings);
+    }
+
+    void Scene::setNumThreads(int numThreads)
+    {
+        delete mThreadPool;
+        mThreadPool = nullptr;
+        mNumThreads = numThreads;
+    }
+
+    void Scene::setBvhCacheDirectory(const std::string& directory)
+    {
+        delete mBvhCache;
+        mBvhCache = directory.empty() ? nullptr : new accel::BvhCache(directory);
+    }
+
     void Scene::createAccelerationStructures()
     {
+        // Everything derived from the meshes and instances is built again, so the scene can be
+        // rebuilt after instances were added, moved or removed
+        mIndices.clear();
+        mVertices.clear();
+        mSceneObjects.clear();
+        mDirtyInstances.clear();
+        mTLASChanged = false;
+        flattenInstances();
         createBLAS();
         createTLAS();
         std::vector<accel::Bvh*> bvhs;
         std::vector<accel::BvhInstance> bvhInstances;
         for (int i = 0; i < mMeshs.size(); ++i)
         {
-            bvhs.push_back(mMeshs[i]->mBvh);
+            bvhs.push_back(mFlattenedMeshes[i] ? &mEmptyBvh : mMeshs[i]->mBvh);
         }
         for (int i = 0; i < mMeshInstances.size(); ++i)
         {
@@ -96,32 +245,39 @@ namespace star {
             bvhInstance.transform = mMeshInstances[i].transform;
             bvhInstances.push_back(bvhInstance);
         }
-        mBvhTranslator.process(mBvh, bvhs, bvhInstances);
+        mBvhTranslator.process(mBvh, bvhs, bvhInstances, mBvhReferences);
+        if (getWideWidth() > 0)
+            mBvhTranslator.processWide(getWideWidth());
+        if ((mBvhWidth == 4 || mBvhWidth == 8) && mBvhCompressed)
+            mBvhTranslator.processCompressed();
 
+        // Removed instances keep their slot until an insertion reuses it
         for (int i = 0; i < mMeshInstances.size(); ++i)
         {
-            Mesh* mesh = mMeshInstances[i].mesh;
-            SceneObject sceneObject;
-            sceneObject.transform = mMeshInstances[i].transform;
-            sceneObject.albedo = mesh->mAlbedo;
-            sceneObject.emission = mesh->mEmission;
-            sceneObject.matParams = glm::vec4(mesh->mMetallic, mesh->mRoughness, 0.0f, 0.0f);
-            mSceneObjects.push_back(sceneObject);
+            mSceneObjects.push_back(mMeshInstances[i].mesh ? createSceneObject(i) : SceneObject());
         }
 
+        // Triangles follow the leaf order of the translator, which compression changes
         int verticesCount = 0;
+        int primOffset = 0;
         for (int i = 0; i < mMeshs.size(); i++)
         {
+            // The world mesh holds the triangles and vertices of flattened meshes
+            if (mFlattenedMeshes[i])
+                continue;
+
             int numIndices = mMeshs[i]->mBvh->getNumIndices();
-            uint32_t* triIndices = mMeshs[i]->mBvh->getIndices();
+            const uint32_t* triIndices = &mBvhTranslator.mPrimIndices[primOffset];
+            const uint32_t* meshIndices = mMeshs[i]->mIndices.data();
 
             for (int j = 0; j < numIndices; j++)
             {
                 int index = triIndices[j];
-                int v1 = (index * 3 + 0) + verticesCount;
-                int v2 = (index * 3 + 1) + verticesCount;
-                int v3 = (index * 3 + 2) + verticesCount;
-                mIndices.push_back({ v1, v2, v3 });
+                int v1 = meshIndices[index * 3 + 0] + verticesCount;
+                int v2 = meshIndices[index * 3 + 1] + verticesCount;
+                int v3 = meshIndices[index * 3 + 2] + verticesCount;
+                int objectIdx = i == mWorldMeshIdx ? mWorldTriangleObjects[index] : -1;
+                mIndices.push_back({ v1, v2, v3, objectIdx });
             }
 
             for (int j = 0; j < mMeshs[i]->mVertices.size(); ++j)
@@ -134,54 +290,476 @@ namespace star {
             }
 
             verticesCount += mMeshs[i]->mVertices.size();
+            primOffset += numIndices;
+        }
+
+        mTriangles.clear();
+        if (mTriangleStream)
+        {
+            mTriangles.resize(mIndices.size());
+            accel::parallelFor(getThreadPool(), 0, mIndices.size(), 16 * 1024, [this](int begin, int end)
+            {
+                for (int i = begin; i < end; ++i)
+                {
+                    const Index& index = mIndices[i];
+                    glm::vec3 v0 = mVertices[index.idx0].position;
+                    mTriangles[i].v0 = v0;
+                    mTriangles[i].e0 = mVertices[index.idx1].position - v0;
+                    mTriangles[i].e1 = mVertices[index.idx2].position - v0;
+                }
+            });
+        }
+
+        delete mBvhTraversal;
+        mBvhTraversal = new accel::BvhTraversal(&mBvhTranslator);
+    }
+
+    bool Scene::intersectTriangle(int primIdx, const accel::Ray& ray, float& t, float& u, float& v)
+    {
+        if (mTriangleStream)
+        {
+            const Triangle& triangle = mTriangles[primIdx];
+            return accel::intersectTriangleEdges(triangle.v0, triangle.e0, triangle.e1, ray, t, u, v);
         }
+        const Index& index = mIndices[primIdx];
+        return accel::intersectTriangle(mVertices[index.idx0].position, mVertices[index.idx1].position, mVertices[index.idx2].position, ray, t, u, v);
+    }
+
+    bool Scene::intersect(const accel::Ray& ray, accel::Hit& hit, accel::TraversalStats* stats)
+    {
+        auto intersector = [this](int primIdx, const accel::Ray& localRay, accel::Hit& localHit)
+        {
+            float t, u, v;
+            if (intersectTriangle(primIdx, localRay, t, u, v) && t < localHit.t && t < localRay.tMax)
+            {
+                localHit.t = t;
+                localHit.u = u;
+                localHit.v = v;
+                return true;
+            }
+            return false;
+        };
+        bool found;
+        if (mBvhWidth == 4 && mBvhCompressed)
+            found = mBvhTraversal->intersectCompressed<4>(ray, hit, intersector, stats);
+        else if (mBvhWidth == 8 && mBvhCompressed)
+            found = mBvhTraversal->intersectCompressed<8>(ray, hit, intersector, stats);
+        else if (mBvhWidth == 4)
+            found = mBvhTraversal->intersectWide<4>(ray, hit, intersector, stats);
+        else if (mBvhWidth == 8)
+            found = mBvhTraversal->intersectWide<8>(ray, hit, intersector, stats);
+        else if (mBvhPairNodes)
+            found = mBvhTraversal->intersectWide<2>(ray, hit, intersector, stats);
+        else if (mBvhThreaded)
+            found = mBvhTraversal->intersectThreaded(ray, hit, intersector, stats);
+        else
+            found = mBvhTraversal->intersect(ray, hit, intersector, stats);
+
+        // Hits in the world mesh report the flattened instance
+        if (found && mIndices[hit.primIdx].objectIdx >= 0)
+            hit.instanceIdx = mIndices[hit.primIdx].objectIdx;
+        return found;
+    }
+
+    bool Scene::occluded(const accel::Ray& ray, accel::TraversalStats* stats)
+    {
+        auto intersector = [this](int primIdx, const accel::Ray& localRay, accel::Hit& localHit)
+        {
+            float t, u, v;
+            return intersectTriangle(primIdx, localRay, t, u, v) && t < localRay.tMax;
+        };
+        if (mBvhWidth == 4 && mBvhCompressed)
+            return mBvhTraversal->occludedCompressed<4>(ray, intersector, stats);
+        if (mBvhWidth == 8 && mBvhCompressed)
+            return mBvhTraversal->occludedCompressed<8>(ray, intersector, stats);
+        if (mBvhWidth == 4)
+            return mBvhTraversal->occludedWide<4>(ray, intersector, stats);
+        if (mBvhWidth == 8)
+            return mBvhTraversal->occludedWide<8>(ray, intersector, stats);
+        if (mBvhPairNodes)
+            return mBvhTraversal->occludedWide<2>(ray, intersector, stats);
+        if (mBvhThreaded)
+            return mBvhTraversal->occludedThreaded(ray, intersector, stats);
+        return mBvhTraversal->occluded(ray, intersector, stats);
+    }
+
+    template<int N>
+    int Scene::intersectPacketN(const accel::Ray* rays, int numRays, accel::Hit* hits, accel::TraversalStats* stats)
+    {
+        auto intersector = [this](int primIdx, const accel::Ray& localRay, accel::Hit& localHit)
+        {
+            float t, u, v;
+            if (intersectTriangle(primIdx, localRay, t, u, v) && t < localHit.t && t < localRay.tMax)
+            {
+                localHit.t = t;
+                localHit.u = u;
+                localHit.v = v;
+                return true;
+            }
+            return false;
+        };
+        accel::RayPacket<N> packet;
+        accel::Hit packetHits[N];
+        for (int i = 0; i < numRays; ++i)
+        {
+            packet.setRay(i, rays[i]);
+            packetHits[i] = hits[i];
+        }
+        int foundMask = mBvhTraversal->intersectPacket<N>(packet, (1 << numRays) - 1, packetHits, intersector, stats);
+        for (int i = 0; i < numRays; ++i)
+        {
+            hits[i] = packetHits[i];
+            // Hits in the world mesh report the flattened instance
+            if (foundMask & (1 << i) && mIndices[hits[i].primIdx].objectIdx >= 0)
+                hits[i].instanceIdx = mIndices[hits[i].primIdx].objectIdx;
+        }
+        return foundMask;
+    }
+
+    template<int N>
+    int Scene::occludedPacketN(const accel::Ray* rays, int numRays, accel::TraversalStats* stats)
+    {
+        auto intersector = [this](int primIdx, const accel::Ray& localRay, accel::Hit& localHit)
+        {
+            float t, u, v;
+            return intersectTriangle(primIdx, localRay, t, u, v) && t < localRay.tMax;
+        };
+        accel::RayPacket<N> packet;
+        for (int i = 0; i < numRays; ++i)
+            packet.setRay(i, rays[i]);
+        return mBvhTraversal->occludedPacket<N>(packet, (1 << numRays) - 1, intersector, stats);
+    }
+
+    void Scene::setPacketWidth(int width)
+    {
+        int supported = width >= 16 ? 16 : (width >= 8 ? 8 : 4);
+        mPacketWidth = std::min(supported, accel::gSimdWidth);
+    }
+
+    int Scene::intersectPacket(const accel::Ray* rays, int numRays, accel::Hit* hits, accel::TraversalStats* stats)
+    {
+        assert(numRays <= mPacketWidth);
+        if (mPacketWidth == 4)
+            return intersectPacketN<4>(rays, numRays, hits, stats);
+        if (mPacketWidth == 8)
+            return intersectPacketN<8>(rays, numRays, hits, stats);
+        return intersectPacketN<16>(rays, numRays, hits, stats);
+    }
+
+    int Scene::occludedPacket(const accel::Ray* rays, int numRays, accel::TraversalStats* stats)
+    {
+        assert(numRays <= mPacketWidth);
+        if (mPacketWidth == 4)
+            return occludedPacketN<4>(rays, numRays, stats);
+        if (mPacketWidth == 8)
+            return occludedPacketN<8>(rays, numRays, stats);
+        return occludedPacketN<16>(rays, numRays, stats);
+    }
+
+    void Scene::analyzeAccelerationStructures(std::vector<accel::BvhMetrics>& blasMetrics, accel::BvhMetrics& tlasMetrics)
+    {
+        blasMetrics.clear();
+        for (int i = 0; i < mMeshs.size(); ++i)
+        {
+            blasMetrics.push_back(accel::BvhAnalyzer::analyze(mMeshs[i]->mBvh, mMeshs[i]->mVertices.data(), mMeshs[i]->mIndices.data(), getThreadPool()));
+        }
+        // The flattened TLAS also reflects refits, insertions and removals
+        const accel::Bvh::BuildSettings& settings = mBvh->getBuildSettings();
+        tlasMetrics = accel::BvhAnalyzer::analyze(&mBvhTranslator, mBvhTranslator.mTopIndex, settings.traversalCost, settings.intersectionCost);
+    }
+
+    void Scene::flattenInstances()
+    {
+        // The world mesh of a previous build is replaced, its instance slot is freed
+        if (mWorldMeshIdx >= 0)
+        {
+            for (int i = 0; i < mMeshInstances.size(); ++i)
+            {
+                if (mMeshInstances[i].meshIdx == mWorldMeshIdx)
+                {
+                    mMeshInstances[i].mesh = nullptr;
+                    mMeshInstances[i].meshIdx = -1;
+                    mFreeInstanceIds.push_back(i);
+                }
+                else if (mMeshInstances[i].meshIdx > mWorldMeshIdx)
+                {
+                    mMeshInstances[i].meshIdx--;
+                }
+            }
+            delete mMeshs[mWorldMeshIdx];
+            mMeshs.erase(mMeshs.begin() + mWorldMeshIdx);
+            mWorldMeshIdx = -1;
+        }
+        mWorldTriangleObjects.clear();
+
+        mFlattenedInstances.assign(mMeshInstances.size(), false);
+        mFlattenedMeshes.assign(mMeshs.size(), false);
+        if (mFlattenInstanceLimit <= 0)
+            return;
+
+        std::vector<int> instanceCounts(mMeshs.size(), 0);
+        for (int i = 0; i < mMeshInstances.size(); ++i)
+        {
+            if (mMeshInstances[i].mesh)
+                instanceCounts[mMeshInstances[i].meshIdx]++;
+        }
+
+        // Meshes whose instances are all flattened get no BLAS of their own and can not be
+        // instanced again until the next build
+        mFlattenedMeshes.assign(mMeshs.size(), false);
+        for (int i = 0; i < mMeshs.size(); ++i)
+        {
+            mFlattenedMeshes[i] = instanceCounts[i] > 0 && instanceCounts[i] <= mFlattenInstanceLimit;
+        }
+        Mesh* world = nullptr;
+        for (int i = 0; i < mMeshInstances.size(); ++i)
+        {
+            Mesh* mesh = mMeshInstances[i].mesh;
+            if (!mesh || instanceCounts[mMeshInstances[i].meshIdx] > mFlattenInstanceLimit)
+                continue;
+
+            if (!world)
+            {
+                world = new Mesh();
+                world->setBvhBuildSettings(mesh->mBvh->getBuildSettings());
+                world->mAlbedo = glm::vec3(0.0f);
+                world->mEmission = glm::vec3(0.0f);
+                world->mMetallic = 0.0f;
+                world->mRoughness = 0.0f;
+            }
+
+            // Normals are normalized after interpolation, so the normal matrix is applied per vertex
+            const glm::mat4& transform = mMeshInstances[i].transform;
+            glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(transform)));
+            uint32_t vertexStart = world->mVertices.size();
+            for (int j = 0; j < mesh->mVertices.size(); ++j)
+            {
+                world->mVertices.push_back(transformPoint(mesh->mVertices[j], transform));
+                world->mNormals.push_back(normalMatrix * mesh->mNormals[j]);
+                world->mUVs.push_back(mesh->mUVs[j]);
+            }
+            for (int j = 0; j < mesh->mIndices.size(); ++j)
+                world->mIndices.push_back(vertexStart + mesh->mIndices[j]);
+            mWorldTriangleObjects.insert(mWorldTriangleObjects.end(), mesh->mIndices.size() / 3, i);
+            mFlattenedInstances[i] = true;
+        }
+
+        if (!world)
+            return;
+
+        // The world mesh is owned by the scene and placed by an identity instance, materials
+        // still come from the scene objects of the flattened instances
+        addMesh(world);
+        mFlattenedMeshes.push_back(false);
+        mWorldMeshIdx = mMeshs.size() - 1;
+        MeshInstance instance;
+        instance.meshIdx = mWorldMeshIdx;
+        instance.mesh = world;
+        instance.transform = glm::mat4(1.0f);
+        if (!mFreeInstanceIds.empty())
+        {
+            mMeshInstances[mFreeInstanceIds.back()] = instance;
+            mFreeInstanceIds.pop_back();
+            return;
+        }
+        mMeshInstances.push_back(instance);
+        mFlattenedInstances.push_back(false);
     }
 
     void Scene::createTLAS()
     {
+        // Every instance starts as a reference to its BLAS root, flattened ones have none
+        mBvhReferences.clear();
         std::vector<accel::BBox> bounds;
-        bounds.resize(mMeshInstances.size());
-
         for (int i = 0; i < mMeshInstances.size(); i++)
         {
-            accel::BBox bbox = mMeshs[mMeshInstances[i].meshIdx]->mBvh->getBound();
+            if (mFlattenedInstances[i] || !mMeshInstances[i].mesh)
+                continue;
+            mBvhReferences.push_back({ i, mMeshs[mMeshInstances[i].meshIdx]->mBvh->getRoot() });
+            bounds.push_back(getInstanceBound(i));
+        }
+
+        mBraidedInstances.assign(mMeshInstances.size(), false);
+        if (mRebraidBudget > 0.0f)
+            rebraidInstances(bounds);
+
+        mBvh->setThreadPool(getThreadPool());
+        mBvh->build(bounds.data(), bounds.size());
+        mBvh->setThreadPool(nullptr);
+    }
+
+    static accel::BBox transformBound(const accel::BBox& bbox, const glm::mat4& matrix)
+    {
+        glm::vec3 minBound = bbox.mMin;
+        glm::vec3 maxBound = bbox.mMax;
 
-            glm::mat4 matrix = mMeshInstances[i].transform;
+        glm::vec3 right       = glm::vec3(matrix[0][0], matrix[0][1], matrix[0][2]);
+        glm::vec3 up          = glm::vec3(matrix[1][0], matrix[1][1], matrix[1][2]);
+        glm::vec3 forward     = glm::vec3(matrix[2][0], matrix[2][1], matrix[2][2]);
+        glm::vec3 translation = glm::vec3(matrix[3][0], matrix[3][1], matrix[3][2]);
 
-            glm::vec3 minBound = bbox.mMin;
-            glm::vec3 maxBound = bbox.mMax;
+        glm::vec3 xa = right * minBound.x;
+        glm::vec3 xb = right * maxBound.x;
 
-            glm::vec3 right       = glm::vec3(matrix[0][0], matrix[0][1], matrix[0][2]);
-            glm::vec3 up          = glm::vec3(matrix[1][0], matrix[1][1], matrix[1][2]);
-            glm::vec3 forward     = glm::vec3(matrix[2][0], matrix[2][1], matrix[2][2]);
-            glm::vec3 translation = glm::vec3(matrix[3][0], matrix[3][1], matrix[3][2]);
+        glm::vec3 ya = up * minBound.y;
+        glm::vec3 yb = up * maxBound.y;
+
+        glm::vec3 za = forward * minBound.z;
+        glm::vec3 zb = forward * maxBound.z;
+
+        minBound = glm::min(xa, xb) + glm::min(ya, yb) + glm::min(za, zb) + translation;
+        maxBound = glm::max(xa, xb) + glm::max(ya, yb) + glm::max(za, zb) + translation;
+
+        accel::BBox bound;
+        bound.mMin = minBound;
+        bound.mMax = maxBound;
+
+        return bound;
+    }
 
-            glm::vec3 xa = right * minBound.x;
-            glm::vec3 xb = right * maxBound.x;
+    accel::BBox Scene::getInstanceBound(int id)
+    {
+        Mesh* mesh = mMeshs[mMeshInstances[id].meshIdx];
+        glm::mat4 matrix = mMeshInstances[id].transform;
+        if (mesh->mBoundCut.empty())
+            return transformBound(mesh->mBvh->getBound(), matrix);
+
+        accel::BBox bound;
+        for (int i = 0; i < mesh->mBoundCut.size(); ++i)
+        {
+            bound.grow(transformBound(mesh->mBoundCut[i], matrix));
+        }
+        return bound;
+    }
+
+    static accel::BBox clipBound(const accel::BBox& bbox, const accel::BBox& clip)
+    {
+        accel::BBox bound;
+        bound.mMin = glm::max(bbox.mMin, clip.mMin);
+        bound.mMax = glm::min(bbox.mMax, clip.mMax);
+        return bound;
+    }
+
+    void Scene::rebraidInstances(std::vector<accel::BBox>& bounds)
+    {
+        // Greedily opens the reference with the largest world space box until the budget is
+        // used. A child box is clipped to its parent reference, both contain the child geometry
+        int maxReferences = mBvhReferences.size() + (int)(mRebraidBudget * mBvhReferences.size());
+        std::vector<std::pair<float, int>> queue;
+        for (int i = 0; i < mBvhReferences.size(); i++)
+        {
+            queue.push_back({ bounds[i].surfaceArea(), i });
+        }
+        std::make_heap(queue.begin(), queue.end());
 
-            glm::vec3 ya = up * minBound.y;
-            glm::vec3 yb = up * maxBound.y;
+        while (!queue.empty() && mBvhReferences.size() < maxReferences)
+        {
+            std::pop_heap(queue.begin(), queue.end());
+            int reference = queue.back().second;
+            queue.pop_back();
+
+            int instance = mBvhReferences[reference].instance;
+            accel::Bvh* bvh = mMeshs[mMeshInstances[instance].meshIdx]->mBvh;
+            const accel::Bvh::Node& node = bvh->getNode(mBvhReferences[reference].node);
+            if (node.isLeaf())
+                continue;
+
+            const glm::mat4& transform = mMeshInstances[instance].transform;
+            accel::BBox parentBound = bounds[reference];
+            mBvhReferences[reference].node = node.lc;
+            bounds[reference] = clipBound(transformBound(bvh->getNode(node.lc).bound, transform), parentBound);
+            mBvhReferences.push_back({ instance, node.rc });
+            bounds.push_back(clipBound(transformBound(bvh->getNode(node.rc).bound, transform), parentBound));
+            mBraidedInstances[instance] = true;
+
+            queue.push_back({ bounds[reference].surfaceArea(), reference });
+            std::push_heap(queue.begin(), queue.end());
+            queue.push_back({ bounds.back().surfaceArea(), (int)bounds.size() - 1 });
+            std::push_heap(queue.begin(), queue.end());
+        }
+    }
 
-            glm::vec3 za = forward * minBound.z;
-            glm::vec3 zb = forward * maxBound.z;
+    void Scene::setInstanceTransform(int id, const glm::mat4& transform)
+    {
+        assert(!mFlattenedInstances[id] && !mBraidedInstances[id]);
+        mMeshInstances[id].transform = transform;
+        mSceneObjects[id].transform = transform;
+        mDirtyInstances.push_back(id);
+    }
 
-            minBound = glm::min(xa, xb) + glm::min(ya, yb) + glm::min(za, zb) + translation;
-            maxBound = glm::max(xa, xb) + glm::max(ya, yb) + glm::max(za, zb) + translation;
+    SceneObject Scene::createSceneObject(int id)
+    {
+        Mesh* mesh = mMeshInstances[id].mesh;
+        SceneObject sceneObject;
+        sceneObject.transform = mMeshInstances[id].transform;
+        sceneObject.albedo = mesh->mAlbedo;
+        sceneObject.emission = mesh->mEmission;
+        sceneObject.matParams = glm::vec4(mesh->mMetallic, mesh->mRoughness, 0.0f, 0.0f);
+        return sceneObject;
+    }
 
-            accel::BBox bound;
-            bound.mMin = minBound;
-            bound.mMax = maxBound;
+    Scene::RefitRange Scene::refit()
+    {
+        if (mTLASChanged && mBvhTranslator.mThreaded)
+            mBvhTranslator.processMissLinks(mBvhTranslator.mTopIndex);
+        if (mTLASChanged && getWideWidth() > 0)
+            mBvhTranslator.processWideTLAS();
+        mTLASChanged = false;
+
+        // Instances moved several times are refitted once, instances removed after they were
+        // moved have nothing left to refit
+        std::sort(mDirtyInstances.begin(), mDirtyInstances.end());
+        mDirtyInstances.erase(std::unique(mDirtyInstances.begin(), mDirtyInstances.end()), mDirtyInstances.end());
+        mDirtyInstances.erase(std::remove_if(mDirtyInstances.begin(), mDirtyInstances.end(), [this](int id) { return !mMeshInstances[id].mesh; }), mDirtyInstances.end());
+        int numDirty = mDirtyInstances.size();
+        std::vector<glm::mat4> transforms(numDirty);
+        std::vector<accel::BBox> bounds(numDirty);
+        accel::parallelFor(getThreadPool(), 0, numDirty, 1024, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                transforms[i] = mMeshInstances[mDirtyInstances[i]].transform;
+                bounds[i] = getInstanceBound(mDirtyInstances[i]);
+            }
+        });
 
-            bounds[i] = bound;
+        RefitRange range;
+        range.nodes = mBvhTranslator.refit(mDirtyInstances, transforms, bounds);
+        if (numDirty > 0)
+        {
+            range.sceneObjects.first = mDirtyInstances.front();
+            range.sceneObjects.count = mDirtyInstances.back() - mDirtyInstances.front() + 1;
         }
-        mBvh->build(&bounds[0], bounds.size());
+        accel::parallelFor(getThreadPool(), 0, numDirty, 1024, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                mBvhTraversal->updateInstance(mDirtyInstances[i]);
+            }
+        });
+        mDirtyInstances.clear();
+        return range;
     }
 
     void Scene::createBLAS()
     {
+        // Meshes are built concurrently and share the pool for their subtree tasks
+        accel::ThreadPool* pool = getThreadPool();
+        accel::BvhCache* cache = mBvhCache;
+        accel::TaskGroup group(pool);
+        for (int i = 0; i < mMeshs.size(); ++i)
+        {
+            Mesh* mesh = mMeshs[i];
+            if (!mFlattenedMeshes[i])
+                group.run([mesh, pool, cache]() { mesh->buildBvh(pool, cache); });
+        }
+        group.wait();
+
         for (int i = 0; i < mMeshs.size(); ++i)
         {
-            mMeshs[i]->buildBvh();
+            mMeshs[i]->mBoundCut.clear();
+            if (mInstanceBoundDepth > 0 && !mFlattenedMeshes[i])
+                mMeshs[i]->mBvh->getBoundCut(mInstanceBoundDepth, mMeshs[i]->mBoundCut);
         }
     }
 
@@ -1,8 +1,12 @@
 #ifndef STAR_SCENE_H
 #define STAR_SCENE_H
 #include "Accelerator/Bvh.h"
+#include "Accelerator/BvhAnalyzer.h"
+#include "Accelerator/BvhCache.h"
 #include "Accelerator/BvhTranslator.h"
+#include "Accelerator/BvhTraversal.h"
 #include <glm/glm.hpp>
+#include <string>
 #include <vector>
 namespace star {
     struct Vertex {
@@ -15,7 +19,16 @@ namespace star {
         alignas(4) int idx0;
         alignas(4) int idx1;
         alignas(4) int idx2;
-        alignas(4) int padding;
+        // Instance of a triangle in the world mesh of flattened instances, -1 otherwise
+        alignas(4) int objectIdx;
+    };
+
+    // Intersection data of mIndices[i] in the optional triangle stream: the first vertex and
+    // the edges to the other two, so a leaf test reads one block per triangle
+    struct Triangle {
+        alignas(16) glm::vec3 v0;
+        alignas(16) glm::vec3 e0;
+        alignas(16) glm::vec3 e1;
     };
 
     struct SceneObject {
@@ -40,14 +53,24 @@ namespace star {
     public:
         Mesh();
         ~Mesh();
-        void buildBvh();
+        void setBvhBuildSettings(const accel::Bvh::BuildSettings& settings);
+        // Loads the Bvh from the cache if it has an entry for the vertices and settings,
+        // otherwise builds it and stores it there
+        void buildBvh(accel::ThreadPool* pool = nullptr, accel::BvhCache* cache = nullptr);
+        // Merges vertices with the same position, normal and uv and remaps mIndices, the
+        // remaining vertices keep their order
+        void weldVertices();
     private:
         friend class Scene;
         friend class Importer;
         accel::Bvh* mBvh = nullptr;
+        // Local boxes whose transforms bound an instance, see Scene::setInstanceBoundDepth
+        std::vector<accel::BBox> mBoundCut;
+        // Shared vertex attributes and three indices into them per triangle
         std::vector<glm::vec3> mVertices;
         std::vector<glm::vec3> mNormals;
         std::vector<glm::vec2> mUVs;
+        std::vector<uint32_t> mIndices;
         glm::vec3 mAlbedo;
         glm::vec3 mEmission;
         float mMetallic;
@@ -63,24 +86,139 @@ namespace star {
 
     class Scene
     {
+    public:
+        // Parts of the flattened buffers a refit changed
+        struct RefitRange
+        {
+            accel::BvhTranslator::NodeRange nodes;
+            // mSceneObjects of the moved and added instances
+            accel::BvhTranslator::NodeRange sceneObjects;
+        };
     public:
         Scene();
         ~Scene();
         void addMesh(Mesh* mesh);
-        void addMeshInstance(const MeshInstance& instance);
+        // Returns the id of the instance, which stays valid until it is removed. After
+        // createAccelerationStructures the instance is inserted into the TLAS directly, -1 is
+        // returned for meshes the build only flattened
+        int addMeshInstance(const MeshInstance& instance);
+        // Removes an instance of a built scene from the TLAS, its id may be reused
+        void removeMeshInstance(int id);
         void addLight(const Light& light);
+        void setTLASBuildSettings(const accel::Bvh::BuildSettings& settings);
+        // Threads of the pool the scene shares between all its builds and refits, zero uses all
+        // hardware threads
+        void setNumThreads(int numThreads);
+        // Caches mesh BLASes in the directory across runs, empty disables the cache
+        void setBvhCacheDirectory(const std::string& directory);
+        // 4 or 8 also collapses the BVH into wide nodes for the CPU traversal
+        void setBvhWidth(int width) { mBvhWidth = width; }
+        // Quantizes the wide nodes to 8 bit child bounds, needs a width of 4 or 8 and leaves of
+        // at most 253 primitives
+        void setBvhCompressed(bool compressed) { mBvhCompressed = compressed; }
+        // With a width of 2, stores both child boxes in the parent for the CPU and GPU traversals
+        void setBvhPairNodes(bool pairNodes) { mBvhPairNodes = pairNodes; }
+        // With the binary nodes, the CPU and GPU traversals follow their miss links without a
+        // stack. Only threaded scenes get miss links. The stackless traversals visit the children
+        // in stored order and take several times the node visits of the stack ones
+        void setBvhThreaded(bool threaded) { mBvhThreaded = threaded; mBvhTranslator.setThreaded(threaded); }
+        // Order of the BLAS nodes in the flattened buffers, see BvhTranslator::NodeLayout
+        void setBvhNodeLayout(accel::BvhTranslator::NodeLayout layout) { mBvhTranslator.setNodeLayout(layout); }
+        // Instance bounds are the union of the transformed BLAS node boxes at this depth, which
+        // stays much tighter than the transformed root box for rotated instances. Zero uses the
+        // root box only
+        void setInstanceBoundDepth(int depth) { mInstanceBoundDepth = depth; }
+        // Instances of meshes with at most this many instances are copied to world space and
+        // merged into one world BLAS, which saves their TLAS leaves and ray transforms at the
+        // cost of a mesh copy per instance. Flattened instances can not be moved or removed.
+        // Meshes with all their instances flattened get no BLAS and can not be instanced until
+        // the next build. Zero disables flattening, one only flattens meshes used once
+        void setFlattenInstanceLimit(int maxInstances) { mFlattenInstanceLimit = maxInstances; }
+        // Rebraiding builds the TLAS over the top BLAS nodes of the largest instances instead of
+        // their whole boxes, which separates overlapping instances. Up to budget * instances
+        // extra TLAS references are opened. Opened instances can not be moved or removed.
+        // Zero disables rebraiding
+        void setRebraidBudget(float budget) { mRebraidBudget = budget; }
+        // Writes mTriangles in leaf order next to mIndices. Traversal tests read it instead of
+        // the three vertices of mIndices, which are only fetched to shade the closest hit
+        void setTriangleStream(bool triangleStream) { mTriangleStream = triangleStream; }
+        // Builds the scene again from the meshes and instances when called more than once
         void createAccelerationStructures();
+        // Moves an instance of a built scene, the TLAS is updated on the next refit
+        void setInstanceTransform(int id, const glm::mat4& transform);
+        // Refits the TLAS to the moved instances without rebuilding, returns the ranges of
+        // BvhTranslator nodes and scene objects to upload. Also needed after adding or removing
+        // instances before the CPU traversal is used again
+        RefitRange refit();
+        // Whether instances were moved, added or removed since the last refit
+        bool isDirty() { return mTLASChanged || !mDirtyInstances.empty(); }
+        // CPU reference traversal over the flattened buffers, hit.primIdx indexes mIndices
+        bool intersect(const accel::Ray& ray, accel::Hit& hit, accel::TraversalStats* stats = nullptr);
+        bool occluded(const accel::Ray& ray, accel::TraversalStats* stats = nullptr);
+        // Lanes of the packet queries, 4, 8 or 16. Wider packets than the SIMD width of the build
+        // would run on scalar loops, so the width is rounded down to a supported one and clamped
+        // to accel::gSimdWidth, which is also the default
+        void setPacketWidth(int width);
+        int getPacketWidth() { return mPacketWidth; }
+        // Traces up to the packet width of coherent rays together over the binary nodes, the
+        // results match intersect and occluded ray by ray. Returns the mask of rays that hit
+        int intersectPacket(const accel::Ray* rays, int numRays, accel::Hit* hits, accel::TraversalStats* stats = nullptr);
+        int occludedPacket(const accel::Ray* rays, int numRays, accel::TraversalStats* stats = nullptr);
+        // Quality metrics of every mesh BLAS and of the flattened TLAS
+        void analyzeAccelerationStructures(std::vector<accel::BvhMetrics>& blasMetrics, accel::BvhMetrics& tlasMetrics);
+        // World space bound of the built scene
+        accel::BBox getBound() { return mBvh->getBound(); }
     private:
         int findMesh(Mesh* mesh);
+        accel::ThreadPool* getThreadPool();
+        // Width of the wide nodes the CPU traversal uses, 0 for the binary nodes
+        int getWideWidth();
+        void flattenInstances();
         void createBLAS();
         void createTLAS();
+        void rebraidInstances(std::vector<accel::BBox>& bounds);
+        accel::BBox getInstanceBound(int id);
+        bool intersectTriangle(int primIdx, const accel::Ray& ray, float& t, float& u, float& v);
+        template<int N>
+        int intersectPacketN(const accel::Ray* rays, int numRays, accel::Hit* hits, accel::TraversalStats* stats);
+        template<int N>
+        int occludedPacketN(const accel::Ray* rays, int numRays, accel::TraversalStats* stats);
+        SceneObject createSceneObject(int id);
     private:
         friend class Renderer;
+        friend class CpuRenderer;
         accel::Bvh* mBvh = nullptr;
+        accel::ThreadPool* mThreadPool = nullptr;
+        int mNumThreads = 0;
+        accel::BvhCache* mBvhCache = nullptr;
         accel::BvhTranslator mBvhTranslator;
+        accel::BvhTraversal* mBvhTraversal = nullptr;
+        int mBvhWidth = 2;
+        bool mBvhCompressed = false;
+        bool mBvhPairNodes = false;
+        bool mBvhThreaded = false;
+        int mPacketWidth = accel::gSimdWidth;
+        int mInstanceBoundDepth = 3;
+        int mFlattenInstanceLimit = 0;
+        // Mesh holding the flattened instances and the instance of each of its triangles
+        int mWorldMeshIdx = -1;
+        std::vector<int> mWorldTriangleObjects;
+        std::vector<bool> mFlattenedInstances;
+        // Meshes only used by flattened instances, their BLAS is mEmptyBvh
+        std::vector<bool> mFlattenedMeshes;
+        accel::Bvh mEmptyBvh;
+        float mRebraidBudget = 0.0f;
+        // TLAS primitives and the instances split into several of them
+        std::vector<accel::BvhReference> mBvhReferences;
+        std::vector<bool> mBraidedInstances;
         std::vector<Mesh*> mMeshs;
         std::vector<MeshInstance> mMeshInstances;
+        std::vector<int> mDirtyInstances;
+        std::vector<int> mFreeInstanceIds;
+        bool mTLASChanged = false;
+        bool mTriangleStream = false;
         std::vector<Index> mIndices;
+        std::vector<Triangle> mTriangles;
         std::vector<Vertex> mVertices;
         std::vector<SceneObject> mSceneObjects;
         std::vector<Light> mLights;
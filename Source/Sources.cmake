@@ -1,8 +1,23 @@
-set(STAR_SRC
+set(STAR_CORE_SRC
         Source/Accelerator/BBox.cpp
         Source/Accelerator/Bvh.cpp
+        Source/Accelerator/BvhAnalyzer.cpp
+        Source/Accelerator/BvhCache.cpp
+        Source/Accelerator/BvhOptimizer.cpp
         Source/Accelerator/BvhTranslator.cpp
+        Source/Accelerator/BvhTraversal.cpp
+        Source/Accelerator/ClusterBuilder.cpp
+        Source/Accelerator/LinearBuilder.cpp
+        Source/Accelerator/Morton.cpp
+        Source/Accelerator/PreSplitter.cpp
+        Source/Accelerator/SplitBuilder.cpp
+        Source/Accelerator/ThreadPool.cpp
         Source/Scene.cpp
         Source/Importer.cpp
+        Source/CpuRenderer.cpp
+)
+
+set(STAR_SRC
+        ${STAR_CORE_SRC}
         Source/Renderer.cpp
 )
\ No newline at end of file
@@ -0,0 +1,123 @@
+#include "Scene.h"
+#include "Importer.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Builds the acceleration structures of a glTF and prints their quality metrics as JSON.
+// Usage: BvhReport scene.gltf [middle|sah|linear|spatial|cluster] [optimizeIterations]
+static void printHistogram(const char* name, const std::vector<int>& histogram)
+{
+    printf("      \"%s\": [", name);
+    for (int i = 0; i < histogram.size(); ++i)
+    {
+        printf(i == 0 ? "%d" : ", %d", histogram[i]);
+    }
+    printf("]");
+}
+
+// Prints s as the body of a JSON string, quotes, backslashes and control characters escaped
+static void printJsonString(const char* s)
+{
+    for (; *s; ++s)
+    {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            printf("\\%c", c);
+        else if (c == '\n')
+            printf("\\n");
+        else if (c == '\t')
+            printf("\\t");
+        else if (c < 0x20)
+            printf("\\u%04x", c);
+        else
+            putchar(c);
+    }
+}
+
+static void printMetrics(const accel::BvhMetrics& metrics, bool last)
+{
+    printf("      \"sahCost\": %.6f,\n", metrics.sahCost);
+    if (metrics.epo >= 0.0f)
+        printf("      \"epo\": %.6f,\n", metrics.epo);
+    else
+        printf("      \"epo\": null,\n");
+    printf("      \"numNodes\": %d,\n", metrics.numNodes);
+    printf("      \"numLeaves\": %d,\n", metrics.numLeaves);
+    printf("      \"numPrimRefs\": %d,\n", metrics.numPrimRefs);
+    printf("      \"height\": %d,\n", metrics.height);
+    printf("      \"memoryBytes\": %zu,\n", metrics.memoryBytes);
+    printHistogram("leafSizeHistogram", metrics.leafSizeHistogram);
+    printf(",\n");
+    printHistogram("depthHistogram", metrics.depthHistogram);
+    printf("\n    }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s scene.gltf [middle|sah|linear|spatial|cluster] [optimizeIterations]\n", argv[0]);
+        return 1;
+    }
+
+    const char* modeNames[] = { "middle", "sah", "linear", "spatial", "cluster" };
+    accel::Bvh::BuildSettings settings;
+    const char* modeName = argc > 2 ? argv[2] : "sah";
+    int mode = 0;
+    while (mode < 5 && strcmp(modeName, modeNames[mode]) != 0)
+        mode++;
+    if (mode == 5)
+    {
+        printf("unknown build mode %s\n", modeName);
+        return 1;
+    }
+    settings.mode = (accel::Bvh::BuildMode)mode;
+    settings.optimizeIterations = argc > 3 ? atoi(argv[3]) : 0;
+
+    star::Importer importer;
+    star::ImportedResult importedResult = importer.load(argv[1]);
+    if (importedResult.meshs.empty())
+    {
+        printf("failed to load %s\n", argv[1]);
+        return 1;
+    }
+
+    star::Scene* scene = new star::Scene;
+    for (int i = 0; i < importedResult.meshs.size(); ++i)
+    {
+        importedResult.meshs[i]->setBvhBuildSettings(settings);
+        scene->addMesh(importedResult.meshs[i]);
+    }
+    for (int i = 0; i < importedResult.meshInstances.size(); ++i)
+    {
+        scene->addMeshInstance(importedResult.meshInstances[i]);
+    }
+    scene->setTLASBuildSettings(settings);
+    scene->createAccelerationStructures();
+
+    std::vector<accel::BvhMetrics> blasMetrics;
+    accel::BvhMetrics tlasMetrics;
+    scene->analyzeAccelerationStructures(blasMetrics, tlasMetrics);
+
+    printf("{\n");
+    printf("  \"scene\": \"");
+    printJsonString(argv[1]);
+    printf("\",\n");
+    printf("  \"mode\": \"%s\",\n", modeName);
+    printf("  \"optimizeIterations\": %d,\n", settings.optimizeIterations);
+    printf("  \"blas\": [\n");
+    for (int i = 0; i < blasMetrics.size(); ++i)
+    {
+        printf("    {\n");
+        printf("      \"mesh\": %d,\n", i);
+        printMetrics(blasMetrics[i], i + 1 == blasMetrics.size());
+    }
+    printf("  ],\n");
+    printf("  \"tlas\":\n    {\n");
+    printMetrics(tlasMetrics, true);
+    printf("}\n");
+
+    delete scene;
+    return 0;
+}
@@ -0,0 +1,117 @@
+#include "CpuRenderer.h"
+#include "Scene.h"
+#include "Importer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+// Scene of main.cpp over the wide nodes, or the binary ones for the check. The scene owns the
+// imported meshes, so every scene loads its own
+static star::Scene* createScene(const std::string& path, int bvhWidth, int numThreads)
+{
+    star::Importer importer;
+    star::ImportedResult importedResult = importer.load(path);
+    if (importedResult.meshs.empty())
+        return nullptr;
+
+    star::Scene* scene = new star::Scene;
+    {
+        star::Light light;
+        light.type = 1;
+        light.position = glm::vec3(0.0f, 1.9f, 0.0f);
+        light.emission = glm::vec3(30, 30, 30);
+        light.radius = 0.1f;
+        light.area = 4 * 3.1415926 * (light.radius * light.radius);
+        scene->addLight(light);
+    }
+    for (int i = 0; i < importedResult.meshs.size(); ++i)
+    {
+        scene->addMesh(importedResult.meshs[i]);
+    }
+    for (int i = 0; i < importedResult.meshInstances.size(); ++i)
+    {
+        scene->addMeshInstance(importedResult.meshInstances[i]);
+    }
+    scene->setBvhWidth(bvhWidth);
+    scene->setNumThreads(numThreads);
+    scene->createAccelerationStructures();
+    return scene;
+}
+
+// Looks along -z at the scene bound from far enough to frame it
+static star::CpuCamera frameScene(star::Scene* scene)
+{
+    accel::BBox bound = scene->getBound();
+    glm::vec3 center = (bound.mMin + bound.mMax) * 0.5f;
+    glm::vec3 extent = bound.mMax - bound.mMin;
+    star::CpuCamera camera;
+    camera.position = glm::vec3(center.x, center.y, bound.mMax.z + 0.5f * std::max(extent.x, extent.y) / std::tan(0.5f * glm::radians(45.0f)));
+    return camera;
+}
+
+// Renders a scene with the CPU reference path tracer on all cores and writes a Radiance HDR
+// image. The light is the one of main.cpp and the camera frames the scene bound.
+// Reports the sample and ray throughput.
+// With check set the image is rendered again over the binary nodes on one thread, and the tool
+// returns 1 if a pixel differs, the images must not depend on the node format or thread count.
+// Usage: CpuRender [scene.gltf] [output.hdr] [width] [height] [samples] [check]
+int main(int argc, char** argv)
+{
+    std::string path = argc > 1 ? argv[1] : "./Resources/Scenes/CornellBox.gltf";
+    std::string output = argc > 2 ? argv[2] : "CpuRender.hdr";
+    int width = argc > 3 ? atoi(argv[3]) : 640;
+    int height = argc > 4 ? atoi(argv[4]) : 640;
+    int samples = argc > 5 ? atoi(argv[5]) : 16;
+    bool check = argc > 6 && atoi(argv[6]) != 0;
+
+    // Incoherent bounces go through the SIMD wide node traversal
+    star::Scene* scene = createScene(path, accel::gSimdWidth >= 8 ? 8 : 4, 0);
+    if (!scene)
+    {
+        printf("failed to load %s\n", path.c_str());
+        return 1;
+    }
+    star::CpuRenderer renderer(scene, width, height);
+    renderer.setCamera(frameScene(scene));
+    auto start = std::chrono::steady_clock::now();
+    renderer.render(samples);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("scene: %s, %dx%d, %d spp, %u hardware threads\n", path.c_str(), width, height, samples, std::thread::hardware_concurrency());
+    printf("time: %.2f s, %.2f MSamples/s, %.2f MRays/s\n", seconds, (double)width * height * samples / seconds * 1e-6,
+           (double)renderer.getNumRays() / seconds * 1e-6);
+    if (!renderer.writeHDR(output))
+    {
+        printf("failed to write %s\n", output.c_str());
+        delete scene;
+        return 1;
+    }
+    printf("wrote %s\n", output.c_str());
+
+    bool passed = true;
+    if (check)
+    {
+        star::Scene* reference = createScene(path, 2, 1);
+        star::CpuRenderer referenceRenderer(reference, width, height);
+        referenceRenderer.setCamera(frameScene(reference));
+        referenceRenderer.render(samples);
+
+        std::vector<glm::vec3> image;
+        std::vector<glm::vec3> referenceImage;
+        renderer.getImage(image);
+        referenceRenderer.getImage(referenceImage);
+        int pixelDiffs = 0;
+        for (size_t i = 0; i < image.size(); ++i)
+        {
+            pixelDiffs += image[i] != referenceImage[i];
+        }
+        passed = pixelDiffs == 0;
+        printf("pixels differing from the binary nodes on one thread: %d\n", pixelDiffs);
+        delete reference;
+    }
+    delete scene;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,218 @@
+#include "Scene.h"
+#include "Importer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+// Traces the same rays through every BvhTranslator node layout and reports MRays/s of the
+// binary CPU traversal together with the miss rates of a simulated L1/L2 hierarchy fed with
+// the node fetches. Primary rays come from a pinhole camera in front of the scene, random rays
+// start anywhere inside it and stand in for incoherent bounces.
+// Usage: LayoutBenchmark [scene.gltf] [numRays]
+static const int gLineSize = 64;
+static const int gPageSize = 4096;
+
+// Set associative cache with LRU replacement over line addresses
+class CacheModel
+{
+public:
+    CacheModel(int size, int ways)
+        : mWays(ways), mNumSets(size / (gLineSize * ways)), mTags(mNumSets * ways, UINT64_MAX), mAges(mNumSets * ways, 0)
+    {
+    }
+
+    bool access(uint64_t line)
+    {
+        int set = line % mNumSets;
+        uint64_t* tags = &mTags[set * mWays];
+        uint64_t* ages = &mAges[set * mWays];
+        mTime++;
+        int victim = 0;
+        for (int i = 0; i < mWays; ++i)
+        {
+            if (tags[i] == line)
+            {
+                ages[i] = mTime;
+                return true;
+            }
+            if (ages[i] < ages[victim])
+                victim = i;
+        }
+        tags[victim] = line;
+        ages[victim] = mTime;
+        return false;
+    }
+private:
+    int mWays;
+    int mNumSets;
+    uint64_t mTime = 0;
+    std::vector<uint64_t> mTags;
+    std::vector<uint64_t> mAges;
+};
+
+struct LayoutResult
+{
+    double mrays = 0.0;
+    double l1MissRate = 0.0;
+    double l2MissRate = 0.0;
+    double linesPerRay = 0.0;
+    double pagesPerRay = 0.0;
+    double nodesPerRay = 0.0;
+};
+
+static std::vector<accel::Ray> primaryRays(const accel::BBox& bound, int numRays)
+{
+    // Square image looking down -z at the scene from twice its extent
+    glm::vec3 center = (bound.mMin + bound.mMax) * 0.5f;
+    glm::vec3 extent = bound.mMax - bound.mMin;
+    float size = glm::max(extent.x, extent.y);
+    glm::vec3 eye = center + glm::vec3(0.0f, 0.0f, extent.z * 0.5f + size * 1.5f);
+    int resolution = glm::max((int)std::sqrt((float)numRays), 1);
+    std::vector<accel::Ray> rays;
+    for (int y = 0; y < resolution; ++y)
+    {
+        for (int x = 0; x < resolution; ++x)
+        {
+            glm::vec3 target = center + glm::vec3(((x + 0.5f) / resolution - 0.5f) * size, (0.5f - (y + 0.5f) / resolution) * size, extent.z * 0.5f);
+            accel::Ray ray;
+            ray.origin = eye;
+            ray.direction = glm::normalize(target - eye);
+            rays.push_back(ray);
+        }
+    }
+    return rays;
+}
+
+static std::vector<accel::Ray> randomRays(const accel::BBox& bound, int numRays)
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::vector<accel::Ray> rays(numRays);
+    for (int i = 0; i < numRays; ++i)
+    {
+        glm::vec3 t = glm::vec3(uniform(rng), uniform(rng), uniform(rng));
+        glm::vec3 direction;
+        do
+        {
+            direction = glm::vec3(uniform(rng), uniform(rng), uniform(rng)) * 2.0f - 1.0f;
+        } while (glm::dot(direction, direction) > 1.0f || glm::dot(direction, direction) < 1e-4f);
+        rays[i].origin = bound.mMin + (bound.mMax - bound.mMin) * t;
+        rays[i].direction = glm::normalize(direction);
+    }
+    return rays;
+}
+
+static LayoutResult measure(star::Scene* scene, const std::vector<accel::Ray>& rays)
+{
+    LayoutResult result;
+
+    // Best of three single threaded runs
+    double bestSeconds = 1e30;
+    for (int run = 0; run < 3; ++run)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < rays.size(); ++i)
+        {
+            accel::Hit hit;
+            scene->intersect(rays[i], hit);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        bestSeconds = glm::min(bestSeconds, seconds);
+    }
+    result.mrays = rays.size() / bestSeconds * 1e-6;
+
+    // 32 KB 8 way L1 and 1 MB 16 way L2, the state carries over from ray to ray like on one core
+    CacheModel l1(32 * 1024, 8);
+    CacheModel l2(1024 * 1024, 16);
+    uint64_t numFetches = 0;
+    uint64_t l1Misses = 0;
+    uint64_t l2Misses = 0;
+    uint64_t numLines = 0;
+    uint64_t numPages = 0;
+    std::vector<const void*> fetches;
+    std::vector<uint64_t> lines;
+    std::vector<uint64_t> pages;
+    accel::TraversalStats stats;
+    stats.nodeFetches = &fetches;
+    for (int i = 0; i < rays.size(); ++i)
+    {
+        fetches.clear();
+        accel::Hit hit;
+        scene->intersect(rays[i], hit, &stats);
+
+        lines.clear();
+        pages.clear();
+        for (int j = 0; j < fetches.size(); ++j)
+        {
+            uint64_t address = (uint64_t)(uintptr_t)fetches[j];
+            uint64_t line = address / gLineSize;
+            numFetches++;
+            if (!l1.access(line))
+            {
+                l1Misses++;
+                if (!l2.access(line))
+                    l2Misses++;
+            }
+            lines.push_back(line);
+            pages.push_back(address / gPageSize);
+        }
+        std::sort(lines.begin(), lines.end());
+        std::sort(pages.begin(), pages.end());
+        numLines += std::unique(lines.begin(), lines.end()) - lines.begin();
+        numPages += std::unique(pages.begin(), pages.end()) - pages.begin();
+    }
+
+    result.l1MissRate = numFetches > 0 ? (double)l1Misses / numFetches : 0.0;
+    result.l2MissRate = l1Misses > 0 ? (double)l2Misses / l1Misses : 0.0;
+    result.linesPerRay = (double)numLines / rays.size();
+    result.pagesPerRay = (double)numPages / rays.size();
+    result.nodesPerRay = (double)stats.nodeVisits / rays.size();
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    std::string path = argc > 1 ? argv[1] : "./Resources/Scenes/CornellBox.gltf";
+    int numRays = argc > 2 ? atoi(argv[2]) : 1 << 18;
+
+    const char* layoutNames[] = { "depthfirst", "siblings", "treelet", "probability" };
+    printf("scene: %s, rays: %d\n", path.c_str(), numRays);
+    printf("%-12s %-8s %10s %10s %10s %10s %10s %10s\n", "layout", "rays", "MRays/s", "nodes/ray", "lines/ray", "pages/ray", "L1 miss", "L2 miss");
+    for (int layout = 0; layout < 4; ++layout)
+    {
+        // Meshes are owned by the scene, so every layout imports them again
+        star::Importer importer;
+        star::ImportedResult importedResult = importer.load(path);
+        if (importedResult.meshs.empty())
+        {
+            printf("failed to load %s\n", path.c_str());
+            return 1;
+        }
+
+        star::Scene* scene = new star::Scene;
+        for (int i = 0; i < importedResult.meshs.size(); ++i)
+        {
+            scene->addMesh(importedResult.meshs[i]);
+        }
+        for (int i = 0; i < importedResult.meshInstances.size(); ++i)
+        {
+            scene->addMeshInstance(importedResult.meshInstances[i]);
+        }
+        scene->setBvhNodeLayout((accel::BvhTranslator::NodeLayout)layout);
+        scene->createAccelerationStructures();
+
+        const char* rayNames[] = { "primary", "random" };
+        std::vector<accel::Ray> rays[2] = { primaryRays(scene->getBound(), numRays), randomRays(scene->getBound(), numRays) };
+        for (int i = 0; i < 2; ++i)
+        {
+            LayoutResult result = measure(scene, rays[i]);
+            printf("%-12s %-8s %10.2f %10.1f %10.1f %10.2f %9.2f%% %9.2f%%\n", layoutNames[layout], rayNames[i], result.mrays, result.nodesPerRay,
+                result.linesPerRay, result.pagesPerRay, result.l1MissRate * 100.0, result.l2MissRate * 100.0);
+        }
+        delete scene;
+    }
+    return 0;
+}
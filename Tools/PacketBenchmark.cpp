@@ -0,0 +1,170 @@
+#include "Scene.h"
+#include "Importer.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+// Traces the primary rays of a camera framing the scene and the shadow rays from their hits to
+// a point below the top of the scene bound, one ray at a time and in packets of 4 lanes up to
+// the SIMD width of the build.
+// Rays are ordered in 4x4 pixel blocks so that every packet covers a compact tile. Reports the
+// single threaded MRays/s, the speedup over single rays and the rays whose results differ.
+// Returns 1 if a packet width disagrees with the single ray traversal.
+// Usage: PacketBenchmark [scene.gltf] [width] [height]
+template<typename Func>
+static double measure(int repeats, Func func)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; ++r)
+        func();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / repeats;
+}
+
+int main(int argc, char** argv)
+{
+    std::string path = argc > 1 ? argv[1] : "./Resources/Scenes/CornellBox.gltf";
+    int width = argc > 2 ? atoi(argv[2]) : 512;
+    int height = argc > 3 ? atoi(argv[3]) : 512;
+
+    star::Importer importer;
+    star::ImportedResult importedResult = importer.load(path);
+    if (importedResult.meshs.empty())
+    {
+        printf("failed to load %s\n", path.c_str());
+        return 1;
+    }
+    star::Scene* scene = new star::Scene;
+    for (int i = 0; i < importedResult.meshs.size(); ++i)
+    {
+        scene->addMesh(importedResult.meshs[i]);
+    }
+    for (int i = 0; i < importedResult.meshInstances.size(); ++i)
+    {
+        scene->addMeshInstance(importedResult.meshInstances[i]);
+    }
+    scene->createAccelerationStructures();
+
+    accel::BBox bound = scene->getBound();
+    glm::vec3 center = (bound.mMin + bound.mMax) * 0.5f;
+    glm::vec3 extent = bound.mMax - bound.mMin;
+    glm::vec3 cameraPosition = glm::vec3(center.x, center.y, bound.mMax.z + 0.5f * std::max(extent.x, extent.y) / std::tan(0.5f * glm::radians(45.0f)));
+    glm::vec3 lightPosition = glm::vec3(center.x, bound.mMax.y - 0.05f * extent.y, center.z);
+
+    // Pixel centers, the 16 rays of a block are in Morton order so its first 4 and 8 rays are
+    // 2x2 and 4x2 tiles
+    std::vector<accel::Ray> primaryRays;
+    float angle = std::tan(0.5f * glm::radians(45.0f));
+    float aspectRatio = (float)width / (float)height;
+    for (int by = 0; by < height; by += 4)
+    {
+        for (int bx = 0; bx < width; bx += 4)
+        {
+            for (int i = 0; i < 16; ++i)
+            {
+                int x = bx + (i & 1) + ((i >> 1) & 2);
+                int y = by + ((i >> 1) & 1) + ((i >> 2) & 2);
+                if (x >= width || y >= height)
+                    continue;
+                float px = (2.0f * ((x + 0.5f) / width) - 1.0f) * angle * aspectRatio;
+                float py = (1.0f - 2.0f * ((y + 0.5f) / height)) * angle;
+                accel::Ray ray;
+                ray.origin = cameraPosition;
+                ray.direction = glm::normalize(glm::vec3(px, py, -1.0f));
+                primaryRays.push_back(ray);
+            }
+        }
+    }
+
+    std::vector<accel::Hit> primaryHits(primaryRays.size());
+    for (int i = 0; i < primaryRays.size(); ++i)
+        scene->intersect(primaryRays[i], primaryHits[i]);
+    std::vector<accel::Ray> shadowRays;
+    for (int i = 0; i < primaryRays.size(); ++i)
+    {
+        if (primaryHits[i].primIdx < 0)
+            continue;
+        glm::vec3 position = primaryRays[i].origin + primaryRays[i].direction * primaryHits[i].t;
+        glm::vec3 toLight = lightPosition - position;
+        float distance = glm::length(toLight);
+        accel::Ray ray;
+        ray.direction = toLight / distance;
+        ray.origin = position + ray.direction * 1e-3f * glm::length(extent);
+        ray.tMax = distance * 0.999f;
+        shadowRays.push_back(ray);
+    }
+    std::vector<bool> shadowOccluded(shadowRays.size());
+    for (int i = 0; i < shadowRays.size(); ++i)
+        shadowOccluded[i] = scene->occluded(shadowRays[i]);
+
+    int numPrimary = primaryRays.size();
+    int numShadow = shadowRays.size();
+    int repeats = std::max(1, 2000000 / (numPrimary + numShadow));
+    std::vector<accel::Hit> hits(numPrimary);
+    double primarySeconds = measure(repeats, [&]()
+    {
+        for (int i = 0; i < numPrimary; ++i)
+        {
+            hits[i] = accel::Hit();
+            scene->intersect(primaryRays[i], hits[i]);
+        }
+    });
+    int numOccluded = 0;
+    double shadowSeconds = measure(repeats, [&]()
+    {
+        numOccluded = 0;
+        for (int i = 0; i < numShadow; ++i)
+            numOccluded += scene->occluded(shadowRays[i]) ? 1 : 0;
+    });
+
+    printf("scene: %s, %dx%d, primary rays: %d, shadow rays: %d (%d occluded)\n", path.c_str(), width, height, numPrimary, numShadow, numOccluded);
+    printf("%-8s %12s %10s %12s %10s %10s %10s\n", "lanes", "primary", "speedup", "shadow", "speedup", "hit diff", "occl diff");
+    printf("%-8s %12.2f %10s %12.2f %10s %10s %10s\n", "1", numPrimary / primarySeconds * 1e-6, "1.00", numShadow / shadowSeconds * 1e-6, "1.00", "-", "-");
+
+    bool passed = true;
+    for (int width = 4; width <= accel::gSimdWidth; width *= 2)
+    {
+        scene->setPacketWidth(width);
+        double packetPrimarySeconds = measure(repeats, [&]()
+        {
+            for (int i = 0; i < numPrimary; i += width)
+            {
+                int count = std::min(width, numPrimary - i);
+                for (int j = 0; j < count; ++j)
+                    hits[i + j] = accel::Hit();
+                scene->intersectPacket(&primaryRays[i], count, &hits[i]);
+            }
+        });
+        std::vector<bool> occluded(numShadow);
+        double packetShadowSeconds = measure(repeats, [&]()
+        {
+            for (int i = 0; i < numShadow; i += width)
+            {
+                int count = std::min(width, numShadow - i);
+                int mask = scene->occludedPacket(&shadowRays[i], count);
+                for (int j = 0; j < count; ++j)
+                    occluded[i + j] = (mask & (1 << j)) != 0;
+            }
+        });
+
+        int hitDiff = 0;
+        for (int i = 0; i < numPrimary; ++i)
+        {
+            if (hits[i].primIdx != primaryHits[i].primIdx || hits[i].t != primaryHits[i].t)
+                hitDiff++;
+        }
+        int occludedDiff = 0;
+        for (int i = 0; i < numShadow; ++i)
+        {
+            if (occluded[i] != shadowOccluded[i])
+                occludedDiff++;
+        }
+        passed = passed && hitDiff == 0 && occludedDiff == 0;
+        printf("%-8d %12.2f %10.2f %12.2f %10.2f %10d %10d\n", width, numPrimary / packetPrimarySeconds * 1e-6, primarySeconds / packetPrimarySeconds,
+               numShadow / packetShadowSeconds * 1e-6, shadowSeconds / packetShadowSeconds, hitDiff, occludedDiff);
+    }
+    printf(passed ? "all packet widths agree\n" : "packet widths disagree\n");
+    delete scene;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,117 @@
+#include "Scene.h"
+#include "Importer.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <glm/gtx/transform.hpp>
+
+// Scatters the meshes of a glTF over a large number of instances, then times removing and
+// inserting instances on the built TLAS against the initial build. Also fills a scene built
+// without instances by insertions only.
+// Usage: TLASBenchmark [scene.gltf] [numInstances] [numUpdates]
+static glm::mat4 randomTransform(std::mt19937& rng)
+{
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    glm::vec3 translation = glm::vec3(uniform(rng), uniform(rng), uniform(rng)) * 2000.0f - 1000.0f;
+    glm::vec3 axis = glm::vec3(uniform(rng), uniform(rng), uniform(rng)) - 0.5f;
+    return glm::translate(translation) * glm::rotate(uniform(rng) * 6.28f, axis);
+}
+
+static double elapsedMs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv)
+{
+    std::string path = argc > 1 ? argv[1] : "./Resources/Scenes/CornellBox.gltf";
+    int numInstances = argc > 2 ? atoi(argv[2]) : 1000000;
+    int numUpdates = argc > 3 ? atoi(argv[3]) : 10000;
+
+    star::Importer importer;
+    star::ImportedResult importedResult = importer.load(path);
+    if (importedResult.meshs.empty())
+    {
+        printf("failed to load %s\n", path.c_str());
+        return 1;
+    }
+
+    std::mt19937 rng(1);
+    star::Scene* scene = new star::Scene;
+    for (int i = 0; i < importedResult.meshs.size(); ++i)
+    {
+        scene->addMesh(importedResult.meshs[i]);
+    }
+    std::vector<int> ids;
+    for (int i = 0; i < numInstances; ++i)
+    {
+        star::MeshInstance instance;
+        instance.mesh = importedResult.meshs[i % importedResult.meshs.size()];
+        instance.transform = randomTransform(rng);
+        ids.push_back(scene->addMeshInstance(instance));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    scene->createAccelerationStructures();
+    double buildMs = elapsedMs(start);
+
+    // Remove random instances, then insert the same number of new ones
+    std::shuffle(ids.begin(), ids.end(), rng);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < numUpdates; ++i)
+    {
+        scene->removeMeshInstance(ids[i]);
+    }
+    accel::BvhTranslator::NodeRange removeRange = scene->refit().nodes;
+    double removeMs = elapsedMs(start);
+
+    std::vector<star::MeshInstance> inserted(numUpdates);
+    for (int i = 0; i < numUpdates; ++i)
+    {
+        inserted[i].mesh = importedResult.meshs[i % importedResult.meshs.size()];
+        inserted[i].transform = randomTransform(rng);
+    }
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < numUpdates; ++i)
+    {
+        scene->addMeshInstance(inserted[i]);
+    }
+    accel::BvhTranslator::NodeRange insertRange = scene->refit().nodes;
+    double insertMs = elapsedMs(start);
+
+    // The TLAS of a scene without instances is an empty root that the first insertion replaces
+    star::ImportedResult emptyResult = importer.load(path);
+    star::Scene* emptyScene = new star::Scene;
+    for (int i = 0; i < emptyResult.meshs.size(); ++i)
+    {
+        emptyScene->addMesh(emptyResult.meshs[i]);
+    }
+    emptyScene->createAccelerationStructures();
+    accel::Ray ray;
+    ray.origin = glm::vec3(0.0f);
+    ray.direction = glm::vec3(0.0f, 0.0f, 1.0f);
+    accel::Hit hit;
+    bool emptyHit = emptyScene->intersect(ray, hit);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < numUpdates; ++i)
+    {
+        star::MeshInstance instance = inserted[i];
+        instance.mesh = emptyResult.meshs[i % emptyResult.meshs.size()];
+        emptyScene->addMeshInstance(instance);
+    }
+    accel::BvhTranslator::NodeRange fillRange = emptyScene->refit().nodes;
+    double fillMs = elapsedMs(start);
+
+    printf("instances: %d, updates: %d\n", numInstances, numUpdates);
+    printf("full build: %.2f ms\n", buildMs);
+    printf("remove: %.2f ms (%.3f us per instance), dirty nodes %d\n", removeMs, removeMs * 1000.0 / numUpdates, removeRange.count);
+    printf("insert: %.2f ms (%.3f us per instance), dirty nodes %d\n", insertMs, insertMs * 1000.0 / numUpdates, insertRange.count);
+    printf("insert into empty: %.2f ms (%.3f us per instance), dirty nodes %d, empty scene %s\n", fillMs, fillMs * 1000.0 / numUpdates, fillRange.count,
+           emptyHit ? "hit" : "missed");
+
+    delete emptyScene;
+    delete scene;
+    return 0;
+}
@@ -0,0 +1,177 @@
+#include "Scene.h"
+#include "Importer.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+
+// Traces the same rays through every node format of BvhTranslator, and the binary nodes over
+// the triangle stream, and compares closest hits and occlusion against the binary nodes. Also reports the node fetches and bytes read per ray
+// and the single threaded closest hit rate.
+// Returns 1 if any format disagrees with the binary nodes. A format name checks only that format.
+// Usage: TraversalCheck [scene.gltf] [numRays] [format]
+struct Format
+{
+    const char* name;
+    int width;
+    bool pairNodes;
+    bool compressed;
+    bool threaded;
+    bool triangleStream;
+    size_t nodeSize;
+};
+
+struct TraceResult
+{
+    std::vector<accel::Hit> hits;
+    std::vector<bool> occluded;
+    double fetchesPerRay = 0.0;
+    double nodesPerRay = 0.0;
+    double mraysPerSecond = 0.0;
+};
+
+static std::vector<accel::Ray> randomRays(const accel::BBox& bound, int numRays)
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::vector<accel::Ray> rays(numRays);
+    glm::vec3 extent = bound.mMax - bound.mMin;
+    for (int i = 0; i < numRays; ++i)
+    {
+        glm::vec3 direction;
+        do
+        {
+            direction = glm::vec3(uniform(rng), uniform(rng), uniform(rng)) * 2.0f - 1.0f;
+        } while (glm::dot(direction, direction) > 1.0f || glm::dot(direction, direction) < 1e-4f);
+        rays[i].origin = bound.mMin + extent * glm::vec3(uniform(rng), uniform(rng), uniform(rng));
+        rays[i].direction = glm::normalize(direction);
+        // Occlusion queries use a finite segment so that both answers show up
+        rays[i].tMax = glm::length(extent) * uniform(rng) * 0.5f;
+    }
+    return rays;
+}
+
+static bool trace(const std::string& path, const Format& format, int numRays, TraceResult& result)
+{
+    star::Importer importer;
+    star::ImportedResult importedResult = importer.load(path);
+    if (importedResult.meshs.empty())
+        return false;
+
+    star::Scene* scene = new star::Scene;
+    for (int i = 0; i < importedResult.meshs.size(); ++i)
+    {
+        scene->addMesh(importedResult.meshs[i]);
+    }
+    for (int i = 0; i < importedResult.meshInstances.size(); ++i)
+    {
+        scene->addMeshInstance(importedResult.meshInstances[i]);
+    }
+    scene->setBvhWidth(format.width);
+    scene->setBvhPairNodes(format.pairNodes);
+    scene->setBvhCompressed(format.compressed);
+    scene->setBvhThreaded(format.threaded);
+    scene->setTriangleStream(format.triangleStream);
+    scene->createAccelerationStructures();
+
+    std::vector<accel::Ray> rays = randomRays(scene->getBound(), numRays);
+    std::vector<const void*> fetches;
+    accel::TraversalStats stats;
+    stats.nodeFetches = &fetches;
+    result.hits.resize(numRays);
+    result.occluded.resize(numRays);
+    for (int i = 0; i < numRays; ++i)
+    {
+        accel::Ray ray = rays[i];
+        result.occluded[i] = scene->occluded(ray);
+        ray.tMax = std::numeric_limits<float>::max();
+        scene->intersect(ray, result.hits[i], &stats);
+    }
+    result.fetchesPerRay = (double)fetches.size() / numRays;
+    result.nodesPerRay = (double)stats.nodeVisits / numRays;
+
+    // Timed again without stats, recording the fetches dominates otherwise
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < numRays; ++i)
+    {
+        accel::Ray ray = rays[i];
+        ray.tMax = std::numeric_limits<float>::max();
+        accel::Hit hit;
+        scene->intersect(ray, hit);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.mraysPerSecond = numRays / seconds * 1e-6;
+
+    delete scene;
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    std::string path = argc > 1 ? argv[1] : "./Resources/Scenes/CornellBox.gltf";
+    int numRays = argc > 2 ? atoi(argv[2]) : 100000;
+    std::string only = argc > 3 ? argv[3] : "";
+
+    const Format formats[] = {
+        { "binary", 2, false, false, false, false, sizeof(accel::BvhTranslator::Node) },
+        { "threaded", 2, false, false, true, false, sizeof(accel::BvhTranslator::Node) },
+        { "triangles", 2, false, false, false, true, sizeof(accel::BvhTranslator::Node) },
+        { "pair", 2, true, false, false, false, sizeof(accel::BvhTranslator::WideNode<2>) },
+        { "wide4", 4, false, false, false, false, sizeof(accel::BvhTranslator::WideNode<4>) },
+        { "wide8", 8, false, false, false, false, sizeof(accel::BvhTranslator::WideNode<8>) },
+        { "compressed4", 4, false, true, false, false, sizeof(accel::BvhTranslator::CompressedNode<4>) },
+        { "compressed8", 8, false, true, false, false, sizeof(accel::BvhTranslator::CompressedNode<8>) },
+    };
+
+    bool known = only.empty();
+    for (int f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f)
+    {
+        known = known || only == formats[f].name;
+    }
+    if (!known)
+    {
+        printf("unknown format %s\n", only.c_str());
+        return 1;
+    }
+
+    TraceResult reference;
+    if (!trace(path, formats[0], numRays, reference))
+    {
+        printf("failed to load %s\n", path.c_str());
+        return 1;
+    }
+
+    printf("scene: %s, rays: %d\n", path.c_str(), numRays);
+    printf("%-12s %10s %10s %10s %10s %10s %10s %10s\n", "format", "node size", "nodes/ray", "fetch/ray", "bytes/ray", "MRays/s", "hit diff", "occl diff");
+    bool passed = true;
+    for (int f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f)
+    {
+        if (f > 0 && !only.empty() && only != formats[f].name)
+            continue;
+        TraceResult result;
+        if (f == 0)
+            result = reference;
+        else
+            trace(path, formats[f], numRays, result);
+
+        // Quantized boxes are conservative, so the hits are still exact
+        int hitDiffs = 0;
+        int occludedDiffs = 0;
+        for (int i = 0; i < numRays; ++i)
+        {
+            const accel::Hit& a = reference.hits[i];
+            const accel::Hit& b = result.hits[i];
+            bool sameHit = (a.primIdx < 0) == (b.primIdx < 0);
+            if (sameHit && a.primIdx >= 0)
+                sameHit = std::fabs(a.t - b.t) <= 1e-4f * glm::max(1.0f, a.t) && a.instanceIdx == b.instanceIdx;
+            hitDiffs += !sameHit;
+            occludedDiffs += reference.occluded[i] != result.occluded[i];
+        }
+        passed = passed && hitDiffs == 0 && occludedDiffs == 0;
+        printf("%-12s %10zu %10.1f %10.1f %10.0f %10.2f %10d %10d\n", formats[f].name, formats[f].nodeSize, result.nodesPerRay, result.fetchesPerRay,
+            result.fetchesPerRay * formats[f].nodeSize, result.mraysPerSecond, hitDiffs, occludedDiffs);
+    }
+    printf(passed ? "all formats agree\n" : "formats disagree\n");
+    return passed ? 0 : 1;
+}